@@ -48,10 +48,48 @@ const char *ast_subtype_name(ast *a) {
 // Constructors
 // -----------------------------------------------------------------------------
 
+// Each thread counts the nodes that it allocates, in a counter found
+// through a key, as C99 has no thread-local variables
+static pthread_key_t  nodes_key;
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+
+static void make_nodes_key(void) {
+  if (pthread_key_create(&nodes_key, free)) PANIC("failed to create a key");
+}
+
+static size_t *nodes_allocated(void) {
+  pthread_once(&nodes_once, make_nodes_key);
+  return thread_block(nodes_key, sizeof(size_t));
+}
+
+size_t ast_node_count(void) {
+  return *nodes_allocated();
+}
+
+// The arena, if any, that a thread's nodes come from, found through
+// another key.  The thread does not own it, so there is no destructor.
+static pthread_key_t  arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void make_arena_key(void) {
+  if (pthread_key_create(&arena_key, NULL)) PANIC("failed to create a key");
+}
+
+static arena *node_arena(void) {
+  pthread_once(&arena_once, make_arena_key);
+  return pthread_getspecific(arena_key);
+}
+
+void ast_use_arena(arena *a) {
+  pthread_once(&arena_once, make_arena_key);
+  if (pthread_setspecific(arena_key, a)) PANIC("failed to set thread data");
+}
+
 // Low-level constructor, populates only the common fields
 ast *new_ast(enum ast_type type, const char *start) {
-  // Could replace with bump allocator if performance becomes an issue
-  ast *e = xmalloc(sizeof(ast));
+  if (PARSER_STATS) (*nodes_allocated())++;
+  arena *a = node_arena();
+  ast *e = a ? arena_alloc(a, sizeof(ast)) : xmalloc(sizeof(ast));
   if (!e) PANIC_NULL();
   e->type = type;
   e->subtype = -1;		// Uninitialized
@@ -86,7 +124,11 @@ ast *ast_error(enum error_type type,
   e->error = deets;
   deets->type = type;
   deets->input = input;
+  deets->end = NULL;
   deets->msg = msg ? strndup(msg, MAX_MSGLEN) : NULL;
+  deets->line = 0;
+  deets->col = 0;
+  deets->line_start = NULL;
   return e;
 }
 
@@ -97,10 +139,12 @@ ast *ast_error_tok(enum error_type type,
   return ast_error(type, input, tok.start + tok.pos, NULL);
 }
 
-// Number may be syntactically correct but not representable in an i64
+// Number may be syntactically correct but not representable in an
+// i64.  The lexer has already checked that, and flagged the token.
 ast *ast_integer(const char *input, token tok) {
   int64_t n;
-  if (!interpret_int(tok.start, tok.len, &n))
+  if ((tok.flags & TOKEN_FLAG_INTRANGE)
+      || !interpret_int(tok.start, tok.len, &n))
     return ast_error_tok(ERR_INTRANGE, input, tok);
   ast *e = new_ast(AST_INTEGER, tok.start);
   e->n = n;
@@ -111,48 +155,155 @@ ast *ast_integer(const char *input, token tok) {
 // its length is always at least 2.  We strip these off and unescape
 // when we create the AST_STRING.
 //
+// The lexer has already found the closing quote, which is the last
+// byte of the token.  It also tells us when there is nothing to
+// unescape, so that the contents can simply be copied.
+//
 // ASCII-only, for now.
 //
 ast *ast_string(const char *input, token tok) {
   if (tok.type != TOKEN_STRING) PANIC("Not a string token");
-
-  const char *err;
-  char *str = unescape(tok.start + 1, token_length(tok), quotep, &err);
-
-  if (str) {
-    assert(quotep(err));
-    assert(err == tok.start + tok.len - 1);
-    ast *e = new_ast(AST_STRING, tok.start);
-    e->str = str;
-    return e;
+  size_t len = token_length(tok);
+  assert((len >= 2) && quotep(tok.start + len - 1));
+
+  char *str;
+  if (tok.flags & TOKEN_FLAG_NOESCAPES) {
+    str = xmalloc(len - 1);
+    if (!str) PANIC_OOM();
+    memcpy(str, tok.start + 1, len - 2);
+    str[len - 2] = '\0';
+  } else {
+    const char *err;
+    str = unescape_string(tok.start + 1, len - 2, &err);
+    if (!str) {
+      assert(*err == ESC);
+      return ast_error_tok(ERR_STRESC, input, tok);
+    }
   }
+  ast *e = new_ast(AST_STRING, tok.start);
+  e->str = str;
+  return e;
+}
 
-  if (!err)
-    return ast_error_tok(ERR_STRLEN, input, tok);
+// -----------------------------------------------------------------------------
+// Symbol table
+// -----------------------------------------------------------------------------
 
-  if (*err == ESC) {
-    ssize_t pos = err - tok.start;
-    assert((pos >= 0) && (pos <= UINT16_MAX));
-    return ast_error_tok(ERR_STRESC, input, tok);
+/*
+
+  Identifiers are interned: every AST_IDENTIFIER with the same name
+  points to the same string, owned by a symbol table, so that two
+  identifiers from one table are equal exactly when their pointers
+  are.  A name that has been seen before costs no allocation.
+
+  The table is open addressing with linear probing, keyed on the
+  bytes of the name, and is kept at most half full.  It belongs to
+  the caller, who passes it to the parser, e.g. one table for a batch
+  of programs, or for the life of an edited source.  The names live
+  until free_symtab(), which must come after the ASTs that use them
+  have been freed.  A table is not locked, so threads that parse at
+  the same time each need their own.  Names from different tables
+  are different strings, so ast_equal() is only for trees that share
+  a table, and ast_equal_across() compares the bytes of the names.
+  A table made by new_symtab_in() keeps its names in an arena instead,
+  where they stay until the arena is reset, after free_symtab().
+
+*/
+
+typedef struct symbol {
+  char    *name;			// NULL for an empty slot
+  uint32_t hash;
+  uint32_t len;
+} symbol;
+
+struct symtab {
+  symbol *slots;
+  size_t  count;
+  size_t  capacity;			// power of 2
+  arena  *names;			// NULL when each name is malloc'd
+};
+
+#define SYMTAB_MIN_CAPACITY 256
+
+symtab *new_symtab_in(arena *names) {
+  symtab *st = xmalloc(sizeof(symtab));
+  if (!st) PANIC_OOM();
+  *st = (symtab) {.capacity = SYMTAB_MIN_CAPACITY, .names = names};
+  st->slots = calloc(st->capacity, sizeof(symbol));
+  if (!st->slots) PANIC_OOM();
+  return st;
+}
+
+symtab *new_symtab(void) {
+  return new_symtab_in(NULL);
+}
+
+void free_symtab(symtab *st) {
+  if (!st) return;
+  if (!st->names)
+    for (size_t i = 0; i < st->capacity; i++) free(st->slots[i].name);
+  free(st->slots);
+  free(st);
+}
+
+size_t symtab_count(symtab *st) {
+  if (!st) PANIC_NULL();
+  return st->count;
+}
+
+// FNV-1a
+static uint32_t symbol_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t) name[i];
+    h *= 16777619u;
   }
-
-  // The lexer should have caught this
-  if (*err == '\0') PANIC("unexpected eof");
-
-  PANIC("unhandled situation");
+  return h;
+}
+
+static void symtab_grow(symtab *st) {
+  size_t capacity = 2 * st->capacity;
+  symbol *slots = calloc(capacity, sizeof(symbol));
+  if (!slots) PANIC_OOM();
+  for (size_t i = 0; i < st->capacity; i++) {
+    if (!st->slots[i].name) continue;
+    size_t j = st->slots[i].hash & (capacity - 1);
+    while (slots[j].name) j = (j + 1) & (capacity - 1);
+    slots[j] = st->slots[i];
+  }
+  free(st->slots);
+  st->slots = slots;
+  st->capacity = capacity;
+}
+
+// Returns the one copy in 'st' of the 'len' bytes at 'name', as a C
+// string
+char *intern(symtab *st, const char *name, size_t len) {
+  if (!st || !name) PANIC_NULL();
+  if (len > UINT32_MAX) PANIC("symbol too long (%zu bytes)", len);
+  if (2 * (st->count + 1) > st->capacity) symtab_grow(st);
+  uint32_t h = symbol_hash(name, len);
+  size_t mask = st->capacity - 1;
+  size_t j = h & mask;
+  for (; st->slots[j].name; j = (j + 1) & mask)
+    if ((st->slots[j].hash == h) && (st->slots[j].len == len)
+	&& (memcmp(st->slots[j].name, name, len) == 0))
+      return st->slots[j].name;
+  char *str = st->names ? arena_alloc(st->names, len + 1) : xmalloc(len + 1);
+  if (!str) PANIC_OOM();
+  memcpy(str, name, len);
+  str[len] = '\0';
+  st->slots[j] = (symbol) {.name = str, .hash = h, .len = (uint32_t) len};
+  st->count++;
+  return str;
 }
 
-ast *ast_identifier(token tok) {
+ast *ast_identifier(symtab *st, token tok) {
   size_t len = token_length(tok);
   if (!tok.start || (len == 0))
     PANIC("Invalid contents of identifier token");
-  ast *e;
-  char *str = xmalloc(len + 1);
-  if (!str) PANIC_OOM();
-  memcpy(str, tok.start, len);
-  str[len] = '\0';
-  e = new_ast(AST_IDENTIFIER, tok.start);
-  e->str = str;
+  ast *e = new_ast(AST_IDENTIFIER, tok.start);
+  e->str = intern(st, tok.start, len);
   return e;
 }
 
@@ -354,7 +505,9 @@ bool ast_proper_listp(ast *obj) {
 
 }
 
-void free_ast(ast *e) {
+// When 'nodes' is false, the nodes belong to an arena, and only what
+// they own is freed
+static void free_tree(ast *e, bool nodes) {
   if (!e) return;
  tailcall:
   switch (e->type) {
@@ -364,7 +517,8 @@ void free_ast(ast *e) {
 	free(e->error);
       }
       break;
-    case AST_IDENTIFIER:
+    case AST_IDENTIFIER:		// the symbol table owns the name
+      break;
     case AST_STRING:
       free(e->str);
       break;
@@ -372,24 +526,29 @@ void free_ast(ast *e) {
     case AST_NULL:
       break;
     case AST_CONS:
-      free_ast(e->car);
+      free_tree(e->car, nodes);
       ast *conscell = e;
       e = e->cdr;
-      free(conscell);
+      if (nodes) free(conscell);
       goto tailcall;
     default:
       PANIC("reader", "Unhandled AST type %s (%d)", ast_name(e), e->type);
   }
-  free(e);
+  if (nodes) free(e);
   return;
 }
 
+void free_ast(ast *e) {
+  free_tree(e, !node_arena());
+}
+
 /* ----------------------------------------------------------------------------- */
 /* Equality testing                                                              */
 /* ----------------------------------------------------------------------------- */
 
-// Shallow comparison
-bool ast_node_equal(ast *a, ast *b) {
+// Shallow comparison.  With 'across', identifiers are compared by name,
+// as those from different symbol tables are different strings.
+static bool node_equal(ast *a, ast *b, bool across) {
   if (!a && !b) return true;
   if (!a || !b) return false;
   if (a->type != b->type) return false;
@@ -399,11 +558,15 @@ bool ast_node_equal(ast *a, ast *b) {
     case AST_ERROR:
       if (!a->error) PANIC_NULL();
       if (a->error->type != b->error->type) return false;
+      if (!a->error->msg || !b->error->msg)
+	return (a->error->msg == b->error->msg);
       if (strncmp(a->error->msg, b->error->msg, MAX_MSGLEN) != 0) return false;
       // Not comparing inputs or input pointers
       return true;
     case AST_IDENTIFIER:
-      return (strncmp(a->str, b->str, MAX_IDLEN) == 0);
+      // Interned, so one pointer for a name within one symbol table
+      if (a->str == b->str) return true;
+      return across && (strncmp(a->str, b->str, MAX_IDLEN) == 0);
     case AST_STRING:
       return (strncmp(a->str, b->str, MAX_STRINGLEN) == 0);
     case AST_INTEGER:
@@ -416,17 +579,29 @@ bool ast_node_equal(ast *a, ast *b) {
   }
 }
 
-// Deep comparison
-bool ast_equal(ast *a, ast *b) {
+bool ast_node_equal(ast *a, ast *b) {
+  return node_equal(a, b, false);
+}
+
+static bool equal(ast *a, ast *b, bool across) {
   while (true) {
-    if (!ast_node_equal(a, b)) return false;
+    if (!node_equal(a, b, across)) return false;
     if (!ast_consp(a)) return true;
-    if (!ast_equal(a->car, b->car)) return false;
+    if (!equal(a->car, b->car, across)) return false;
     a = a->cdr;
     b = b->cdr;
   }
 }
 
+// Deep comparison
+bool ast_equal(ast *a, ast *b) {
+  return equal(a, b, false);
+}
+
+bool ast_equal_across(ast *a, ast *b) {
+  return equal(a, b, true);
+}
+
 /* ----------------------------------------------------------------------------- */
 /* Copy                                                                          */
 /* ----------------------------------------------------------------------------- */
@@ -445,10 +620,14 @@ ast *ast_node_copy(ast *a) {
       b->error = deets;
       deets->type = a->error->type;
       deets->input = a->error->input;
+      deets->end = a->error->end;
       deets->msg = a->error->msg ? strndup(a->error->msg, MAX_MSGLEN) : NULL;
+      deets->line = a->error->line;
+      deets->col = a->error->col;
+      deets->line_start = a->error->line_start;
       return b;
     case AST_IDENTIFIER:
-      b->str = strndup(a->str, MAX_IDLEN);
+      b->str = a->str;
       return b;
     case AST_STRING:
       b->str = strndup(a->str, MAX_STRINGLEN);
@@ -497,18 +676,25 @@ error_type ast_error_type(ast *e) {
 static ulen_t line_at_point(ast *a, const char **start) {
   if (!a || !start) PANIC_NULL();
   const char *input = a->error->input;
+  const char *end = a->error->end;
   const char *point = a->start;
   if (!input || !point) {
     *start = NULL;
     return 0;
   }
-  // Edge case: point is EOF
-  if (!*point && (point > input)) point--;
+  // Edge case: point is EOF (either at 'end' or at a NUL)
+  if (((point == end) || !*point) && (point > input)) point--;
   // Edge case: point is newline
-  if ((*point == '\n') && (point > input)) point--;
-  *start = point;
-  while ((*start != input) && (**start != '\n')) (*start)--;
-  while (*point && (*point != '\n')) point++;
+  if ((point != end) && (*point == '\n') && (point > input)) point--;
+  // The parser may have found the start of the line already
+  const char *known = a->error->line_start;
+  if (known && (known <= point)) {
+    *start = known;
+  } else {
+    *start = point;
+    while ((*start != input) && ((*start)[-1] != '\n')) (*start)--;
+  }
+  while ((point != end) && *point && (*point != '\n')) point++;
 
   return to_ulen(point - *start);
 }
@@ -525,7 +711,11 @@ void fprint_error(FILE *f, ast *a) {
   }    
 
   // Always print this info
-  fprintf(f, "Syntax error [%s]: %s\n", error_name(a), a->error->msg ?: "");
+  if (a->error->line)
+    fprintf(f, "Syntax error [%s] at %zu:%zu: %s\n", error_name(a),
+	    a->error->line, a->error->col, a->error->msg ?: "");
+  else
+    fprintf(f, "Syntax error [%s]: %s\n", error_name(a), a->error->msg ?: "");
 
   // For a lexer panic, there's nothing more we can print
   if (a->error->type == ERR_LEXER) return;
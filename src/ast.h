@@ -11,6 +11,12 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+// When PARSER_STATS is true (as in a debug build), new_ast() counts
+// the nodes it allocates, for parser_statistics() in parser.h
+#ifndef PARSER_STATS
+#define PARSER_STATS false
+#endif
+
 /* ------------------------------------------------------------------ */
 /* AST types and type names                                           */
 /* ------------------------------------------------------------------ */
@@ -75,6 +81,7 @@ static const char *const AST_NAMES[] = {_EXPS(_SECOND)};
     X(ERR_STRLEN,       "String too long")               \
     X(ERR_BADCHAR,      "Illegal character")             \
     X(ERR_LEXER,        "Lexer failed")                  \
+    X(ERR_DEPTH,        "Nesting too deep")              \
     X(ERR_NTYPES,       "SENTINEL")
        
 #define _FIRST(a, b) a,
@@ -101,7 +108,11 @@ static const char *const ERROR_NAMES[] = {_ERRORS(_SECOND)};
 typedef struct ast_error_details {
   enum error_type    type;
   const char        *input;		// full input to parser
+  const char        *end;		// end of input, or NULL at a NUL
   char              *msg;		// optional message
+  size_t             line;		// from 1, or 0 when not known
+  size_t             col;		// in characters, from 1
+  const char        *line_start;	// start of that line in input
 } ast_error_details;
 
 // Individual fields are valid only for the indicated types
@@ -142,10 +153,28 @@ typedef struct ast {
 
 */  
 
+// Symbol tables, which own the names of identifiers; see ast.c
+
+typedef struct symtab symtab;
+struct arena;					// See util.h
+
+symtab *new_symtab(void);
+symtab *new_symtab_in(struct arena *names);
+void    free_symtab(symtab *st);
+size_t  symtab_count(symtab *st);
+char   *intern(symtab *st, const char *name, size_t len);
+
 // Low-level constructor, destructor
 
-ast *new_ast(enum ast_type type, const char *start);
-void free_ast(ast *e);
+ast   *new_ast(enum ast_type type, const char *start);
+void   free_ast(ast *e);
+size_t ast_node_count(void);
+
+// Until it is called again with NULL, the calling thread's nodes come
+// from arena 'a', and its free_ast() leaves them there, freeing only
+// the strings and error details that they own.  A tree must be freed
+// in the same mode that it was made in.
+void   ast_use_arena(struct arena *a);
 
 // Accessors, mostly for convenience
 
@@ -160,7 +189,7 @@ ast *ast_true(const char *start);
 ast *ast_false(const char *start);
 ast *ast_integer(const char *input, token tok);
 ast *ast_string(const char *input, token tok);
-ast *ast_identifier(token t);
+ast *ast_identifier(symtab *st, token t);
 ast *ast_error(enum error_type type,
 	       const char *input,
 	       const char *posn,
@@ -223,9 +252,14 @@ int  ast_length(ast *ls);
 ast *ast_copy(ast *a);		// deep copy
 ast *ast_node_copy(ast *a);	// shallow copy
 
+// Identifiers are compared by pointer, so these are for trees whose
+// names were interned in the same symbol table
 bool ast_equal(ast *a, ast *b);	     // deep comparison
 bool ast_node_equal(ast *a, ast *b); // shallow comparison
 
+// Deep comparison of trees from different tables, by name
+bool ast_equal_across(ast *a, ast *b);
+
 /*
   To 'reduce' a list is to apply a binary (2-arg) function repeatedly
   until all the values in the list have been consumed.  An initial
@@ -0,0 +1,1104 @@
+//  -*- Mode: C; -*-
+//
+//  bench.c   Performance measurements for the lexer and parser
+//
+//  (C) Jamie A. Jennings, 2024.
+
+#include "ast.h"
+#include "parser.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+
+  Usage: bench [-m megabytes] [-r repetitions] [benchmark ...]
+
+  With no benchmark names, all of them are run.  Each benchmark is
+  run 'repetitions' times and the best time is reported.
+
+  The corpus is generated from a fixed seed, so the same command
+  produces the same input on every build.  To compare two versions of
+  the code, build and run this program in each of them.  The one
+  exception is 'classify', which keeps the chain of byte predicates
+  that the lexer used before its class table, so that a single run
+  compares the two.
+
+*/
+
+#define DEFAULT_MEGABYTES 8
+#define DEFAULT_REPETITIONS 5
+
+static size_t option_megabytes = DEFAULT_MEGABYTES;
+static int option_repetitions = DEFAULT_REPETITIONS;
+
+// The names of identifiers parsed by the main thread
+static symtab *symbols;
+
+/* ----------------------------------------------------------------------------- */
+/* Timing                                                                        */
+/* ----------------------------------------------------------------------------- */
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, size_t items,
+		   const char *unit, double secs) {
+  printf("  %-28s %9.2f MB/s  %10.2f M%s/s  (%.4f s)\n",
+	 name,
+	 ((double) bytes / (1024.0 * 1024.0)) / secs,
+	 ((double) items / 1e6) / secs,
+	 unit,
+	 secs);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Corpus generation                                                             */
+/* ----------------------------------------------------------------------------- */
+
+// Simple generator that gives the same sequence on every platform
+static uint64_t rng_state = 417;
+
+static uint32_t rng(uint32_t max) {
+  rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return max ? (uint32_t) (rng_state >> 33) % max : 0;
+}
+
+typedef struct buffer {
+  char  *data;
+  size_t len;
+  size_t capacity;
+} buffer;
+
+static void append(buffer *b, const char *str) {
+  size_t len = strlen(str);
+  if (b->len + len + 1 > b->capacity) {
+    b->capacity = 2 * (b->len + len + 1);
+    b->data = realloc(b->data, b->capacity);
+    if (!b->data) PANIC_OOM();
+  }
+  memcpy(b->data + b->len, str, len + 1);
+  b->len += len;
+}
+
+static const char *names[] = {
+  "n", "x", "acc", "add", "sub", "mul", "fact", "zero?", "print",
+  "total_count", "make-counter", "λx", "list->vector", "fold-left",
+};
+#define NNAMES (sizeof(names) / sizeof(names[0]))
+
+// Machine-generated sources are often heavily indented and commented
+static int indent_width = 2;
+static bool comment_every_line = false;
+
+static void indent(buffer *b, int depth) {
+  for (int i = 0; i < depth * indent_width; i++) append(b, " ");
+}
+
+static void gen_exp(buffer *b, int depth);
+
+static void gen_atom(buffer *b) {
+  char tmp[64];
+  switch (rng(6)) {
+    case 0:
+    case 1:
+      snprintf(tmp, sizeof(tmp), "%d", (int) rng(100000) - 500);
+      append(b, tmp);
+      break;
+    case 2:
+      append(b, rng(4) ? "\"a string literal\"" : "\"tab\\there\\n\"");
+      break;
+    default:
+      append(b, names[rng(NNAMES)]);
+  }
+}
+
+static void gen_app(buffer *b, int depth) {
+  append(b, names[rng(NNAMES)]);
+  append(b, "(");
+  int nargs = rng(4);
+  for (int i = 0; i < nargs; i++) {
+    if (i) append(b, ", ");
+    gen_exp(b, depth + 1);
+  }
+  append(b, ")");
+}
+
+static void gen_exp(buffer *b, int depth) {
+  if (depth > 3) {
+    gen_atom(b);
+    return;
+  }
+  switch (rng(8)) {
+    case 0:
+    case 1:
+    case 2:
+      gen_app(b, depth);
+      break;
+    case 3:
+      append(b, "cond (zero?(");
+      gen_atom(b);
+      append(b, ") => ");
+      gen_exp(b, depth + 1);
+      append(b, ") (true => ");
+      gen_exp(b, depth + 1);
+      append(b, ")");
+      break;
+    default:
+      gen_atom(b);
+  }
+}
+
+static void gen_definition(buffer *b, int i) {
+  char tmp[64];
+  indent(b, 1);
+  append(b, "// Definition number ");
+  snprintf(tmp, sizeof(tmp), "%d", i);
+  append(b, tmp);
+  append(b, ", generated for benchmarking\n");
+  indent(b, 1);
+  snprintf(tmp, sizeof(tmp), "def f%d = λ(a, b, c) {\n", i);
+  append(b, tmp);
+  int nexps = rng(4) + 1;
+  for (int k = 0; k < nexps; k++) {
+    if (comment_every_line) {
+      indent(b, 2);
+      append(b, "// The next expression was generated from a template, "
+	     "do not edit it by hand\n");
+    }
+    indent(b, 2);
+    if (rng(3) == 0) {
+      append(b, "let tmp = ");
+      gen_exp(b, 0);
+    } else {
+      gen_exp(b, 0);
+    }
+    append(b, (k + 1 < nexps) ? ";\n" : "\n");
+  }
+  indent(b, 1);
+  append(b, "};\n");
+}
+
+// Generates one program (a block) of approximately 'size' bytes
+static buffer make_corpus(size_t size) {
+  buffer b = {NULL, 0, 0};
+  append(&b, "{\n");
+  for (int i = 0; b.len < size; i++) gen_definition(&b, i);
+  append(&b, "  0\n}\n");
+  return b;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* The lexer as it classified bytes before its class table                       */
+/* ----------------------------------------------------------------------------- */
+
+// Each byte went through a chain of these, and delimiterp() called up
+// to eleven of them per byte of an identifier or integer.  The tokens
+// are checked with the lexer's own functions, as read_token() does,
+// so that only the classification differs.
+
+#define PREDICATE(name, chr)					\
+  static bool name(const char *c) { return (*c == chr); }
+
+PREDICATE(eofp, '\0');
+PREDICATE(quotep, '\"');
+PREDICATE(commap, ',');
+PREDICATE(semicolonp, ';');
+PREDICATE(newlinep, '\n');
+PREDICATE(returnp, '\r');
+PREDICATE(spacep, ' ');
+PREDICATE(tabp, '\t');
+PREDICATE(openparenp, '(');
+PREDICATE(closeparenp, ')');
+PREDICATE(openbracep, '{');
+PREDICATE(closebracep, '}');
+PREDICATE(minusp, '-');
+PREDICATE(plusp, '+');
+PREDICATE(equalsp, '=');
+static bool arrowp(const char *s) {
+  return (*s == '=') && (*s) && (*(s+1) == '>');
+}
+
+static bool digitp(const char *c) {
+  return ((*c >= '0') && (*c <= '9'));
+}
+
+static bool whitespacep(const char *c) {
+  return newlinep(c) || spacep(c) || tabp(c) || returnp(c);
+}
+
+static bool commentp(const char *c) {
+  return (*c++ == '/') && (*c == '/');
+}
+
+static bool delimiterp(const char *c) {
+  // equals is a prefix of arrow, so we must test for it first
+  return whitespacep(c)
+    || openparenp(c) || closeparenp(c)
+    || openbracep(c) || closebracep(c)
+    || commap(c)     || semicolonp(c)
+    || arrowp(c)     || equalsp(c)
+    || commentp(c)   || eofp(c);
+}
+
+static const char *scan(bool pred(const char *), const char *s) {
+  while (*s && pred(s)) s++;
+  return s;
+}
+
+static const char *until(bool pred(const char *), const char *s) {
+  while (*s && !pred(s)) s++;
+  return s;
+}
+
+static token chain_token(token_type type, const char *start, const char *end) {
+  return (token) {.type = type, .start = start, .len = to_ulen(end - start)};
+}
+
+static token chain_error(token_type type, const char *start, const char *end,
+			 const char *loc) {
+  return (token) {.type = type, .start = start, .len = to_ulen(end - start),
+		  .pos = to_ulen(loc - start)};
+}
+
+static token chain_integer(const char **sptr) {
+  const char *start = *sptr;
+  *sptr = until(delimiterp, start);
+  const char *digits = digitp(start) ? start : start + 1;
+  const char *end = scan(digitp, digits);
+  if (end <= digits)
+    return chain_error(TOKEN_BAD_INTCHAR, start, *sptr, *sptr - 1);
+  if (*sptr != end)
+    return chain_error(TOKEN_BAD_INTCHAR, start, *sptr, end);
+  if (end - start > MAX_INTLEN)
+    return chain_error(TOKEN_BAD_INTLEN, start, *sptr, start + MAX_INTLEN);
+  return chain_token(TOKEN_INTEGER, start, end);
+}
+
+static token chain_identifier(const char **sptr) {
+  const char *start = *sptr;
+  *sptr = until(delimiterp, start);
+  ssize_t len = *sptr - start;
+  if (len > MAX_IDLEN)
+    return chain_error(TOKEN_BAD_IDLEN, start, *sptr, start + MAX_IDLEN);
+  ssize_t errpos = invalid_utf8(start, len);
+  if (errpos != -1)
+    return chain_error(errpos ? TOKEN_BAD_IDCHAR : TOKEN_BAD_CHAR,
+		       start, *sptr, start + errpos);
+  for (errpos = 0; errpos < len; errpos++)
+    if ((((uint8_t) start[errpos] < 32) && !whitespacep(start + errpos))
+	|| (start[errpos] == 0x7F))
+      return chain_error(errpos ? TOKEN_BAD_IDCHAR : TOKEN_BAD_CHAR,
+			 start, *sptr, start + errpos);
+  return chain_token(is_keyword(start, (size_t) len), start, *sptr);
+}
+
+static token chain_string(const char **sptr) {
+  const char *start = (*sptr)++;
+  while (**sptr && !quotep(*sptr)) {
+    if ((**sptr == ESC) && *(*sptr + 1)) (*sptr)++;
+    (*sptr)++;
+  }
+  if (*sptr - start > MAX_STRINGLEN)
+    return chain_error(TOKEN_BAD_STRLEN, start, *sptr, *sptr);
+  if (eofp(*sptr))
+    return chain_error(TOKEN_BAD_STREOF, start, *sptr, *sptr);
+  (*sptr)++;
+  ssize_t errpos = invalid_utf8(start, *sptr - start);
+  if (errpos != -1)
+    return chain_error(TOKEN_BAD_STRCHAR, start, *sptr, start + errpos);
+  return chain_token(TOKEN_STRING, start, *sptr);
+}
+
+// The dispatch of read_token(), one predicate at a time.  The 'end'
+// is ignored, as the input must be NUL-terminated.
+static token chain_read_token(const char **s, const char *end) {
+  (void) end;
+  const char *start = *s;
+  if (openparenp(*s)) return chain_token(TOKEN_OPENPAREN, start, ++(*s));
+  if (closeparenp(*s)) return chain_token(TOKEN_CLOSEPAREN, start, ++(*s));
+  if (openbracep(*s)) return chain_token(TOKEN_OPENBRACE, start, ++(*s));
+  if (closebracep(*s)) return chain_token(TOKEN_CLOSEBRACE, start, ++(*s));
+  if (whitespacep(*s)) {
+    *s = scan(whitespacep, start);
+    return chain_token(TOKEN_WS, start, *s);
+  }
+  if (digitp(*s) || minusp(*s) || plusp(*s)) return chain_integer(s);
+  if (quotep(*s)) return chain_string(s);
+  if (commap(*s)) return chain_token(TOKEN_COMMA, start, ++(*s));
+  if (semicolonp(*s)) return chain_token(TOKEN_SEMICOLON, start, ++(*s));
+  if (arrowp(*s)) return chain_token(TOKEN_ARROW, start, (*s) += 2);
+  if (equalsp(*s)) return chain_token(TOKEN_EQUALS, start, ++(*s));
+  if (commentp(*s)) {
+    *s = until(newlinep, start);
+    return chain_token(TOKEN_COMMENT, start, *s);
+  }
+  if (eofp(*s)) return chain_token(TOKEN_EOF, start, start);
+  return chain_identifier(s);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Benchmarks                                                                    */
+/* ----------------------------------------------------------------------------- */
+
+static void bench_lex(buffer *corpus) {
+  double best = 0;
+  size_t count = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus->data;
+    token tok;
+    count = 0;
+    double t0 = now();
+    do {
+      tok = read_token(&ptr);
+      count++;
+    } while (tok.type != TOKEN_EOF);
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_token", corpus->len, count, "tok", best);
+
+  // The same, with the end of the input given by a pointer
+  const char *end = corpus->data + corpus->len;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus->data;
+    token tok;
+    count = 0;
+    double t0 = now();
+    do {
+      tok = read_token_n(&ptr, end);
+      count++;
+    } while (tok.type != TOKEN_EOF);
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_token_n", corpus->len, count, "tok", best);
+}
+
+// Same measurement on a corpus that is mostly whitespace and comments
+static void bench_lex_atmosphere(buffer *ignored) {
+  (void) ignored;
+  uint64_t saved_state = rng_state;
+  indent_width = 8;
+  comment_every_line = true;
+  buffer corpus = make_corpus(option_megabytes * 1024 * 1024);
+  indent_width = 2;
+  comment_every_line = false;
+  rng_state = saved_state;
+  bench_lex(&corpus);
+  free(corpus.data);
+}
+
+// Long argument lists of identifiers, some of them non-ASCII
+static void bench_identifiers(buffer *ignored) {
+  (void) ignored;
+  uint64_t saved_state = rng_state;
+  buffer corpus = {NULL, 0, 0};
+  char tmp[64];
+  while (corpus.len < option_megabytes * 1024 * 1024) {
+    append(&corpus, names[rng(NNAMES)]);
+    append(&corpus, "(");
+    int nargs = rng(12) + 1;
+    for (int i = 0; i < nargs; i++) {
+      if (i) append(&corpus, ", ");
+      if (rng(2)) {
+	append(&corpus, names[rng(NNAMES)]);
+      } else {
+	snprintf(tmp, sizeof(tmp), "%s_%u", names[rng(NNAMES)], rng(100000));
+	append(&corpus, tmp);
+      }
+    }
+    append(&corpus, ")\n");
+  }
+  rng_state = saved_state;
+  bench_lex(&corpus);
+  free(corpus.data);
+}
+
+// Config blobs embedded as string literals, a few with escapes
+static void bench_strings(buffer *ignored) {
+  (void) ignored;
+  uint64_t saved_state = rng_state;
+  buffer corpus = {NULL, 0, 0};
+  char tmp[64];
+  while (corpus.len < option_megabytes * 1024 * 1024) {
+    append(&corpus, "\"");
+    int nfields = rng(40) + 5;
+    for (int i = 0; i < nfields; i++) {
+      snprintf(tmp, sizeof(tmp), "%s_%d = %d; ",
+	       names[rng(NNAMES)], (int) rng(1000), (int) rng(100000));
+      append(&corpus, tmp);
+    }
+    append(&corpus, rng(8) ? "\"\n" : "last line\\n\"\n");
+  }
+  rng_state = saved_state;
+
+  double best = 0;
+  size_t count = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus.data;
+    token tok;
+    count = 0;
+    double t0 = now();
+    do {
+      tok = read_token(&ptr);
+      if (tok.type == TOKEN_STRING) {
+	free_ast(ast_string(corpus.data, tok));
+	count++;
+      }
+    } while (tok.type != TOKEN_EOF);
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_token + ast_string", corpus.len, count, "str", best);
+  free(corpus.data);
+}
+
+// Tables of constants, from small counts to 64-bit hashes
+static void bench_integers(buffer *ignored) {
+  (void) ignored;
+  uint64_t saved_state = rng_state;
+  buffer corpus = {NULL, 0, 0};
+  char tmp[64];
+  while (corpus.len < option_megabytes * 1024 * 1024) {
+    append(&corpus, "table(");
+    for (int i = 0; i < 16; i++) {
+      uint64_t n = ((uint64_t) rng(UINT32_MAX) << 32) | rng(UINT32_MAX);
+      // Mostly small numbers, and some of every length up to 19 digits
+      n %= (uint64_t) 1 << (4 * (rng(16) + 1) - 1);
+      snprintf(tmp, sizeof(tmp), "%s%s%" PRIu64, i ? ", " : "",
+	       rng(4) ? "" : "-", n);
+      append(&corpus, tmp);
+    }
+    append(&corpus, ")\n");
+  }
+  rng_state = saved_state;
+
+  double best = 0;
+  size_t count = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus.data;
+    token tok;
+    count = 0;
+    double t0 = now();
+    do {
+      tok = read_token(&ptr);
+      if (tok.type == TOKEN_INTEGER) {
+	free_ast(ast_integer(corpus.data, tok));
+	count++;
+      }
+    } while (tok.type != TOKEN_EOF);
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_token + ast_integer", corpus.len, count, "int", best);
+  free(corpus.data);
+}
+
+static void bench_utf8_on(const char *name, const char *unit_text) {
+  buffer text = {NULL, 0, 0};
+  size_t count = 0;
+  for (; text.len < option_megabytes * 1024 * 1024; count++)
+    append(&text, unit_text);
+  double best = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    double t0 = now();
+    ssize_t errpos = invalid_utf8(text.data, (ssize_t) text.len);
+    double t = now() - t0;
+    if (errpos != -1) PANIC("invalid UTF-8 at %zd in benchmark text", errpos);
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report(name, text.len, count, "line", best);
+  free(text.data);
+}
+
+// UTF-8 validation alone, on text with more and more multibyte chars
+static void bench_utf8(buffer *ignored) {
+  (void) ignored;
+  bench_utf8_on("invalid_utf8 (ASCII)",
+		"def make_counter = lambda(n) {let count = add(n, 1); count};\n");
+  bench_utf8_on("invalid_utf8 (mixed)",
+		"def naïve_café = λ(x) {print(\"Grüße, señor\"); x};\n");
+  bench_utf8_on("invalid_utf8 (λ-heavy)",
+		"λλλ(λx, λy) {λxλ(λyλ, λ→λ, λ≠λ)}; ");
+}
+
+// The corpus arrives in chunks, as from a pipe
+#define STREAM_CHUNK (64 * 1024)
+
+static void bench_stream(buffer *corpus) {
+  double best = 0, first = 0;
+  size_t count = 0, peak = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    lexstream *ls = lexstream_new();
+    size_t fed = 0;
+    token tok;
+    count = 0;
+    double t0 = now(), t_first = 0;
+    while (true) {
+      if (lexstream_next(ls, &tok)) {
+	if (!count++) t_first = now() - t0;
+	if (tok.type == TOKEN_EOF) break;
+      } else if (fed < corpus->len) {
+	size_t n = corpus->len - fed;
+	if (n > STREAM_CHUNK) n = STREAM_CHUNK;
+	lexstream_feed(ls, corpus->data + fed, n);
+	fed += n;
+      } else {
+	lexstream_finish(ls);
+      }
+    }
+    double t = now() - t0;
+    peak = ls->capacity;
+    lexstream_free(ls);
+    if ((r == 0) || (t < best)) best = t;
+    if ((r == 0) || (t_first < first)) first = t_first;
+  }
+  report("lexstream_next", corpus->len, count, "tok", best);
+  printf("  First token after %.1f us, with a buffer of %zu bytes\n",
+	 first * 1e6, peak);
+}
+
+// The whole parser, lexing as it goes, and then from a token array
+static void bench_parse(buffer *corpus) {
+  tokbuf *tb = tokenize(corpus->data);
+  size_t count = tb->count;
+  size_t tokbytes = tb->count * 2 * sizeof(uint32_t) +
+    tb->naux * sizeof(tokbuf_aux);
+  printf("  Token buffer is %zu bytes for %zu tokens (%zu would be unpacked)\n",
+	 tokbytes, count, count * sizeof(token));
+  free_tokbuf(tb);
+
+  double best = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus->data;
+    double t0 = now();
+    ast *prog = read_program(symbols, &ptr);
+    double t = now() - t0;
+    if (!prog || ast_errorp(prog)) PANIC("benchmark program did not parse");
+    free_ast(prog);
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_program", corpus->len, count, "tok", best);
+
+  double best_tokenize = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus->data;
+    double t0 = now();
+    tb = tokenize(corpus->data);
+    double t1 = now();
+    ast *prog = read_program_tokens(symbols, tb, &ptr);
+    double t = now() - t0;
+    if (!prog || ast_errorp(prog)) PANIC("benchmark program did not parse");
+    free_ast(prog);
+    free_tokbuf(tb);
+    if ((r == 0) || (t < best)) best = t;
+    if ((r == 0) || (t1 - t0 < best_tokenize)) best_tokenize = t1 - t0;
+  }
+  report("tokenize", corpus->len, count, "tok", best_tokenize);
+  report("tokenize+read_program_tokens", corpus->len, count, "tok", best);
+
+  // Comparing two parses of the same program
+  const char *ptr = corpus->data;
+  ast *prog1 = read_program(symbols, &ptr);
+  ptr = corpus->data;
+  ast *prog2 = read_program(symbols, &ptr);
+  best = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    double t0 = now();
+    bool same = ast_equal(prog1, prog2);
+    double t = now() - t0;
+    if (!same) PANIC("two parses of the benchmark program differ");
+    if ((r == 0) || (t < best)) best = t;
+  }
+  free_ast(prog1);
+  free_ast(prog2);
+  report("ast_equal", corpus->len, count, "tok", best);
+  printf("  %zu distinct identifiers\n", symtab_count(symbols));
+}
+
+// Tokenizing with 1 to N threads, where N is the number of online
+// processors, but at least 4
+static void bench_parallel(buffer *corpus) {
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxthreads = (nprocs > 4) ? (int) nprocs : 4;
+  tokbuf *tb = tokenize(corpus->data);
+  size_t count = tb->count;
+  free_tokbuf(tb);
+  double sequential = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    double t0 = now();
+    tb = tokenize(corpus->data);
+    double t = now() - t0;
+    free_tokbuf(tb);
+    if ((r == 0) || (t < sequential)) sequential = t;
+  }
+  report("tokenize", corpus->len, count, "tok", sequential);
+  for (int nthreads = 1; nthreads <= maxthreads; nthreads++) {
+    double best = 0;
+    for (int r = 0; r < option_repetitions; r++) {
+      double t0 = now();
+      tb = tokenize_parallel(corpus->data, NULL, nthreads, 0);
+      double t = now() - t0;
+      if (tb->count != count) PANIC("parallel tokenizing lost tokens");
+      free_tokbuf(tb);
+      if ((r == 0) || (t < best)) best = t;
+    }
+    char name[40];
+    snprintf(name, sizeof(name), "tokenize_parallel, %d thread%s",
+	     nthreads, (nthreads == 1) ? "" : "s");
+    report(name, corpus->len, count, "tok", best);
+    printf("  %-28s %9.2fx\n", "speedup", sequential / best);
+  }
+  printf("  (%ld processors online)\n", nprocs);
+}
+
+// One lexer over the whole corpus, returning the best time
+static double time_backend(buffer *corpus,
+			   token (*lex)(const char **s, const char *end),
+			   size_t *count) {
+  double best = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus->data;
+    token tok;
+    *count = 0;
+    double t0 = now();
+    do {
+      tok = lex(&ptr, NULL);
+      (*count)++;
+    } while (tok.type != TOKEN_EOF);
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  return best;
+}
+
+// The lexer with its class table, and with the chain of predicates
+// that it replaced, on the usual corpus and on one that is mostly
+// whitespace and comments
+static void bench_classify(buffer *corpus) {
+  uint64_t saved_state = rng_state;
+  indent_width = 8;
+  comment_every_line = true;
+  buffer atmosphere = make_corpus(option_megabytes * 1024 * 1024);
+  indent_width = 2;
+  comment_every_line = false;
+  rng_state = saved_state;
+  buffer *corpora[] = {corpus, &atmosphere};
+  const char *labels[] = {"", ", atmosphere"};
+  char name[40];
+  size_t count = 0, chain_count = 0;
+  for (int k = 0; k < 2; k++) {
+    double chain = time_backend(corpora[k], chain_read_token, &chain_count);
+    snprintf(name, sizeof(name), "predicate chain%s", labels[k]);
+    report(name, corpora[k]->len, chain_count, "tok", chain);
+    double table = time_backend(corpora[k], read_token_direct, &count);
+    snprintf(name, sizeof(name), "class table%s", labels[k]);
+    report(name, corpora[k]->len, count, "tok", table);
+    if (count != chain_count)
+      PANIC("lexers differ: %zu tokens and %zu", count, chain_count);
+    printf("  %-28s %9.2fx\n", "table speedup", chain / table);
+  }
+  free(atmosphere.data);
+}
+
+// The hand-written lexer and the table-driven one, on the usual
+// corpus and on one that is mostly whitespace and comments.  Build
+// with LEXER_BACKEND=dfa to make read_token() use the faster one.
+static void bench_backends(buffer *corpus) {
+  uint64_t saved_state = rng_state;
+  indent_width = 8;
+  comment_every_line = true;
+  buffer atmosphere = make_corpus(option_megabytes * 1024 * 1024);
+  indent_width = 2;
+  comment_every_line = false;
+  rng_state = saved_state;
+  buffer *corpora[] = {corpus, &atmosphere};
+  const char *labels[] = {"", ", atmosphere"};
+  char name[40];
+  size_t count;
+  for (int k = 0; k < 2; k++) {
+    double direct = time_backend(corpora[k], read_token_direct, &count);
+    snprintf(name, sizeof(name), "read_token_direct%s", labels[k]);
+    report(name, corpora[k]->len, count, "tok", direct);
+    double dfa = time_backend(corpora[k], read_token_dfa, &count);
+    snprintf(name, sizeof(name), "read_token_dfa%s", labels[k]);
+    report(name, corpora[k]->len, count, "tok", dfa);
+    printf("  %-28s %9.2fx\n", "dfa speedup", direct / dfa);
+  }
+  free(atmosphere.data);
+}
+
+// Building the structural index, compared to lexing the whole input,
+// and then matching every bracket in it
+static void bench_structural(buffer *corpus) {
+  double best = 0;
+  structindex *si = NULL;
+  for (int r = 0; r < option_repetitions; r++) {
+    free_structindex(si);
+    double t0 = now();
+    si = structural_index(corpus->data, NULL);
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("structural_index", corpus->len, si->count, "delim", best);
+  size_t matched = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    matched = 0;
+    double t0 = now();
+    for (size_t i = 0; i < si->count; i++)
+      if (structindex_partner(si, i) != STRUCTINDEX_NONE) matched++;
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("structindex_partner", corpus->len, si->count, "delim", best);
+  printf("  %zu delimiters, %zu of them matched brackets, %s\n",
+	 si->count, matched, si->exact ? "exact" : "NOT exact");
+  free_structindex(si);
+  size_t count = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    double t0 = now();
+    tokbuf *tb = tokenize(corpus->data);
+    double t = now() - t0;
+    count = tb->count;
+    free_tokbuf(tb);
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("tokenize", corpus->len, count, "tok", best);
+}
+
+// Generated code with very wide blocks and argument lists: each
+// program is a block of thousands of short statements, and ends in a
+// call with thousands of arguments
+#define WIDE_COUNT 4000
+
+static void bench_wide(buffer *ignored) {
+  (void) ignored;
+  uint64_t saved_state = rng_state;
+  buffer corpus = {NULL, 0, 0};
+  while (corpus.len < option_megabytes * 1024 * 1024) {
+    append(&corpus, "{\n");
+    for (int i = 0; i < WIDE_COUNT; i++) {
+      append(&corpus, "  ");
+      if (rng(2)) gen_app(&corpus, 3);
+      else gen_atom(&corpus);
+      append(&corpus, ";\n");
+    }
+    append(&corpus, "  list(");
+    for (int i = 0; i < WIDE_COUNT; i++) {
+      if (i) append(&corpus, ", ");
+      gen_atom(&corpus);
+    }
+    append(&corpus, ")\n}\n");
+  }
+  rng_state = saved_state;
+  tokbuf *tb = tokenize(corpus.data);
+  size_t count = tb->count;
+  free_tokbuf(tb);
+
+  double best = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus.data;
+    pstate state = {.input = corpus.data, .astart = corpus.data, .sptr = &ptr,
+		    .symbols = symbols};
+    double t0 = now();
+    ast *a;
+    while ((a = read_ast(&state))) {
+      if (ast_errorp(a)) PANIC("wide benchmark program did not parse");
+      free_ast(a);
+    }
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_ast", corpus.len, count, "tok", best);
+
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = corpus.data;
+    double t0 = now();
+    ast *a;
+    while ((a = read_program(symbols, &ptr))) {
+      if (ast_errorp(a)) PANIC("wide benchmark program did not parse");
+      free_ast(a);
+    }
+    double t = now() - t0;
+    if ((r == 0) || (t < best)) best = t;
+  }
+  report("read_program", corpus.len, count, "tok", best);
+  free(corpus.data);
+}
+
+// Many small programs, as parse -n -j would see them, parsed by 1 to
+// N threads (as for bench_parallel).  Each thread takes every Nth
+// program, and has its own symbol table.  With an arena, as in parse
+// -n, a thread's nodes and names come from it, and it is reset after
+// every BATCH_GROUP programs.
+#define BATCH_GROUP 32
+#define BATCH_ARENA (256 * 1024)
+
+typedef struct batchworker {
+  const char   *data;
+  const size_t *offsets;	// Program i is offsets[i] to offsets[i+1]
+  size_t        count;
+  size_t        first;
+  size_t        stride;
+  arena        *nodes;		// NULL to malloc each node
+} batchworker;
+
+static void *parse_share(void *arg) {
+  batchworker *w = arg;
+  symtab *st = new_symtab_in(w->nodes);
+  ast_use_arena(w->nodes);
+  size_t n = 0;
+  for (size_t i = w->first; i < w->count; i += w->stride) {
+    const char *ptr = w->data + w->offsets[i];
+    ast *a = read_program_n(st, &ptr, w->data + w->offsets[i + 1]);
+    if (!a || ast_errorp(a)) PANIC("batch benchmark program did not parse");
+    free_ast(a);
+    if (w->nodes && (++n % BATCH_GROUP == 0)) {
+      free_symtab(st);
+      arena_reset(w->nodes);
+      st = new_symtab_in(w->nodes);
+    }
+  }
+  ast_use_arena(NULL);
+  free_symtab(st);
+  return NULL;
+}
+
+static double time_batch(buffer *corpus, size_t *offsets, size_t count,
+			 int nthreads, bool use_arena) {
+  batchworker workers[nthreads];
+  pthread_t threads[nthreads];
+  double t0 = now();
+  for (int t = 0; t < nthreads; t++) {
+    workers[t] = (batchworker) {.data = corpus->data, .offsets = offsets,
+				.count = count, .first = (size_t) t,
+				.stride = (size_t) nthreads,
+				.nodes = use_arena ? new_arena(BATCH_ARENA) : NULL};
+    if (t && pthread_create(&threads[t], NULL, parse_share, &workers[t]))
+      PANIC("failed to start a parsing thread");
+  }
+  parse_share(&workers[0]);
+  for (int t = 1; t < nthreads; t++)
+    if (pthread_join(threads[t], NULL))
+      PANIC("failed to join a parsing thread");
+  double elapsed = now() - t0;
+  for (int t = 0; t < nthreads; t++) free_arena(workers[t].nodes);
+  return elapsed;
+}
+
+static void bench_batch(buffer *ignored) {
+  (void) ignored;
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxthreads = (nprocs > 4) ? (int) nprocs : 4;
+  uint64_t saved_state = rng_state;
+  buffer corpus = {NULL, 0, 0};
+  size_t capacity = 1024, count = 0;
+  size_t *offsets = xmalloc(capacity * sizeof(size_t));
+  if (!offsets) PANIC_OOM();
+  offsets[0] = 0;
+  while (corpus.len < option_megabytes * 1024 * 1024) {
+    gen_definition(&corpus, (int) count);
+    if (++count == capacity) {
+      capacity *= 2;
+      offsets = realloc(offsets, capacity * sizeof(size_t));
+      if (!offsets) PANIC_OOM();
+    }
+    offsets[count] = corpus.len;
+  }
+  rng_state = saved_state;
+
+  double sequential = 0;
+  for (int nthreads = 1; nthreads <= maxthreads; nthreads++) {
+    double best = 0, best_arena = 0;
+    for (int r = 0; r < option_repetitions; r++) {
+      double t = time_batch(&corpus, offsets, count, nthreads, false);
+      if ((r == 0) || (t < best)) best = t;
+      t = time_batch(&corpus, offsets, count, nthreads, true);
+      if ((r == 0) || (t < best_arena)) best_arena = t;
+    }
+    if (nthreads == 1) sequential = best;
+    char name[40];
+    snprintf(name, sizeof(name), "read_program_n, %d thread%s",
+	     nthreads, (nthreads == 1) ? "" : "s");
+    report(name, corpus.len, count, "prog", best);
+    report("  with an arena", corpus.len, count, "prog", best_arena);
+    printf("  %-28s %9.2fx\n", "speedup", sequential / best);
+    printf("  %-28s %9.2fx\n", "speedup with an arena", sequential / best_arena);
+  }
+  printf("  (%zu programs, %ld processors online)\n", count, nprocs);
+  free(offsets);
+  free(corpus.data);
+}
+
+// Editing the corpus one keystroke at a time, in the integers of its
+// expressions, as an editor would.  Replacing a digit moves nothing;
+// inserting or deleting one moves the lists after it on the path to
+// the edit, and with reparse_program_lazy(), leaves what is in them
+// to move later.  reparse_program() moves all of it, so it is timed
+// on fewer edits.
+#define REPARSE_EDITS 2000
+#define SETTLED_EDITS 20
+
+static double time_edits(source *src, ast **prog, size_t *sites, size_t nsites,
+			 bool replace, bool lazy) {
+  int nedits = lazy ? REPARSE_EDITS : SETTLED_EDITS;
+  size_t at = 0;
+  double t0 = now();
+  for (int e = 0; e < nedits; e++) {
+    source_edit edit;
+    // Each insertion is deleted by the next edit, so the sites stay put
+    if (replace || (e % 2 == 0)) at = sites[rng((uint32_t) nsites)];
+    if (replace) edit = (source_edit){at, 1, "7", 1};
+    else if (e % 2 == 0) edit = (source_edit){at, 0, "7", 1};
+    else edit = (source_edit){at, 1, "", 0};
+    *prog = lazy ? reparse_program_lazy(symbols, *prog, src, edit)
+                 : reparse_program(symbols, *prog, src, edit);
+  }
+  return (now() - t0) / nedits;
+}
+
+static void bench_reparse(buffer *corpus) {
+  uint64_t saved_state = rng_state;
+  source src = {.len = corpus->len, .capacity = corpus->len + 2};
+  src.text = xmalloc(src.capacity);
+  if (!src.text) PANIC_OOM();
+  memcpy(src.text, corpus->data, corpus->len + 1);
+  // The second digit of each integer, outside of comments
+  size_t nsites = 0;
+  size_t *sites = xmalloc(src.len * sizeof(size_t));
+  if (!sites) PANIC_OOM();
+  bool comment = false;
+  for (size_t i = 1; i + 1 < src.len; i++) {
+    if ((src.text[i] == '/') && (src.text[i + 1] == '/')) comment = true;
+    if (src.text[i] == '\n') comment = false;
+    if (!comment && (src.text[i - 1] == ' ' || src.text[i - 1] == '(')
+	&& isdigit((uint8_t) src.text[i]) && isdigit((uint8_t) src.text[i + 1]))
+      sites[nsites++] = i + 1;
+  }
+
+  double best_full = 0;
+  for (int r = 0; r < option_repetitions; r++) {
+    const char *ptr = src.text;
+    double t0 = now();
+    ast *prog = read_program_n(symbols, &ptr, src.text + src.len);
+    double t = now() - t0;
+    if (!prog || ast_errorp(prog)) PANIC("benchmark program did not parse");
+    free_ast(prog);
+    if ((r == 0) || (t < best_full)) best_full = t;
+  }
+  printf("  %-28s %9.1f us/edit\n", "read_program_n", best_full * 1e6);
+
+  const char *ptr = src.text;
+  ast *prog = read_program_n(symbols, &ptr, src.text + src.len);
+  const struct {const char *name; bool replace; bool lazy;} kinds[] = {
+    {"replace a digit", true, false},
+    {"insert or delete a digit", false, false},
+    {"  lazily", false, true},
+  };
+  for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+    reset_parser_statistics();
+    double best = 0;
+    for (int r = 0; r < option_repetitions; r++) {
+      double t = time_edits(&src, &prog, sites, nsites,
+			    kinds[k].replace, kinds[k].lazy);
+      if ((r == 0) || (t < best)) best = t;
+    }
+    printf("  %-28s %9.1f us/edit  %9.0fx faster",
+	   kinds[k].name, best * 1e6, best_full / best);
+    if (PARSER_STATS)
+      printf("  (%.0f bytes parsed per edit)",
+	     (double) parser_statistics().reparsed
+	     / ((kinds[k].lazy ? REPARSE_EDITS : SETTLED_EDITS)
+		* option_repetitions));
+    printf("\n");
+  }
+
+  // The edited tree is the same as a parse of the edited source
+  ptr = src.text;
+  ast *full = read_program_n(symbols, &ptr, src.text + src.len);
+  if (!ast_equal(prog, full)) PANIC("reparsed program differs from a parse");
+  free_ast(full);
+  free_ast(prog);
+  printf("  (%zu bytes, %zu sites for edits)\n", src.len, nsites);
+  rng_state = saved_state;
+  free(sites);
+  free(src.text);
+}
+
+typedef struct benchmark {
+  const char *name;
+  void (*fn)(buffer *corpus);
+} benchmark;
+
+static const benchmark benchmarks[] = {
+  {"lex", bench_lex},
+  {"classify", bench_classify},
+  {"lex-atmosphere", bench_lex_atmosphere},
+  {"identifiers", bench_identifiers},
+  {"parse", bench_parse},
+  {"wide", bench_wide},
+  {"stream", bench_stream},
+  {"parallel", bench_parallel},
+  {"batch", bench_batch},
+  {"reparse", bench_reparse},
+  {"backends", bench_backends},
+  {"structural", bench_structural},
+  {"strings", bench_strings},
+  {"integers", bench_integers},
+  {"utf8", bench_utf8},
+};
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/* ----------------------------------------------------------------------------- */
+/* Main                                                                          */
+/* ----------------------------------------------------------------------------- */
+
+static bool selected(int argc, char **argv, int first, const char *name) {
+  if (first >= argc) return true;
+  for (int i = first; i < argc; i++)
+    if (strcmp(argv[i], name) == 0) return true;
+  return false;
+}
+
+int main(int argc, char **argv) {
+  int i = 1;
+  for (; i < argc; i++) {
+    if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc))
+      option_megabytes = (size_t) atol(argv[++i]);
+    else if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc))
+      option_repetitions = atoi(argv[++i]);
+    else
+      break;
+  }
+  if ((option_megabytes < 1) || (option_repetitions < 1)) {
+    fprintf(stderr, "Usage: %s [-m megabytes] [-r repetitions] [benchmark ...]\n",
+	    argv[0]);
+    exit(1);
+  }
+
+  symbols = new_symtab();
+  buffer corpus = make_corpus(option_megabytes * 1024 * 1024);
+  printf("Corpus is %zu bytes\n", corpus.len);
+
+  for (size_t k = 0; k < NBENCHMARKS; k++) {
+    if (!selected(argc, argv, i, benchmarks[k].name)) continue;
+    printf("%s:\n", benchmarks[k].name);
+    benchmarks[k].fn(&corpus);
+  }
+
+  free_symtab(symbols);
+  free(corpus.data);
+  return 0;
+}
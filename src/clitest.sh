@@ -98,3 +98,165 @@ fi
 
 echo "Def/Let test passed"
 
+
+# A file named on the command line is mapped, not copied, so it does
+# not end in a NUL.  Make files that end exactly at a page boundary.
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+pagesize=$(getconf PAGESIZE)
+
+function page_file {
+    printf '%s' "$1" > "$2"
+    truncate -s "$pagesize" "$2"
+    # Pad with spaces, not the NULs that truncate writes
+    tr '\0' ' ' < "$2" > "$2.tmp" && mv "$2.tmp" "$2"
+}
+
+printf '%s' "$fact" > "$tmpdir/fact"
+if [[ "$(./parse "$tmpdir/fact")" != "$expected_factorial" ]]; then
+    echo "File argument test failed!"
+    exit -1
+fi
+
+page_file "$fact" "$tmpdir/page"
+if [[ "$(./parse -s "$tmpdir/page")" != "$expected_factorial_sexp" ]]; then
+    echo "File argument test (page boundary) failed!"
+    exit -1
+fi
+
+page_file "// Not closed
+f(a, " "$tmpdir/incomplete"
+status=0
+output=$(./parse "$tmpdir/incomplete" 2>&1) || status=$?
+if [[ $status -ne 2 ]]; then
+    echo "File argument test (syntax error) failed!"
+    exit -1
+fi
+contains "f(a,"
+contains "] at 2:"
+if [[ $allpassed -ne 1 ]]; then
+    echo "File argument test (error message) failed!"
+    exit -1
+fi
+
+echo "File argument test passed"
+
+
+# The token stream, as NDJSON and as binary records
+output=$(./parse -l <<< 'f(x) // hi')
+expected_tokens='{"type":"ID","offset":0,"length":1}
+{"type":"OPEN_PAREN","offset":1,"length":1}
+{"type":"ID","offset":2,"length":1}
+{"type":"CLOSE_PAREN","offset":3,"length":1}
+{"type":"WS","offset":4,"length":1}
+{"type":"COMMENT","offset":5,"length":5}
+{"type":"WS","offset":10,"length":1}
+{"type":"EOF","offset":11,"length":0}'
+if [[ "$output" != "$expected_tokens" ]]; then
+    echo "Token stream test failed!"
+    exit -1
+fi
+
+output=$(./parse -l <<< '"abc')
+contains '{"type":"UNTERMINATED_STRING","offset":0,"length":5,"pos":5}'
+page_file "$fact" "$tmpdir/page"
+output=$(./parse -l "$tmpdir/page" | tail -1)
+contains "{\"type\":\"EOF\",\"offset\":$pagesize,\"length\":0}"
+if [[ $allpassed -ne 1 ]]; then
+    echo "Token stream test (errors, files) failed!"
+    exit -1
+fi
+
+# 8 records of 16 bytes: offset, length, pos, type and flags
+output=$(./parse -l -b <<< 'f(x) // hi' | od -An -v -tu4 | tr -s ' \n' ' ')
+if [[ "$output" != " 0 1 0 8 1 1 0 0 2 1 0 8 3 1 0 1 4 1 0 7 5 5 0 6 10 1 0 7 11 0 0 11 " ]]; then
+    echo "Token stream test (binary) failed!"
+    exit -1
+fi
+
+# From stdin, input of any size is streamed, even when it arrives in
+# pieces, and gives the same tokens as from a file
+for i in $(seq 2000); do echo "$fact // $i"; done > "$tmpdir/long"
+if ! cmp -s <(./parse -l "$tmpdir/long") \
+     <( (head -c 70000 "$tmpdir/long"; sleep 0.2; tail -c +70001 "$tmpdir/long") | ./parse -l); then
+    echo "Token stream test (long stdin) failed!"
+    exit -1
+fi
+if ! cmp -s <(./parse -l -b "$tmpdir/long") <(./parse -l -b < "$tmpdir/long"); then
+    echo "Token stream test (long stdin, binary) failed!"
+    exit -1
+fi
+
+echo "Token stream test passed"
+
+
+# Deep nesting is an error, not a stack overflow, even with a small stack
+head -c 100000 /dev/zero | tr '\0' '{' > "$tmpdir/deep"
+status=0
+output=$(ulimit -s 1024 && ./parse "$tmpdir/deep" 2>&1) || status=$?
+if [[ $status -ne 2 ]]; then
+    echo "Nesting test failed!"
+    exit -1
+fi
+contains "[Nesting too deep]"
+output=$( (head -c 1000 /dev/zero | tr '\0' '{'; echo x; head -c 1000 /dev/zero | tr '\0' '}') | ./parse -s)
+contains "(Block (Block (Block x)))"
+if [[ $allpassed -ne 1 ]]; then
+    echo "Nesting test (error message) failed!"
+    exit -1
+fi
+
+# So are Curried applications and lets in a block, which nest without
+# brackets
+{ printf 'f'; head -c 300000 /dev/zero | tr '\0' '.' | sed 's/\./()/g'; } > "$tmpdir/curry"
+{ printf '{'; head -c 300000 /dev/zero | tr '\0' '.' | sed 's/\./let a = 1; /g'; printf 'a}'; } > "$tmpdir/lets"
+for deep in curry lets; do
+    status=0
+    output=$(./parse "$tmpdir/$deep" 2>&1) || status=$?
+    if [[ $status -ne 2 ]]; then
+	echo "Nesting test ($deep) failed!"
+	exit -1
+    fi
+    contains "[Nesting too deep]"
+done
+if [[ $allpassed -ne 1 ]]; then
+    echo "Nesting test (applications, lets) failed!"
+    exit -1
+fi
+
+echo "Nesting test passed"
+
+
+# Batch mode: one line per NUL-terminated program, errors included
+expected_batch='{"Application":[{"Identifier": "f"},1]}
+{"Error":{"type":"Empty input"}}
+{"Error":{"type":"Unexpected EOF","offset":8,"line":1,"col":9,"message":"expected expression"}}
+{"Error":{"type":"Unparsed input remaining","offset":4}}
+{"Let":[{"Identifier": "a"},1,{"Block":[]}]}'
+output=$(printf '%s\0' 'f(1)' ' // none' 'def x = ' 'f(1) g(2)' 'let a = 1' | ./parse -n 2>/dev/null)
+if [[ "$output" != "$expected_batch" ]]; then
+    echo "Batch test failed!"
+    exit -1
+fi
+output=$(printf 'f(1)\0x' | ./parse -n 2>&1)
+contains '{"Identifier": "x"}' "Parsed 2 programs (0 with errors)" "programs/sec"
+printf '%s\0' "$fact" "$fact" "(" > "$tmpdir/batch"
+output=$(./parse -n "$tmpdir/batch" 2>/dev/null | sed -n 2p)
+contains "$expected_factorial"
+if [[ $allpassed -ne 1 ]]; then
+    echo "Batch test (stdin, files) failed!"
+    exit -1
+fi
+
+# With threads, the results are the same, and in the same order
+for i in $(seq 1 20000); do printf 'f(%d, x%d)\0{\0' $i $i; done > "$tmpdir/many"
+./parse -n "$tmpdir/many" > "$tmpdir/one" 2>/dev/null
+output=$(./parse -n -j 4 "$tmpdir/many" 2>&1 >"$tmpdir/four")
+contains "Parsed 40000 programs (20000 with errors)" "with 4 threads"
+if [[ $allpassed -ne 1 ]] || ! cmp -s "$tmpdir/one" "$tmpdir/four" ||
+       ! ./parse -n -j 3 < "$tmpdir/many" 2>/dev/null | cmp -s - "$tmpdir/one"; then
+    echo "Batch test (threads) failed!"
+    exit -1
+fi
+
+echo "Batch test passed"
@@ -0,0 +1,502 @@
+//  -*- Mode: C; -*-
+//
+//  dfagen.c   Generates dfa.h, the state table of the table-driven lexer
+//
+//  (C) Jamie A. Jennings, 2024
+
+#include "lexer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+/*
+
+  Usage: dfagen > dfa.h
+
+  The generated lexer reads one byte per step:
+
+      state = dfa_table[state][dfa_classes[byte]]
+
+  until a transition says that the token has ended.  The rules below
+  are those of lex_token() in lexer.c, written one byte at a time.
+  The keywords and operators come from the token list in lexer.h, and
+  are recognized by the table itself: each is a path through a trie,
+  and the state records where in the trie the token is so far.
+
+  A state is the set of facts about the token so far that decide what
+  happens next (see 'mstate').  Starting from the empty token, we
+  apply every byte to every state we reach, until no new states
+  appear.  Bytes that act alike in every state then share a class, so
+  the table has one column per class instead of 257.
+
+  A transition may carry these actions, applied to the byte being
+  read at 's':
+
+      DFA_MARK1    first invalid UTF-8 (id) or invalid char (string)
+      DFA_MARK2    first control char in an identifier
+      DFA_STOP     the token has ended, before 's'; the low bits index
+                   dfa_accepts instead of naming a state
+      DFA_CONSUME  with STOP, the token ends after 's'
+      DFA_BACK     with STOP, the token ends at 's' - 1
+
+  The lengths of tokens and the values of integers are not part of the
+  table.  They are checked when the token ends, as they are in lex_token().
+
+*/
+
+// Byte 256 is the end of the input.  Byte 0 is a NUL before the end
+// of bounded input.
+#define EOF_BYTE 256
+#define NBYTES 257
+
+#define MAX_STATES 1024
+#define MAX_NODES 64
+
+#define DFA_INDEX   0x07FF
+#define DFA_MARK1   0x0800
+#define DFA_MARK2   0x1000
+#define DFA_CONSUME 0x2000
+#define DFA_BACK    0x4000
+#define DFA_STOP    0x8000
+
+#define _ENUM_NAME(a, b) #a,
+static const char *const TOKEN_ENUM_NAMES[] = {_TOKENS(_ENUM_NAME)};
+#undef _ENUM_NAME
+
+// Single-char tokens, which lexer.h names but does not spell
+static const struct {
+  char chr;
+  token_type type;
+} punctuation[] = {
+  {'(', TOKEN_OPENPAREN}, {')', TOKEN_CLOSEPAREN},
+  {'{', TOKEN_OPENBRACE}, {'}', TOKEN_CLOSEBRACE},
+  {',', TOKEN_COMMA}, {';', TOKEN_SEMICOLON},
+};
+
+#define NPUNCTUATION (sizeof(punctuation) / sizeof(punctuation[0]))
+
+/* ----------------------------------------------------------------------------- */
+/* Bytes                                                                         */
+/* ----------------------------------------------------------------------------- */
+
+static bool delimiters[NBYTES];
+
+static bool wsp(int b) {
+  return (b == ' ') || (b == '\t') || (b == '\n') || (b == '\r');
+}
+
+static bool digitp(int b) {
+  return (b >= '0') && (b <= '9');
+}
+
+// ASCII control chars, other than whitespace, and DEL
+static bool controlp(int b) {
+  return ((b > 0) && (b < 0x20) && !wsp(b)) || (b == 0x7F);
+}
+
+static bool continuationp(int b) {
+  return (b < EOF_BYTE) && ((b & 0xC0) == 0x80);
+}
+
+// As in lexer.c, leniently: only 0xC0-0xF7 need continuation bytes
+static int continuations(int b) {
+  if ((b >= 0xC0) && (b < 0xE0)) return 1;
+  if ((b >= 0xE0) && (b < 0xF0)) return 2;
+  if ((b >= 0xF0) && (b < 0xF8)) return 3;
+  return 0;
+}
+
+// Operators are the keywords spelled with ASCII punctuation, like "=>"
+static bool operatorp(const char *kw) {
+  return ((uint8_t) kw[0] < 0x80) && ispunct((uint8_t) kw[0]);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Keyword tries                                                                 */
+/* ----------------------------------------------------------------------------- */
+
+typedef struct trienode {
+  int child[256];		// -1 for none
+  bool leaf;			// no children
+  token_type type;		// TOKEN_NTOKENS if no token ends here
+} trienode;
+
+static trienode trie[MAX_NODES];
+static int nnodes = 0;
+static int id_root, op_root;
+
+static int new_node(void) {
+  if (nnodes == MAX_NODES) {
+    fprintf(stderr, "dfagen: too many trie nodes\n");
+    exit(1);
+  }
+  for (int b = 0; b < 256; b++) trie[nnodes].child[b] = -1;
+  trie[nnodes].leaf = true;
+  trie[nnodes].type = TOKEN_NTOKENS;
+  return nnodes++;
+}
+
+static int child(int node, int b) {
+  return ((node < 0) || (b >= 256)) ? -1 : trie[node].child[b];
+}
+
+static void insert(int root, const char *str, token_type type) {
+  int node = root;
+  for (const char *s = str; *s; s++) {
+    uint8_t b = (uint8_t) *s;
+    if (trie[node].child[b] < 0) {
+      int n = new_node();
+      trie[node].child[b] = n;
+      trie[node].leaf = false;
+    }
+    node = trie[node].child[b];
+  }
+  trie[node].type = type;
+}
+
+// Identifiers that are not keywords end at a node with no type
+static token_type id_type(int node) {
+  return ((node < 0) || (trie[node].type == TOKEN_NTOKENS))
+    ? TOKEN_IDENTIFIER : trie[node].type;
+}
+
+static void build_tries(void) {
+  id_root = new_node();
+  op_root = new_node();
+  for (size_t i = 0; i < NPUNCTUATION; i++) {
+    char str[2] = {punctuation[i].chr, '\0'};
+    insert(op_root, str, punctuation[i].type);
+  }
+  for (token_type t = KEYWORD_START; t < KEYWORD_END; t++)
+    insert(operatorp(TOKEN_NAMES[t]) ? op_root : id_root, TOKEN_NAMES[t], t);
+  // An operator or punctuation char ends an identifier or integer
+  delimiters[0] = delimiters[EOF_BYTE] = true;
+  for (int b = 0; b < 256; b++)
+    if (wsp(b) || (child(op_root, b) >= 0)) delimiters[b] = true;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* States                                                                        */
+/* ----------------------------------------------------------------------------- */
+
+typedef enum mode {
+  M_START, M_WS, M_COMMENT, M_SLASH, M_OP, M_ID, M_INT, M_STR
+} mode;
+
+static const char *const MODE_NAMES[] = {
+  "START", "WS", "COMMENT", "SLASH", "OP", "ID", "INT", "STR"
+};
+
+typedef struct mstate {
+  int  mode;
+  int  node;			// M_ID, M_OP: trie node, or -1 (M_ID)
+  int  cbytes;			// M_ID, M_STR: continuation bytes expected
+  bool bad_utf8;		// M_ID: DFA_MARK1 was done
+  bool bad_char;		// M_ID: DFA_MARK2 was done
+  bool slash;			// M_ID, M_INT: last byte was a slash
+  bool err;			// M_STR: DFA_MARK1 was done
+  bool escapes;			// M_STR: an escape was seen
+  bool after_esc;		// M_STR: last byte was an unescaped ESC
+} mstate;
+
+typedef enum dfa_category {
+  DFA_FIXED, DFA_WS, DFA_COMMENT, DFA_ID, DFA_INT,
+  DFA_STRING, DFA_STRING_ESC, DFA_STREOF,
+} dfa_category;
+
+static const char *const CATEGORY_NAMES[] = {
+  "DFA_FIXED", "DFA_WS", "DFA_COMMENT", "DFA_ID", "DFA_INT",
+  "DFA_STRING", "DFA_STRING_ESC", "DFA_STREOF",
+};
+
+typedef struct accept {
+  dfa_category category;
+  token_type type;
+} accept;
+
+static mstate states[MAX_STATES];
+static int nstates = 0;
+static accept accepts[MAX_STATES];
+static int naccepts = 0;
+static unsigned int table[MAX_STATES][NBYTES];
+
+static mstate new_state(int m) {
+  return (mstate) {.mode = m};
+}
+
+static bool same_state(mstate a, mstate b) {
+  return (a.mode == b.mode) && (a.node == b.node) && (a.cbytes == b.cbytes)
+    && (a.bad_utf8 == b.bad_utf8) && (a.bad_char == b.bad_char)
+    && (a.slash == b.slash) && (a.err == b.err)
+    && (a.escapes == b.escapes) && (a.after_esc == b.after_esc);
+}
+
+static unsigned int state_index(mstate st) {
+  for (int i = 0; i < nstates; i++)
+    if (same_state(states[i], st)) return i;
+  if (nstates == MAX_STATES) {
+    fprintf(stderr, "dfagen: too many states\n");
+    exit(1);
+  }
+  states[nstates] = st;
+  return nstates++;
+}
+
+static unsigned int accept_index(dfa_category category, token_type type) {
+  for (int i = 0; i < naccepts; i++)
+    if ((accepts[i].category == category) && (accepts[i].type == type))
+      return i;
+  accepts[naccepts] = (accept) {category, type};
+  return naccepts++;
+}
+
+static unsigned int go(mstate next, unsigned int flags) {
+  return state_index(next) | flags;
+}
+
+static unsigned int stop(unsigned int flags, dfa_category category,
+			 token_type type) {
+  return accept_index(category, type) | flags | DFA_STOP;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Transitions, following lex_token() and the functions it calls                 */
+/* ----------------------------------------------------------------------------- */
+
+// See lex_identifier().  The trie node is kept while a slash might
+// start a comment, so that "def//" is still a keyword.
+static unsigned int step_id(mstate st, int b) {
+  unsigned int flags = 0;
+  if (st.slash) {
+    if (b == '/') return stop(DFA_BACK, DFA_ID, id_type(st.node));
+    st.slash = false;
+    st.node = child(st.node, '/');
+  }
+  if (st.cbytes) {
+    if (continuationp(b)) {
+      st.cbytes--;
+      st.node = child(st.node, b);
+      return go(st, 0);
+    }
+    flags |= DFA_MARK1;
+    st.bad_utf8 = true;
+    st.cbytes = 0;
+    st.node = -1;
+  }
+  if (delimiters[b]) return stop(flags, DFA_ID, id_type(st.node));
+  if (b == '/') {
+    st.slash = true;
+    return go(st, flags);
+  }
+  if (controlp(b)) {
+    if (!st.bad_char) flags |= DFA_MARK2;
+    st.bad_char = true;
+    st.node = -1;
+  } else {
+    if ((b >= 0x80) && !st.bad_utf8) st.cbytes = continuations(b);
+    st.node = child(st.node, b);
+  }
+  return go(st, flags);
+}
+
+// See lex_integer().  Only the end is found here.
+static unsigned int step_int(mstate st, int b) {
+  if (st.slash) {
+    if (b == '/') return stop(DFA_BACK, DFA_INT, TOKEN_INTEGER);
+    st.slash = false;
+  }
+  if (delimiters[b]) return stop(0, DFA_INT, TOKEN_INTEGER);
+  st.slash = (b == '/');
+  return go(st, 0);
+}
+
+// See lex_string()
+static unsigned int step_str(mstate st, int b) {
+  unsigned int flags = 0;
+  if (st.cbytes) {
+    if (continuationp(b)) {
+      st.cbytes--;
+      return go(st, 0);
+    }
+    flags |= DFA_MARK1;
+    st.err = true;
+    st.cbytes = 0;
+  }
+  if (st.after_esc) {
+    // The escaped byte cannot end the string
+    st.after_esc = false;
+  } else if (b == '"') {
+    return stop(flags | DFA_CONSUME,
+		st.escapes ? DFA_STRING_ESC : DFA_STRING, TOKEN_STRING);
+  } else if (b == ESC) {
+    st.escapes = true;
+    st.after_esc = true;
+    return go(st, flags);
+  }
+  if (b == EOF_BYTE) return stop(flags, DFA_STREOF, TOKEN_BAD_STREOF);
+  if ((b == 0) && !st.err) {
+    flags |= DFA_MARK1;
+    st.err = true;
+  }
+  if ((b >= 0x80) && !st.err) st.cbytes = continuations(b);
+  return go(st, flags);
+}
+
+// Operators are matched longest first, as "=>" is in lex_token()
+static unsigned int step_op(int node, int b) {
+  int next = child(node, b);
+  if (next < 0) {
+    if (trie[node].type == TOKEN_NTOKENS) {
+      fprintf(stderr, "dfagen: an operator prefix is not a token\n");
+      exit(1);
+    }
+    return stop(0, DFA_FIXED, trie[node].type);
+  }
+  if (trie[next].leaf) return stop(DFA_CONSUME, DFA_FIXED, trie[next].type);
+  mstate st = new_state(M_OP);
+  st.node = next;
+  return go(st, 0);
+}
+
+static unsigned int step(mstate st, int b) {
+  mstate id = new_state(M_ID);
+  switch (st.mode) {
+    case M_START:
+      if (b == EOF_BYTE) return stop(0, DFA_FIXED, TOKEN_EOF);
+      if (b == 0) return stop(DFA_CONSUME, DFA_FIXED, TOKEN_BAD_CHAR);
+      if (wsp(b)) return go(new_state(M_WS), 0);
+      if (b == '"') return go(new_state(M_STR), 0);
+      if (digitp(b) || (b == '+') || (b == '-')) return go(new_state(M_INT), 0);
+      if (b == '/') return go(new_state(M_SLASH), 0);
+      if (child(op_root, b) >= 0) return step_op(op_root, b);
+      id.node = id_root;
+      return step_id(id, b);
+    case M_WS:
+      if (wsp(b)) return go(st, 0);
+      return stop(0, DFA_WS, TOKEN_WS);
+    case M_COMMENT:
+      if ((b == '\n') || (b == 0) || (b == EOF_BYTE))
+	return stop(0, DFA_COMMENT, TOKEN_COMMENT);
+      return go(st, 0);
+    case M_SLASH:
+      // A slash that does not start a comment starts an identifier
+      if (b == '/') return go(new_state(M_COMMENT), 0);
+      id.node = child(id_root, '/');
+      return step_id(id, b);
+    case M_OP:  return step_op(st.node, b);
+    case M_ID:  return step_id(st, b);
+    case M_INT: return step_int(st, b);
+    case M_STR: return step_str(st, b);
+  }
+  fprintf(stderr, "dfagen: invalid mode %d\n", st.mode);
+  exit(1);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Output                                                                        */
+/* ----------------------------------------------------------------------------- */
+
+static int byte_class[NBYTES];
+static int nclasses = 0;
+
+// Bytes whose columns of the table are equal share a class
+static void find_classes(void) {
+  int first[NBYTES];		// a byte of each class
+  for (int b = 0; b < NBYTES; b++) {
+    int c;
+    for (c = 0; c < nclasses; c++) {
+      int s;
+      for (s = 0; s < nstates; s++)
+	if (table[s][b] != table[s][first[c]]) break;
+      if (s == nstates) break;
+    }
+    if (c == nclasses) first[nclasses++] = b;
+    byte_class[b] = c;
+  }
+}
+
+static void describe(mstate st) {
+  printf("  // %d: %s", state_index(st), MODE_NAMES[st.mode]);
+  if ((st.mode == M_ID) || (st.mode == M_OP)) printf(" node %d", st.node);
+  if (st.cbytes) printf(" cbytes %d", st.cbytes);
+  if (st.bad_utf8) printf(" bad_utf8");
+  if (st.bad_char) printf(" bad_char");
+  if (st.slash) printf(" slash");
+  if (st.err) printf(" err");
+  if (st.escapes) printf(" escapes");
+  if (st.after_esc) printf(" after_esc");
+  printf("\n");
+}
+
+static void print_classes(const char *name, bool nul_is_eof) {
+  printf("static const uint8_t %s[256] = {", name);
+  for (int b = 0; b < 256; b++) {
+    int c = ((b == 0) && nul_is_eof) ? byte_class[EOF_BYTE] : byte_class[b];
+    printf("%s%2d,", (b % 16) ? " " : "\n  ", c);
+  }
+  printf("\n};\n\n");
+}
+
+static void generate(void) {
+  int first[NBYTES];
+  int ncols = 0;
+  for (int b = 0; b < NBYTES; b++)
+    if (byte_class[b] == ncols) first[ncols++] = b;
+
+  printf("// Generated by dfagen from the tokens in lexer.h.  Do not edit.\n\n");
+  printf("#define DFA_NSTATES %d\n", nstates);
+  printf("#define DFA_NCLASSES %d\n", nclasses);
+  printf("#define DFA_CLASS_EOF %d\n", byte_class[EOF_BYTE]);
+  printf("#define DFA_START 0\n\n");
+  printf("#define DFA_INDEX   0x%04X\n", DFA_INDEX);
+  printf("#define DFA_MARK1   0x%04X\n", DFA_MARK1);
+  printf("#define DFA_MARK2   0x%04X\n", DFA_MARK2);
+  printf("#define DFA_CONSUME 0x%04X\n", DFA_CONSUME);
+  printf("#define DFA_BACK    0x%04X\n", DFA_BACK);
+  printf("#define DFA_STOP    0x%04X\n\n", DFA_STOP);
+
+  printf("typedef enum dfa_category {\n");
+  for (size_t i = 0; i < sizeof(CATEGORY_NAMES) / sizeof(CATEGORY_NAMES[0]); i++)
+    printf("  %s,\n", CATEGORY_NAMES[i]);
+  printf("} dfa_category;\n\n");
+  printf("typedef struct dfa_accept {\n"
+	 "  dfa_category category;\n"
+	 "  token_type type;\n"
+	 "} dfa_accept;\n\n");
+  printf("static const dfa_accept dfa_accepts[%d] = {\n", naccepts);
+  for (int i = 0; i < naccepts; i++)
+    printf("  {%s, %s},\n", CATEGORY_NAMES[accepts[i].category],
+	   TOKEN_ENUM_NAMES[accepts[i].type]);
+  printf("};\n\n");
+
+  printf("// For input that ends at a NUL\n");
+  print_classes("dfa_classes", true);
+  printf("// For input that ends at a pointer, before which a NUL is a char\n");
+  print_classes("dfa_classes_n", false);
+
+  printf("static const uint16_t dfa_table[DFA_NSTATES][DFA_NCLASSES] = {\n");
+  for (int s = 0; s < nstates; s++) {
+    describe(states[s]);
+    printf("  {");
+    for (int c = 0; c < ncols; c++)
+      printf("%s0x%04X", c ? ", " : "", table[s][first[c]]);
+    printf("},\n");
+  }
+  printf("};\n");
+}
+
+int main(void) {
+  build_tries();
+  state_index(new_state(M_START));
+  // New states are appended as they are found
+  for (int s = 0; s < nstates; s++)
+    for (int b = 0; b < NBYTES; b++)
+      table[s][b] = step(states[s], b);
+  if ((nstates > DFA_INDEX) || (naccepts > DFA_INDEX)) {
+    fprintf(stderr, "dfagen: too many states for the table encoding\n");
+    exit(1);
+  }
+  find_classes();
+  generate();
+  return 0;
+}
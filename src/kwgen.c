@@ -0,0 +1,111 @@
+//  -*- Mode: C; -*-
+//
+//  kwgen.c   Generates keywords.h, the keyword lookup table
+//
+//  (C) Jamie A. Jennings, 2024
+
+#include "lexer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+/*
+
+  Usage: kwgen > keywords.h
+
+  The keywords are the tokens from KEYWORD_START to KEYWORD_END in
+  lexer.h.  We search for a perfect hash of the length and the first
+  and last bytes of each keyword:
+
+      (first + last * A + len * B) & (size - 1)
+
+  trying the smallest table sizes first.  The generated table lets
+  is_keyword() reject any identifier with at most one comparison.
+
+*/
+
+// The enum names, e.g. "TOKEN_LAMBDA", for the generated code
+#define _ENUM_NAME(a, b) #a,
+static const char *const TOKEN_ENUM_NAMES[] = {_TOKENS(_ENUM_NAME)};
+#undef _ENUM_NAME
+
+#define NKEYWORDS (KEYWORD_END - KEYWORD_START)
+#define MAX_TABLE_SIZE 256
+#define MAX_MULTIPLIER 64
+
+static unsigned int hash(const char *kw, unsigned int A, unsigned int B,
+			 unsigned int size) {
+  size_t len = strlen(kw);
+  unsigned int first = (uint8_t) kw[0];
+  unsigned int last = (uint8_t) kw[len - 1];
+  return (first + last * A + (unsigned int) len * B) & (size - 1);
+}
+
+static bool perfectp(unsigned int A, unsigned int B, unsigned int size) {
+  bool used[MAX_TABLE_SIZE] = {false};
+  for (token_type t = KEYWORD_START; t < KEYWORD_END; t++) {
+    unsigned int h = hash(TOKEN_NAMES[t], A, B, size);
+    if (used[h]) return false;
+    used[h] = true;
+  }
+  return true;
+}
+
+// Non-ASCII bytes are written as hex escapes.  A hex escape does not
+// end until a non-hex digit, so the string is split after one.
+static void print_string(const char *str) {
+  bool after_escape = false;
+  printf("\"");
+  for (const char *s = str; *s; s++) {
+    if (((uint8_t) *s < 0x80) && (*s != '"') && (*s != ESC)) {
+      if (after_escape && isxdigit((uint8_t) *s)) printf("\" \"");
+      printf("%c", *s);
+      after_escape = false;
+    } else {
+      printf("\\x%02x", (uint8_t) *s);
+      after_escape = true;
+    }
+  }
+  printf("\"");
+}
+
+static void generate(unsigned int A, unsigned int B, unsigned int size) {
+  size_t maxlen = 0;
+  for (token_type t = KEYWORD_START; t < KEYWORD_END; t++)
+    if (strlen(TOKEN_NAMES[t]) > maxlen) maxlen = strlen(TOKEN_NAMES[t]);
+
+  printf("// Generated by kwgen from the keywords in lexer.h.  Do not edit.\n\n");
+  printf("#define KEYWORD_TABLE_SIZE %u\n", size);
+  printf("#define KEYWORD_MAXLEN %zu\n\n", maxlen);
+  printf("#define keyword_hash(len, first, last)\t\t\t\t\\\n"
+	 "  (((first) + (last) * %uu + (len) * %uu) & %uu)\n\n",
+	 A, B, size - 1);
+  printf("typedef struct keyword_entry {\n"
+	 "  size_t len;\t\t\t// 0 for an empty slot\n"
+	 "  token_type type;\n"
+	 "  const char text[KEYWORD_MAXLEN + 1];\n"
+	 "} keyword_entry;\n\n");
+  printf("static const keyword_entry keyword_table[KEYWORD_TABLE_SIZE] = {\n");
+  for (token_type t = KEYWORD_START; t < KEYWORD_END; t++) {
+    const char *kw = TOKEN_NAMES[t];
+    printf("  [%u] = {%zu, %s, ", hash(kw, A, B, size), strlen(kw),
+	   TOKEN_ENUM_NAMES[t]);
+    print_string(kw);
+    printf("},\n");
+  }
+  printf("};\n");
+}
+
+int main(void) {
+  for (unsigned int size = 1; size <= MAX_TABLE_SIZE; size *= 2) {
+    if (size < NKEYWORDS) continue;
+    for (unsigned int B = 0; B < MAX_MULTIPLIER; B++)
+      for (unsigned int A = 0; A < MAX_MULTIPLIER; A++)
+	if (perfectp(A, B, size)) {
+	  generate(A, B, size);
+	  return 0;
+	}
+  }
+  fprintf(stderr, "kwgen: no perfect hash found for the keywords\n");
+  return 1;
+}
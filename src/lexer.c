@@ -5,12 +5,18 @@
 //  (C) Jamie A. Jennings, 2024
 
 #include "lexer.h"
+#include "keywords.h"
+#include "dfa.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 
+#ifndef LEXER_DFA
+#define LEXER_DFA 0
+#endif
+
 size_t token_length(token tok) {
   if (!tok.start) PANIC_NULL();
   return (size_t) tok.len;
@@ -22,6 +28,85 @@ ulen_t to_ulen(ssize_t len) {
   return len;
 }
 
+/* ----------------------------------------------------------------------------- */
+/* Character classes                                                             */
+/* ----------------------------------------------------------------------------- */
+
+// Every input byte is classified by a single table lookup.  The
+// classes at or after CC_WS are delimiters: they end an identifier or
+// an integer.  A slash is a delimiter only when it starts a comment,
+// so it gets its own class and the caller checks the next byte.
+// Control characters and non-ASCII bytes may appear in an identifier
+// only to be reported as errors or checked as UTF-8, so they have
+// classes of their own too.  Unlisted bytes default to CC_IDCHAR.
+
+typedef enum char_class {
+  CC_IDCHAR = 0,
+  CC_DIGIT,
+  CC_SIGN,
+  CC_QUOTE,
+  CC_SLASH,
+  CC_CONTROL,
+  CC_UTF8,
+  // Delimiters:
+  CC_WS,
+  CC_OPENPAREN,
+  CC_CLOSEPAREN,
+  CC_OPENBRACE,
+  CC_CLOSEBRACE,
+  CC_COMMA,
+  CC_SEMICOLON,
+  CC_EQUALS,
+  CC_NUL,
+} char_class;
+
+#define CC_FIRST_DELIMITER CC_WS
+
+#define ROW(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+
+static const uint8_t char_classes[256] = {
+  ['\0'] = CC_NUL,
+  [0x01] = CC_CONTROL, CC_CONTROL, CC_CONTROL, CC_CONTROL,
+	   CC_CONTROL, CC_CONTROL, CC_CONTROL, CC_CONTROL,
+  [0x0B] = CC_CONTROL, CC_CONTROL,
+  [0x0E] = CC_CONTROL, CC_CONTROL, ROW(CC_CONTROL),
+  [0x7F] = CC_CONTROL,
+  [0x80] = ROW(CC_UTF8), ROW(CC_UTF8), ROW(CC_UTF8), ROW(CC_UTF8),
+	   ROW(CC_UTF8), ROW(CC_UTF8), ROW(CC_UTF8), ROW(CC_UTF8),
+  ['\t'] = CC_WS, ['\n'] = CC_WS, ['\r'] = CC_WS, [' '] = CC_WS,
+  ['('] = CC_OPENPAREN, [')'] = CC_CLOSEPAREN,
+  ['{'] = CC_OPENBRACE, ['}'] = CC_CLOSEBRACE,
+  [','] = CC_COMMA, [';'] = CC_SEMICOLON, ['='] = CC_EQUALS,
+  ['"'] = CC_QUOTE, ['/'] = CC_SLASH,
+  ['+'] = CC_SIGN, ['-'] = CC_SIGN,
+  ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT,
+  ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT,
+  ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+};
+
+#define classify(c) ((char_class) char_classes[(uint8_t) (c)])
+
+/* ----------------------------------------------------------------------------- */
+/* The end of the input                                                          */
+/* ----------------------------------------------------------------------------- */
+
+// Every lexing function takes an 'end' pointer.  When it is NULL, the
+// input ends at its NUL terminator.  Otherwise, the input ends at
+// 'end', which need not point to a NUL (or to readable memory at
+// all), and a NUL byte before 'end' is an error.
+//
+// The byte at 's', where 'end' reads as a NUL:
+#define byte_at(s, end) (((end) && ((s) == (end))) ? '\0' : *(s))
+
+static bool eofp(const char *s, const char *end) {
+  return end ? (s == end) : (*s == '\0');
+}
+
+// The lexer is inlined into both read_token(), where 'end' is NULL,
+// and read_token_n(), so that the compiler can remove the checks for
+// 'end' from the usual case.
+#define LEXER_INLINE __attribute__((always_inline)) static inline
+
 /* ----------------------------------------------------------------------------- */
 /* Character predicates, named in lisp style, with a trailing 'p'                */
 /* ----------------------------------------------------------------------------- */
@@ -29,76 +114,334 @@ ulen_t to_ulen(ssize_t len) {
 #define PREDICATE(name, chr)					\
   static bool name(const char *c) { return (*c == chr); }
 
-PREDICATE(eofp, '\0');
 PREDICATE(quotep, '\"');
-PREDICATE(commap, ',');
-PREDICATE(semicolonp, ';');
-PREDICATE(newlinep, '\n');
-PREDICATE(returnp, '\r');
-PREDICATE(spacep, ' ');
-PREDICATE(tabp, '\t');
-PREDICATE(openparenp, '(');
-PREDICATE(closeparenp, ')');
-PREDICATE(openbracep, '{');
-PREDICATE(closebracep, '}');
 PREDICATE(minusp, '-');
 PREDICATE(plusp, '+');
-PREDICATE(equalsp, '=');
-static bool arrowp(const char *s) { 
-  return (*s == '=') && (*s) && (*(s+1) == '>');
-}
 
 static bool digitp(const char *c) {
-  return ((*c >= '0') && (*c <= '9'));
+  return classify(*c) == CC_DIGIT;
 }
 
-static bool whitespacep(const char *c) {
-  return newlinep(c) || spacep(c) || tabp(c) || returnp(c);
+// Requires c != end
+static bool commentp(const char *c, const char *end) {
+  return (*c == '/') && (byte_at(c + 1, end) == '/');
 }
 
-static bool commentp(const char *c) {
-  return (*c++ == '/') && (*c == '/');
+// Returns the first byte at or after 's' that is not in one of the
+// ordinary classes (up to CC_QUOTE) that make up most identifiers and
+// integers.  This is the hot loop of the lexer, so the check for
+// 'end' is made once, not per byte.
+LEXER_INLINE const char *skip_ordinary(const char *s, const char *end) {
+  if (end)
+    while ((s != end) && (classify(*s) <= CC_QUOTE)) s++;
+  else
+    while (classify(*s) <= CC_QUOTE) s++;
+  return s;
 }
 
-static bool delimiterp(const char *c) {
-  // equals is a prefix of arrow, so we must test for it first
-  return whitespacep(c)
-    || openparenp(c) || closeparenp(c)
-    || openbracep(c) || closebracep(c)
-    || commap(c)     || semicolonp(c)
-    || arrowp(c)     || equalsp(c)
-    || commentp(c)   || eofp(c);
+// Returns a pointer to the first delimiter at or after 's'.  Equals
+// is a prefix of arrow, so both are found by the CC_EQUALS class.
+LEXER_INLINE const char *find_delimiter(const char *s, const char *end) {
+  char_class cc;
+  while (true) {
+    s = skip_ordinary(s, end);
+    cc = classify(byte_at(s, end));
+    if (cc >= CC_FIRST_DELIMITER) return s;
+    if ((cc == CC_SLASH) && commentp(s, end)) return s;
+    s++;
+  }
 }
 
-// FUTURE: Build these using ESC (from lexer.h)
-static const char *string_escape_chars = "\\\"rnt";
-static const char *string_escape_values = "\\\"\r\n\t";
+/* ----------------------------------------------------------------------------- */
+/* Decoding integers                                                             */
+/* ----------------------------------------------------------------------------- */
 
-// Returns the unescaped value, e.g. \n ==> 10, or -1 on error.
-static int unescape_char(const char *sptr) {
-  const char *pos = strchr(string_escape_chars, *sptr);
-  return (pos && (!eofp(pos))) ? 
-    string_escape_values[pos - string_escape_chars] : -1;
+/*
+  Integer literals are decoded by the lexer, 8 digits at a time where
+  possible, by treating 8 bytes as one uint64_t ("SIMD within a
+  register").  The bytes are loaded with memcpy, little-endian, and
+  only when all 8 lie before the end of the token, which the lexer has
+  already found, so we never read past the input.
+*/
+
+#define SWAR_ONES(b) (0x0101010101010101ULL * (b))
+
+// True when all 8 bytes are in '0'..'9'
+static bool swar_digitsp(uint64_t x) {
+  return ((x & SWAR_ONES(0xF0)) |
+	  (((x + SWAR_ONES(0x06)) & SWAR_ONES(0xF0)) >> 4)) == SWAR_ONES(0x33);
 }
 
-// This is not a predicate.  It returns the escaped char value, or the
-// NUL character to indicate an error.
-static char escape_char(const char *c) {
-  char *pos = strchr(string_escape_values, *c);
-  return (pos && (!eofp(pos))) ?
-    string_escape_chars[pos - string_escape_values] : '\0';
+// The value of 8 ASCII digits, the first (most significant) of which
+// is in the low byte.  Adjacent digits are combined into pairs, then
+// pairs into 4-digit groups, then the two groups into the result.
+static uint32_t swar_value(uint64_t x) {
+  x -= SWAR_ONES('0');
+  x = (x * 10) + (x >> 8);
+  x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  return (uint32_t) x;
+}
+
+static uint64_t load8(const char *s) {
+  uint64_t x;
+  memcpy(&x, s, sizeof(x));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  x = __builtin_bswap64(x);
+#endif
+  return x;
+}
+
+// Skip the digits starting at 's' and before 'end', accumulating
+// their value into '*n'.  Sets '*overflow' if the value does not fit
+// in a uint64_t.  Returns a pointer to the first non-digit, or 'end'.
+static const char *scan_digits(const char *s, const char *end,
+			       uint64_t *n, bool *overflow) {
+  while ((end - s) >= 8) {
+    uint64_t x = load8(s);
+    if (!swar_digitsp(x)) break;
+    *overflow |= __builtin_mul_overflow(*n, 100000000U, n);
+    *overflow |= __builtin_add_overflow(*n, swar_value(x), n);
+    s += 8;
+  }
+  while ((s < end) && (classify(*s) == CC_DIGIT)) {
+    *overflow |= __builtin_mul_overflow(*n, 10U, n);
+    *overflow |= __builtin_add_overflow(*n, (unsigned int) (*s - '0'), n);
+    s++;
+  }
+  return s;
+}
+
+// True if 'n' (with a sign) does not fit in an int64_t
+static bool int64_overflowp(uint64_t n, bool negative) {
+  return negative ? (n > (uint64_t) INT64_MAX + 1) : (n > INT64_MAX);
+}
+
+// The magnitude 'n' is known to fit
+static int64_t int64_value(uint64_t n, bool negative) {
+  return negative ? (int64_t) (0 - n) : (int64_t) n;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Vectorized scanning                                                           */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  Whitespace, comment bodies, and the plain ASCII runs inside string
+  literals are skipped a block at a time (32 bytes with AVX2, 16 with
+  SSE2).  Each block is loaded from an
+  ALIGNED address, so a load never crosses a page boundary and can
+  never fault, even though it may read bytes before the start of the
+  scan or after the terminating NUL.  Those bytes are masked off.
+  When the input has an 'end', the scan also stops there, and no
+  block that starts at or after 'end' is loaded, so 'end' may be the
+  end of a mapped page.
+  Because such reads fall outside the object being scanned, the
+  address sanitizer must be told to ignore these functions.
+
+  Other platforms use the scalar loops.  To build the AVX2 kernels on
+  a machine that has them, use e.g. 'make release ARCH_FLAGS=-mavx2'.
+*/
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define VECTOR_SCAN 1
+  #define VBLOCK 32
+  #define VBLOCK_ALL 0xFFFFFFFFu
+  typedef __m256i vblock;
+  #define vload(p) _mm256_load_si256((const __m256i *) (p))
+  #define vmatch(v, c)							\
+    ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))))
+  #define vloadu(p) _mm256_loadu_si256((const __m256i *) (p))
+  #define vhighbits(v) ((uint32_t) _mm256_movemask_epi8(v))
+  #define vgreater(v, c)						\
+    ((uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8((v), _mm256_set1_epi8(c))))
+  #define vless(v, c)							\
+    ((uint32_t) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(c), (v))))
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define VECTOR_SCAN 1
+  #define VBLOCK 16
+  #define VBLOCK_ALL 0xFFFFu
+  typedef __m128i vblock;
+  #define vload(p) _mm_load_si128((const __m128i *) (p))
+  #define vmatch(v, c)							\
+    ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8((v), _mm_set1_epi8(c))))
+  #define vloadu(p) _mm_loadu_si128((const __m128i *) (p))
+  #define vhighbits(v) ((uint32_t) _mm_movemask_epi8(v))
+  #define vgreater(v, c)						\
+    ((uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8((v), _mm_set1_epi8(c))))
+  #define vless(v, c)							\
+    ((uint32_t) _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(c), (v))))
+#else
+  #define VECTOR_SCAN 0
+#endif
+
+#if VECTOR_SCAN
+
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+
+// Bit i is set when byte i of the block is NOT whitespace
+static inline uint32_t non_whitespace_mask(vblock v) {
+  return VBLOCK_ALL &
+    ~(vmatch(v, ' ') | vmatch(v, '\n') | vmatch(v, '\t') | vmatch(v, '\r'));
+}
+
+// Bit i is set when byte i of the block ends a comment
+static inline uint32_t newline_mask(vblock v) {
+  return vmatch(v, '\n') | vmatch(v, '\0');
+}
+
+// Bit i is set when byte i of the block needs a closer look inside a
+// string: a quote, an escape, a NUL, or a non-ASCII byte
+static inline uint32_t string_special_mask(vblock v) {
+  return vmatch(v, '"') | vmatch(v, ESC) | vmatch(v, '\0') | vhighbits(v);
+}
+
+// Bit i is set when byte i of the block is not ASCII, or is NUL
+static inline uint32_t utf8_special_mask(vblock v) {
+  return vmatch(v, '\0') | vhighbits(v);
+}
+
+// Checks a block that starts at the beginning of a UTF-8 sequence.
+// Returns the number of bytes that are valid up to the start of the
+// last sequence (which may continue into the next block), or 0 if
+// the block contains a NUL or an error and must be walked byte by
+// byte.
+//
+// The comparisons are signed, so 0x80-0xBF are the continuation
+// bytes, and the leads of 2, 3, and 4 byte sequences are 0xC0-0xF7,
+// 0xE0-0xF7, and 0xF0-0xF7.  Every byte after a lead, up to the
+// length of its sequence, must be a continuation byte.  Because a
+// continuation byte is never a lead, sequences cannot overlap unless
+// there is an error, so this can be computed for all bytes at once.
+static inline ssize_t utf8_block(vblock v) {
+  uint32_t below_f8 = vless(v, (char) 0xF8);
+  uint64_t lead2 = vgreater(v, (char) 0xBF) & below_f8;
+  uint64_t lead3 = vgreater(v, (char) 0xDF) & below_f8;
+  uint64_t lead4 = vgreater(v, (char) 0xEF) & below_f8;
+  uint64_t continuation = vless(v, (char) 0xC0);
+  uint64_t required = (lead2 << 1) | (lead3 << 2) | (lead4 << 3);
+  if ((required & ~continuation & VBLOCK_ALL) || vmatch(v, '\0')) return 0;
+  uint64_t last = (lead2 & ((uint64_t) 1 << (VBLOCK - 1)))
+    | (lead3 & ((uint64_t) 3 << (VBLOCK - 2)))
+    | (lead4 & ((uint64_t) 7 << (VBLOCK - 3)));
+  return last ? __builtin_ctzll(last) : VBLOCK;
+}
+
+// Mask of the bits at or above position 'n' in a block
+#define bits_from(n) (~(uint32_t) 0 << (n))
+
+// Bit i is set when byte i of the block is at 'end'.  A NULL 'end' is
+// never within a block.
+static inline uint32_t end_mask(const char *block, const char *end) {
+  uintptr_t distance = (uintptr_t) end - (uintptr_t) block;
+  return (end && (distance < VBLOCK)) ? (uint32_t) 1 << distance : 0;
+}
+
+// Returns the first byte at or after 's' that is not whitespace
+NO_SANITIZE_ADDRESS
+static const char *skip_whitespace_run(const char *s, const char *end) {
+  uintptr_t offset = (uintptr_t) s % VBLOCK;
+  const char *block = s - offset;
+  uint32_t stop = (non_whitespace_mask(vload(block)) | end_mask(block, end))
+    & bits_from(offset);
+  while (!stop) {
+    block += VBLOCK;
+    if (block == end) return end;
+    stop = non_whitespace_mask(vload(block)) | end_mask(block, end);
+  }
+  return block + __builtin_ctz(stop);
+}
+
+// Returns the first newline or NUL at or after 's'
+NO_SANITIZE_ADDRESS
+static const char *skip_to_newline(const char *s, const char *end) {
+  if (s == end) return s;
+  uintptr_t offset = (uintptr_t) s % VBLOCK;
+  const char *block = s - offset;
+  uint32_t stop = (newline_mask(vload(block)) | end_mask(block, end))
+    & bits_from(offset);
+  while (!stop) {
+    block += VBLOCK;
+    if (block == end) return end;
+    stop = newline_mask(vload(block)) | end_mask(block, end);
+  }
+  return block + __builtin_ctz(stop);
+}
+
+// Returns the first byte at or after 's' that string_special_mask()
+// would flag
+NO_SANITIZE_ADDRESS
+static const char *skip_string_plain(const char *s, const char *end) {
+  if (s == end) return s;
+  uintptr_t offset = (uintptr_t) s % VBLOCK;
+  const char *block = s - offset;
+  uint32_t stop = (string_special_mask(vload(block)) | end_mask(block, end))
+    & bits_from(offset);
+  while (!stop) {
+    block += VBLOCK;
+    if (block == end) return end;
+    stop = string_special_mask(vload(block)) | end_mask(block, end);
+  }
+  return block + __builtin_ctz(stop);
+}
+
+#else
+
+static const char *skip_whitespace_run(const char *s, const char *end) {
+  while (classify(byte_at(s, end)) == CC_WS) s++;
+  return s;
 }
 
-static const char *scan(bool pred(const char *), const char *s) {
-  while (*s && pred(s)) s++;
+static const char *skip_to_newline(const char *s, const char *end) {
+  char c;
+  while ((c = byte_at(s, end)) && (c != '\n')) s++;
   return s;
 }
 
-static const char *until(bool pred(const char *), const char *s) {
-  while (*s && !pred(s)) s++;
+static const char *skip_string_plain(const char *s, const char *end) {
+  char c;
+  while ((c = byte_at(s, end)) && (c != '"') && (c != ESC) && ((uint8_t) c < 0x80))
+    s++;
   return s;
 }
 
+#endif
+
+// Returns the first byte at or after 's' that is not whitespace
+LEXER_INLINE const char *skip_whitespace(const char *s, const char *end) {
+  // Most runs are a single space, which is not worth a vector load
+  if (classify(byte_at(s, end)) != CC_WS) return s;
+  s++;
+  if (classify(byte_at(s, end)) != CC_WS) return s;
+  return skip_whitespace_run(s, end);
+}
+
+// The value of each escape sequence, indexed by the char after ESC,
+// e.g. unescape_table['n'] is 10.  Zero marks an invalid sequence.
+static const char unescape_table[256] = {
+  [ESC] = ESC, ['"'] = '"', ['r'] = '\r', ['n'] = '\n', ['t'] = '\t',
+};
+
+// The reverse, e.g. escape_table[10] is 'n'.  Zero means that the
+// char needs no escape.
+static const char escape_table[256] = {
+  [ESC] = ESC, ['"'] = '"', ['\r'] = 'r', ['\n'] = 'n', ['\t'] = 't',
+};
+
+// Returns the unescaped value, e.g. \n ==> 10, or -1 on error.
+static int unescape_char(const char *sptr) {
+  char chr = unescape_table[(uint8_t) *sptr];
+  return chr ? chr : -1;
+}
+
+// This is not a predicate.  It returns the escaped char value, or the
+// NUL character to indicate an error.
+static char escape_char(const char *c) {
+  return escape_table[(uint8_t) *c];
+}
+
 // Unescaping stops:
 //   when stop_at(c) is true for current char c ==> success
 //   at the end of string ==> failure (expected stop_at())
@@ -166,6 +509,36 @@ char *unescape(const char *str, size_t len,
   return NULL;
 }
 	
+// Unescapes exactly 'len' bytes, such as the contents of a string
+// token, which have no NUL and no unescaped quote.  The bytes between
+// escape sequences are copied a block at a time.
+//
+// Caller must free the returned string.  On error, NULL is returned
+// and *err points to the ESC that starts a bad escape sequence.
+char *unescape_string(const char *str, size_t len, const char **err) {
+  if (!str) return NULL;
+  const char *end = str + len;
+  char *result = xmalloc(len + 1);
+  if (!result) PANIC_OOM();
+  char *dest = result;
+  const char *esc;
+  while ((esc = memchr(str, ESC, end - str))) {
+    memcpy(dest, str, esc - str);
+    dest += esc - str;
+    int chr = (esc + 1 < end) ? unescape_char(esc + 1) : -1;
+    if (chr < 0) {
+      free(result);
+      *err = esc;
+      return NULL;
+    }
+    *dest++ = (char) chr;
+    str = esc + 2;
+  }
+  memcpy(dest, str, end - str);
+  dest[end - str] = '\0';
+  return result;
+}
+
 // Caller must free the returned string.
 // Processing stops at NUL or after len bytes
 char *escape(const char *str, size_t len) {
@@ -191,8 +564,7 @@ char *escape(const char *str, size_t len) {
 }
 
 bool all_whitespacep(const char *ptr, ulen_t len) {
-  const char *end = scan(whitespacep, ptr);
-  return (end >= ptr + len);
+  return skip_whitespace(ptr, ptr + len) == ptr + len;
 }
 
 
@@ -200,52 +572,71 @@ bool all_whitespacep(const char *ptr, ulen_t len) {
 /* String utilities                                                              */
 /* ----------------------------------------------------------------------------- */
 
-// Doing this the old-fashioned slow way.
+// Number of continuation bytes that follow each possible lead byte.
 // See, e.g. https://en.wikipedia.org/wiki/UTF-8
-// Returns position of invalid UTF8, or -1 if valid.
-static ssize_t invalid_utf8(const char *start, ssize_t len) {
+//
+// This is lenient, as the byte loop it replaced was: stray
+// continuation bytes and the unused lead bytes 0xF8-0xFF need no
+// continuation bytes, and so they are accepted.
+static const uint8_t utf8_continuations[256] = {
+  ROW(0), ROW(0), ROW(0), ROW(0), ROW(0), ROW(0), ROW(0), ROW(0), // ASCII
+  ROW(0), ROW(0), ROW(0), ROW(0),		// Continuation bytes
+  ROW(1), ROW(1),				// 2-byte sequence
+  ROW(2),					// 3-byte sequence
+  3, 3, 3, 3, 3, 3, 3, 3,			// 4-byte sequence
+  0, 0, 0, 0, 0, 0, 0, 0,
+};
+#undef ROW
+
+// Returns position of invalid UTF8, or -1 if valid.  NUL is invalid,
+// and so is a sequence that is cut off by the end of the input, in
+// which case 'len' is returned.
+//
+// Blocks are checked a vector at a time, first for being plain ASCII
+// and then by utf8_block().  The bytes are within [start, start +
+// len), so unaligned loads are safe.  A block with an error in it,
+// and the tail of the input, are walked using the table above.
+//
+ssize_t invalid_utf8(const char *start, ssize_t len) {
   int cbytes = 0;
-  for (ssize_t i = 0; i < len; i++) {
-    uint8_t c = start[i];
-    if (cbytes) {
-      // Check for continuation byte
-      if ((c & 0xC0) == 0x80) {
-	cbytes--;
+  ssize_t i = 0;
+  while (i < len) {
+    ssize_t stop = len;
+#if VECTOR_SCAN
+    if (i + VBLOCK <= len) {
+      vblock v = vloadu(start + i);
+      ssize_t valid = utf8_special_mask(v) ? utf8_block(v) : VBLOCK;
+      if (valid) {
+	i += valid;
 	continue;
-      } else {
-	return i;
       }
+      stop = i + VBLOCK;
+    }
+#endif
+    for (; (i < stop) || (cbytes && (i < len)); i++) {
+      uint8_t c = start[i];
+      if (cbytes) {
+	// Check for continuation byte
+	if ((c & 0xC0) == 0x80) {
+	  cbytes--;
+	  continue;
+	} else {
+	  return i;
+	}
+      }
+      if (!c) return i;		// No NUL bytes in UTF8
+      cbytes = utf8_continuations[c];
     }
-    if (!c) return i;		// No NUL bytes in UTF8
-    if (c < 0x80) continue;	// ASCII
-    if ((c & 0xE0) == 0xC0)	// 2-byte sequence
-      cbytes = 1;
-    if ((c & 0xF0) == 0xE0)	// 3-byte sequence
-      cbytes = 2;
-    if ((c & 0xF8) == 0xF0)	// 4-byte sequence
-      cbytes = 3;
   }
   return (cbytes == 0) ? -1 : len;
 }
 
-// ASCII control chars not allowed, including DEL.
-// Returns position of verboten char, or -1 if none found.
-static ssize_t contains_verboten(const char *start, ssize_t len) {
-  for (ssize_t i = 0; i < len; i++) {
-    if (((uint8_t) start[i] < 32) && !whitespacep(&(start[i])))
-      return i;
-    if (start[i] == 0x7F)
-      return i;
-  }
-  return -1;
-}
-
 /* ----------------------------------------------------------------------------- */
 /* Creating tokens                                                               */
 /* ----------------------------------------------------------------------------- */
 
 #define TOKEN_MAKER(name, toktype)				\
-  static token name(const char *tokstart,			\
+  LEXER_INLINE token name(const char *tokstart,			\
 		    const char *tokend) {			\
     ssize_t len = tokend - tokstart;				\
     if (len < 0) PANIC("invalid token length");			\
@@ -268,10 +659,10 @@ TOKEN_MAKER(closebrace, TOKEN_CLOSEBRACE);
 
 // Receiving the panic token indicates a bug in our lexer/parser.  It
 // means "this should not happen".
-token panictoken = (token) {.type = TOKEN_PANIC,
-			    .start = NULL,
-			    .len = 0,
-			    .pos = 0};
+static const token panictoken = {.type = TOKEN_PANIC,
+				 .start = NULL,
+				 .len = 0,
+				 .pos = 0};
 
 // Note: 'end' is allowed to point beyond the end of the
 // null-terminated string that begins at 'start'.  The 'strndup'
@@ -296,136 +687,200 @@ static token error_token(token_type err,
 bool interpret_int(const char *start, ulen_t len, int64_t *retval) {
   if (!retval || !start) PANIC_NULL();
 
-  int sign = 0;
-  if (plusp(start)) sign = 1;
-  if (minusp(start)) sign = -1;
-  if ((sign != 0) && (len < 2)) return false;
+  bool negative = minusp(start);
+  const char *digits = (negative || plusp(start)) ? start + 1 : start;
+  const char *end = start + len;
+  if (digits >= end) return false;
 
-  uint32_t i = (sign != 0);
-  uint64_t n = *(start + i) - '0';
-  uint64_t oldn = n;
-  for (++i; i < len; i++) {
-    n = 10*n + (*(start + i) - '0');
-    // If overflow, report failure
-    if (n < oldn) return false;
-    oldn = n;
-  }
+  uint64_t n = 0;
+  bool overflow = false;
+  if (scan_digits(digits, end, &n, &overflow) != end) return false;
   // If underflow or overflow, report failure
-  if ((sign > -1) && (n > INT64_MAX)) return false;
-  if ((sign == -1) && (n > (uint64_t) INT64_MAX + 1)) return false;
-  *retval = (sign == -1) ? -n : n;
+  if (overflow || int64_overflowp(n, negative)) return false;
+  *retval = int64_value(n, negative);
   return true;
 }
 
-static token lex_integer(const char **sptr) {
-  assert(digitp(*sptr) || minusp(*sptr) || plusp(*sptr));
-  const char *start = *sptr;
-  *sptr = until(delimiterp, start);
+// The digits of a TOKEN_INTEGER are checked here, 8 at a time, and a
+// number that is syntactically correct but does not fit in an int64_t
+// gets TOKEN_FLAG_INTRANGE.  Only one with at least 19 digits can be
+// out of range, so only those are decoded.  The value is not carried
+// in the token, which would make every token larger: interpret_int()
+// decodes it, once, when an AST is made.
+//
+// The integer token that spans [start, end), once its end is known.
+LEXER_INLINE token integer_token(const char *start, const char *end) {
+  bool negative = minusp(start);
   const char *digits = digitp(start) ? start : start + 1;
-  const char *end = scan(digitp, digits);
-  ssize_t len = end - start;
+  const char *last = digits;
+  while (((end - last) >= 8) && swar_digitsp(load8(last))) last += 8;
+  while ((last < end) && (classify(*last) == CC_DIGIT)) last++;
+  ssize_t len = last - start;
   assert(len > 0);
-  if (end <= digits)
+  if (last <= digits)
     // no digits found!
-    return error_token(TOKEN_BAD_INTCHAR, start, *sptr, *sptr - 1);
-  if (*sptr != end)
+    return error_token(TOKEN_BAD_INTCHAR, start, end, end - 1);
+  if (end != last)
     // something other than digits found!
-    return error_token(TOKEN_BAD_INTCHAR, start, *sptr, end);
+    return error_token(TOKEN_BAD_INTCHAR, start, end, last);
   if (len > MAX_INTLEN)
     // too long!
-    return error_token(TOKEN_BAD_INTLEN, start, *sptr, start + MAX_INTLEN);
-  
+    return error_token(TOKEN_BAD_INTLEN, start, end, start + MAX_INTLEN);
+
+  uint64_t n = 0;
+  bool overflow = false;
+  if (last - digits >= 19) {
+    scan_digits(digits, last, &n, &overflow);
+    overflow = overflow || int64_overflowp(n, negative);
+  }
   return (token){.type = TOKEN_INTEGER,
 		 .start = start,
-		 .len = len};
+		 .len = len,
+		 .flags = overflow ? TOKEN_FLAG_INTRANGE : 0};
+}
+
+LEXER_INLINE token lex_integer(const char **sptr, const char *end) {
+  assert(digitp(*sptr) || minusp(*sptr) || plusp(*sptr));
+  const char *start = *sptr;
+  *sptr = find_delimiter(start, end);
+  return integer_token(start, *sptr);
 }
 
 // Return the token type if input matches a keyword, and
 // TOKEN_IDENTIFIER if the input does NOT match any keyword.
+//
+// The table in keywords.h is generated at build time by kwgen.  Its
+// hash of the length and the first and last bytes is perfect, so
+// only one keyword ever needs to be compared.
 token_type is_keyword(const char *start, size_t len) {
-  for (token_type t = KEYWORD_START; t < KEYWORD_END; t++) {
-    const char *keyword = token_type_name(t);
-    if ((len == strlen(keyword)) &&
-	(strncmp(start, keyword, strlen(keyword)) == 0))
-      return t;
-  }
+  if ((len == 0) || (len > KEYWORD_MAXLEN)) return TOKEN_IDENTIFIER;
+  const keyword_entry *kw =
+    &keyword_table[keyword_hash(len, (uint8_t) start[0], (uint8_t) start[len - 1])];
+  if ((kw->len == len) && (memcmp(start, kw->text, len) == 0))
+    return kw->type;
   return TOKEN_IDENTIFIER;
 }
 
-// Read an identifier or keyword
-static token lex_identifier(const char **sptr) {
+// Read an identifier or keyword, in one pass that finds the
+// delimiter, validates UTF-8, and looks for control characters.  The
+// errors reported are, in order of priority: the identifier is too
+// long; the first invalid UTF-8; the first control character (ASCII
+// control chars are not allowed, including DEL).  Only the first and
+// last bytes and the length are needed to hash a keyword.
+LEXER_INLINE token lex_identifier(const char **sptr, const char *end) {
   const char *start = *sptr;
-  *sptr = until(delimiterp, start);
-  ssize_t len = *sptr - start;
+  const char *s = start;
+  const char *bad_utf8 = NULL, *bad_char = NULL;
+  int cbytes = 0;
+  while (true) {
+    // The usual case is a run of plain ASCII
+    if (!cbytes) s = skip_ordinary(s, end);
+    uint8_t c = (uint8_t) byte_at(s, end);
+    char_class cc = classify(c);
+    if (cbytes) {
+      // Check for continuation byte
+      if ((c & 0xC0) == 0x80) {
+	cbytes--;
+	s++;
+	continue;
+      }
+      bad_utf8 = s;
+      cbytes = 0;
+    }
+    if (cc >= CC_FIRST_DELIMITER) break;
+    if (cc == CC_SLASH) {
+      if (commentp(s, end)) break;
+    } else if (cc == CC_CONTROL) {
+      if (!bad_char) bad_char = s;
+    } else if ((cc == CC_UTF8) && !bad_utf8) {
+      cbytes = utf8_continuations[c];
+    }
+    s++;
+  }
+  *sptr = s;
+  ssize_t len = s - start;
   // Does identifier exceed max number of bytes?
   if (len > MAX_IDLEN)
-    return error_token(TOKEN_BAD_IDLEN, start, *sptr, start + MAX_IDLEN);
-  // Is it valid UTF8?
-  ssize_t errpos = invalid_utf8(start, len);
-  if (errpos != -1) {
-    if (errpos == 0)
-      return error_token(TOKEN_BAD_CHAR, start, *sptr, start + errpos);
-    else
-      return error_token(TOKEN_BAD_IDCHAR, start, *sptr, start + errpos);
-  }
-  // Does it contain any unprintable ASCII chars?
-  errpos = contains_verboten(start, len);
-  if (errpos != -1) {
-    if (errpos == 0)
-      return error_token(TOKEN_BAD_CHAR, start, *sptr, start + errpos);
+    return error_token(TOKEN_BAD_IDLEN, start, s, start + MAX_IDLEN);
+  // Is it valid UTF8, without any unprintable ASCII chars?
+  const char *bad = bad_utf8 ? bad_utf8 : bad_char;
+  if (bad) {
+    if (bad == start)
+      return error_token(TOKEN_BAD_CHAR, start, s, bad);
     else
-      return error_token(TOKEN_BAD_IDCHAR, start, *sptr, start + errpos);
+      return error_token(TOKEN_BAD_IDCHAR, start, s, bad);
   }
   // Contents are all good.  Now check for keywords.
   token_type maybe_keyword = is_keyword(start, (size_t) len);
   return (token){.type = maybe_keyword,
 		   .start = start,
-		   .len = len};      
+		   .len = len};
 }
 
-// Find the unescaped quote that marks the end of string
-static enum token_type inspect_string(const char **sptr) {
+// NOTE: An unprocessed string contains the delimiting double quotes
+// in its first and last bytes.
+//
+// One pass over the string finds the unescaped closing quote, the
+// first invalid UTF-8 byte (if any), and whether there are escape
+// sequences at all.  Runs of plain ASCII are skipped a block at a
+// time.  The escapes themselves are checked later, by ast_string().
+// A NUL before the end of the input is an invalid string char.
+//
+LEXER_INLINE token lex_string(const char **sptr, const char *end) {
+  assert(quotep(*sptr));
   const char *start = *sptr;
-  while (**sptr) {
-    if (quotep(*sptr)) break;
-    if ((**sptr == ESC) && *(*sptr + 1)) (*sptr)++;
-    (*sptr)++;
+  const char *s = start + 1;
+  ssize_t errpos = -1;
+  bool escapes = false;
+  int cbytes = 0;
+  uint8_t c;
+  while (true) {
+    if (!cbytes) s = skip_string_plain(s, end);
+    c = (uint8_t) byte_at(s, end);
+    if (cbytes) {
+      // Check for continuation byte
+      if ((c & 0xC0) == 0x80) {
+	cbytes--;
+	s++;
+	continue;
+      }
+      errpos = s - start;
+      cbytes = 0;
+    }
+    if (c == '"') break;
+    if (c == ESC) {
+      // The escaped byte cannot end the string, but it must still be
+      // valid UTF-8
+      escapes = true;
+      s++;
+      c = (uint8_t) byte_at(s, end);
+    }
+    if (!c) {
+      if (eofp(s, end)) break;
+      if (errpos == -1) errpos = s - start;
+    }
+    if ((c >= 0x80) && (errpos == -1)) cbytes = utf8_continuations[c];
+    s++;
   }
+  *sptr = s;
   // Is the string too long?
-  if ((*sptr - start) > MAX_STRINGLEN) return TOKEN_BAD_STRLEN;
+  if ((s - start - 1) > MAX_STRINGLEN)
+    return error_token(TOKEN_BAD_STRLEN, start, s, s);
   // Did it end with EOF?
-  if (**sptr == '\0') return TOKEN_BAD_STREOF;
-  // If it ended with a quote, then inspection is done
-  if (quotep(*sptr)) {
-    (*sptr)++;
-    return TOKEN_STRING;
-  }
-  PANIC("Unhandled condition when reading a string");
+  if (!c) return error_token(TOKEN_BAD_STREOF, start, s, s);
+  // It ended with a quote
+  *sptr = ++s;
+  if (errpos != -1)
+    return error_token(TOKEN_BAD_STRCHAR, start, s, start + errpos);
+  return (token){.type = TOKEN_STRING,
+		 .start = start,
+		 .len = to_ulen(s - start),
+		 .flags = escapes ? 0 : TOKEN_FLAG_NOESCAPES};
 }
 
-// NOTE: An unprocessed string contains the delimiting double quotes
-// in its first and last bytes.
-static token lex_string(const char **sptr) {
-  assert(quotep(*sptr));
-  const char *start = (*sptr)++;
-  token_type status = inspect_string(sptr);
-  ssize_t errpos, len = *sptr - start;
-  if (status == TOKEN_STRING) {
-    // We used to check delimiterp(*sptr) here.  Hmmm...
-    errpos = invalid_utf8(start, len);
-    if (errpos != -1)
-      return error_token(TOKEN_BAD_STRCHAR, start, *sptr, start + errpos);
-    return (token){.type = TOKEN_STRING,
-                   .start = start,
-                   .len = len};
-  }
-  // Else inspect_string() returned a problem
-  return error_token(status, start, *sptr, *sptr);
-}
-
-static token lex_whitespace(const char **sptr) {
+LEXER_INLINE token lex_whitespace(const char **sptr, const char *end) {
   const char *start = *sptr;
-  *sptr = scan(whitespacep, start);
+  *sptr = skip_whitespace(start, end);
   ssize_t len = *sptr - start;
   if (len > UINT16_MAX)
     return error_token(TOKEN_BAD_WS, start, *sptr, *sptr);
@@ -434,9 +889,9 @@ static token lex_whitespace(const char **sptr) {
                  .len = len};
 }
 
-static token lex_comment(const char **sptr) {
+LEXER_INLINE token lex_comment(const char **sptr, const char *end) {
   const char *start = *sptr;
-  *sptr = until(newlinep, start);
+  *sptr = skip_to_newline(start, end);
   ssize_t len = *sptr - start;
   if (len > UINT16_MAX)
     return error_token(TOKEN_BAD_COMMENT, start, *sptr, *sptr);
@@ -446,26 +901,641 @@ static token lex_comment(const char **sptr) {
 }
 
 // Low-level API.  Can be used to peek at comments or whitespace.
-token read_token(const char **s) {
+//
+// One table lookup on the first byte selects the kind of token.  The
+// input ends at 'end', or at a NUL when 'end' is NULL.
+LEXER_INLINE token lex_token(const char **s, const char *end) {
   if (!s || !*s) return panictoken;
   const char *start = *s;
-  if (openparenp(*s)) return ((*s)++,  openparen(start, *s));
-  if (closeparenp(*s)) return ((*s)++, closeparen(start, *s));
-  if (openbracep(*s)) return ((*s)++, openbrace(start, *s));
-  if (closebracep(*s)) return ((*s)++, closebrace(start, *s));
-  if (whitespacep(*s)) return lex_whitespace(s);
-  if (digitp(*s) || minusp(*s) || plusp(*s)) return lex_integer(s);
-  if (quotep(*s)) return lex_string(s);
-  if (commap(*s)) return ((*s)++, comma(start, *s));
-  if (semicolonp(*s)) return ((*s)++, semicolon(start, *s));
-  if (arrowp(*s)) return ((*s)+=2, arrow(start, *s));
-  if (equalsp(*s)) return ((*s)++, equals(start, *s));
-  if (commentp(*s)) return lex_comment(s);
-  if (eofp(*s)) return eof(start, *s);
+  switch (classify(byte_at(start, end))) {
+    case CC_OPENPAREN:  return ((*s)++, openparen(start, *s));
+    case CC_CLOSEPAREN: return ((*s)++, closeparen(start, *s));
+    case CC_OPENBRACE:  return ((*s)++, openbrace(start, *s));
+    case CC_CLOSEBRACE: return ((*s)++, closebrace(start, *s));
+    case CC_WS:         return lex_whitespace(s, end);
+    case CC_DIGIT:
+    case CC_SIGN:       return lex_integer(s, end);
+    case CC_QUOTE:      return lex_string(s, end);
+    case CC_COMMA:      return ((*s)++, comma(start, *s));
+    case CC_SEMICOLON:  return ((*s)++, semicolon(start, *s));
+    case CC_EQUALS:
+      if (byte_at(start + 1, end) == '>') return ((*s)+=2, arrow(start, *s));
+      return ((*s)++, equals(start, *s));
+    case CC_SLASH:
+      if (commentp(start, end)) return lex_comment(s, end);
+      break;
+    case CC_NUL:
+      if (eofp(start, end)) return eof(start, *s);
+      // A NUL inside bounded input
+      (*s)++;
+      return error_token(TOKEN_BAD_CHAR, start, *s, start);
+    default:
+      break;
+  }
   // By making identifier the last possibility, we ensure that ids do
   // not start with delimiters, number chars, a double quote, or the
   // comment start sequence.
-  return lex_identifier(s);
+  return lex_identifier(s, end);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Table-driven lexer                                                            */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  The same tokens as lex_token(), found by the state table in dfa.h,
+  which is generated at build time by dfagen.  Each step looks up the
+  class of one byte and then the next state, so there are no branches
+  on the kind of token, but also no vector skips.  Keywords are
+  recognized by the table as the identifier is read.
+
+  A transition that ends the token gives its category, and the token
+  is finished here, with the same checks (and errors) as the
+  hand-written lexer.  A transition may also mark the current byte as
+  the first invalid one.
+*/
+
+LEXER_INLINE token dfa_token(const char **sptr, const char *end) {
+  if (!sptr || !*sptr) return panictoken;
+  const uint8_t *classes = end ? dfa_classes_n : dfa_classes;
+  const char *start = *sptr;
+  const char *s = start;
+  const char *mark1 = NULL, *mark2 = NULL;
+  unsigned int t = DFA_START;
+  while (true) {
+    unsigned int cc = (end && (s == end)) ? DFA_CLASS_EOF : classes[(uint8_t) *s];
+    t = dfa_table[t & DFA_INDEX][cc];
+    if (t & ~DFA_INDEX) {
+      if (t & DFA_MARK1) mark1 = s;
+      if (t & DFA_MARK2) mark2 = s;
+      if (t & DFA_STOP) break;
+    }
+    s++;
+  }
+  if (t & DFA_CONSUME) s++;
+  if (t & DFA_BACK) s--;
+  *sptr = s;
+  const dfa_accept *accept = &dfa_accepts[t & DFA_INDEX];
+  ssize_t len = s - start;
+  switch (accept->category) {
+    case DFA_FIXED:
+      return (token){.type = accept->type, .start = start, .len = len};
+    case DFA_WS:
+      if (len > UINT16_MAX) return error_token(TOKEN_BAD_WS, start, s, s);
+      return (token){.type = TOKEN_WS, .start = start, .len = len};
+    case DFA_COMMENT:
+      if (len > UINT16_MAX) return error_token(TOKEN_BAD_COMMENT, start, s, s);
+      return (token){.type = TOKEN_COMMENT, .start = start, .len = len};
+    case DFA_INT:
+      return integer_token(start, s);
+    case DFA_ID: {
+      if (len > MAX_IDLEN)
+	return error_token(TOKEN_BAD_IDLEN, start, s, start + MAX_IDLEN);
+      // Invalid UTF-8 (mark1) is reported before control chars (mark2)
+      const char *bad = mark1 ? mark1 : mark2;
+      if (bad)
+	return error_token((bad == start) ? TOKEN_BAD_CHAR : TOKEN_BAD_IDCHAR,
+			   start, s, bad);
+      return (token){.type = accept->type, .start = start, .len = len};
+    }
+    case DFA_STREOF:
+      if ((len - 1) > MAX_STRINGLEN)
+	return error_token(TOKEN_BAD_STRLEN, start, s, s);
+      return error_token(TOKEN_BAD_STREOF, start, s, s);
+    case DFA_STRING:
+    case DFA_STRING_ESC:
+      // The closing quote is not part of a string that is too long
+      if ((len - 2) > MAX_STRINGLEN) {
+	*sptr = --s;
+	return error_token(TOKEN_BAD_STRLEN, start, s, s);
+      }
+      if (mark1) return error_token(TOKEN_BAD_STRCHAR, start, s, mark1);
+      return (token){.type = TOKEN_STRING,
+		     .start = start,
+		     .len = len,
+		     .flags = (accept->category == DFA_STRING) ? TOKEN_FLAG_NOESCAPES : 0};
+  }
+  return panictoken;
+}
+
+// Both lexers, whichever one read_token() uses, for testing and
+// benchmarks.  A NULL 'end' means the input ends at a NUL.
+token read_token_direct(const char **s, const char *end) {
+  return end ? lex_token(s, end) : lex_token(s, NULL);
+}
+
+token read_token_dfa(const char **s, const char *end) {
+  return end ? dfa_token(s, end) : dfa_token(s, NULL);
+}
+
+// The lexer is chosen at compile time, with LEXER_BACKEND=dfa (see
+// the Makefile).  The hand-written one is the default.
+#if LEXER_DFA
+  #define next_token dfa_token
+#else
+  #define next_token lex_token
+#endif
+
+token read_token(const char **s) {
+  return next_token(s, NULL);
+}
+
+token read_token_n(const char **s, const char *end) {
+  return next_token(s, end);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Streaming                                                                     */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  Each call to lexstream_next() lexes from the current position to the
+  end of the input received so far, treating that as the end.  The
+  token is the one that the one-shot lexer would produce if it ends
+  before the end of the input: the lexer saw the byte that ended it.
+  A token that reaches the end may continue in the next chunk, unless
+  its last byte is all it needs, e.g. a paren or a closing quote.
+  Otherwise, we wait for more input (or for lexstream_finish()).
+
+  A cut-off token is not lexed again on every chunk, which would make
+  a long comment or string quadratic in the number of chunks.  The
+  kind of token is known from its first byte, so the new bytes alone
+  are scanned for a byte that could end it, and 'scanned' records how
+  far that search got.  Only when such a byte arrives is the token
+  lexed from its start, by the one-shot lexer, which has the final
+  word on where (and whether) it ends.
+*/
+
+#define LEXSTREAM_MIN_CAPACITY 4096
+
+lexstream *lexstream_new(void) {
+  lexstream *ls = xmalloc(sizeof(lexstream));
+  if (!ls) PANIC_OOM();
+  *ls = (lexstream) {.capacity = LEXSTREAM_MIN_CAPACITY};
+  ls->buf = xmalloc(ls->capacity);
+  if (!ls->buf) PANIC_OOM();
+  return ls;
+}
+
+void lexstream_free(lexstream *ls) {
+  if (!ls) return;
+  free(ls->buf);
+  free(ls);
+}
+
+// The bytes already returned as tokens are dropped here, so 'buf'
+// holds at most one partial token plus the new chunk.
+void lexstream_feed(lexstream *ls, const char *chunk, size_t len) {
+  if (!ls || (!chunk && len)) PANIC_NULL();
+  if (ls->finished) PANIC("lexstream fed after lexstream_finish()");
+  if (ls->pos) {
+    memmove(ls->buf, ls->buf + ls->pos, ls->len - ls->pos);
+    ls->len -= ls->pos;
+    ls->offset += ls->pos;
+    ls->scanned = (ls->scanned > ls->pos) ? ls->scanned - ls->pos : 0;
+    ls->pos = 0;
+  }
+  if (ls->len + len > ls->capacity) {
+    while (ls->len + len > ls->capacity) ls->capacity *= 2;
+    ls->buf = realloc(ls->buf, ls->capacity);
+    if (!ls->buf) PANIC_OOM();
+  }
+  if (len) memcpy(ls->buf + ls->len, chunk, len);
+  ls->len += len;
+}
+
+void lexstream_finish(lexstream *ls) {
+  if (!ls) PANIC_NULL();
+  ls->finished = true;
+}
+
+// True when a token that ends exactly at the end of the input cannot
+// be continued by more input
+static bool complete_at_end(token tok) {
+  switch (tok.type) {
+    case TOKEN_OPENPAREN:
+    case TOKEN_CLOSEPAREN:
+    case TOKEN_OPENBRACE:
+    case TOKEN_CLOSEBRACE:
+    case TOKEN_COMMA:
+    case TOKEN_SEMICOLON:
+    case TOKEN_ARROW:
+    case TOKEN_STRING:
+    case TOKEN_BAD_STRCHAR:	// also ends at a closing quote
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the first byte at or after 's' that could end the token
+// starting at 'start', or 'end' when there is none.  A byte that
+// cannot be judged until the next one arrives (an escape at the end
+// of a string) is returned as 'end' is, but not skipped.
+static const char *resume_scan(const char *start, const char *s,
+			       const char *end, const char **stop) {
+  *stop = end;
+  if (s == end) return s;
+  switch (classify(*start)) {
+    case CC_WS:
+      return skip_whitespace_run(s, end);
+    case CC_SLASH:
+      if (commentp(start, end)) return skip_to_newline(s, end);
+      // Otherwise, an identifier
+      // fall through
+    case CC_IDCHAR:
+    case CC_DIGIT:
+    case CC_SIGN:
+    case CC_CONTROL:
+    case CC_UTF8:
+      // Identifiers and integers end at a delimiter or a comment
+      if (s == start) s++;
+      while ((s != end) && (classify(*s) < CC_FIRST_DELIMITER) && (*s != '/'))
+	s++;
+      return s;
+    case CC_QUOTE:
+      if (s == start) s++;
+      while (true) {
+	s = skip_string_plain(s, end);
+	if ((s == end) || (*s == '"')) return s;
+	if (*s == ESC) {
+	  if (s + 1 == end) {
+	    *stop = s;
+	    return end;
+	  }
+	  s++;
+	}
+	s++;
+      }
+    default:
+      break;
+  }
+  // Tokens of one or two bytes are simply lexed again
+  return s;
+}
+
+// Returns false when more input is needed to finish the next token.
+// After the input is finished, the last token is TOKEN_EOF, which is
+// returned again on every call.
+bool lexstream_next(lexstream *ls, token *tok) {
+  if (!ls || !tok) PANIC_NULL();
+  const char *ptr = ls->buf + ls->pos;
+  const char *end = ls->buf + ls->len;
+  if (!ls->finished && (ls->pos < ls->len)) {
+    const char *from = ls->buf + ((ls->scanned > ls->pos) ? ls->scanned : ls->pos);
+    const char *stop;
+    if (resume_scan(ptr, from, end, &stop) == end) {
+      ls->scanned = stop - ls->buf;
+      return false;
+    }
+  }
+  token t = read_token_n(&ptr, end);
+  if (!ls->finished && (ptr == end) && !complete_at_end(t)) {
+    ls->scanned = ls->len;
+    return false;
+  }
+  ls->pos = ptr - ls->buf;
+  *tok = t;
+  return true;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Line index                                                                    */
+/* ----------------------------------------------------------------------------- */
+
+void lineindex_init(lineindex *li, const char *input) {
+  if (!li) PANIC_NULL();
+  *li = (lineindex) {.input = input, .scanned = input};
+}
+
+void lineindex_release(lineindex *li) {
+  if (!li) return;
+  free(li->starts);
+  li->starts = NULL;
+  li->count = li->capacity = 0;
+}
+
+static void lineindex_add(lineindex *li, const char *start) {
+  ssize_t offset = start - li->input;
+  if ((offset < 0) || ((size_t) offset > UINT32_MAX))
+    PANIC("line offset (%zd) does not fit in the line index", offset);
+  if (li->count == li->capacity) {
+    li->capacity = li->capacity ? 2 * li->capacity : 64;
+    li->starts = realloc(li->starts, li->capacity * sizeof(uint32_t));
+    if (!li->starts) PANIC_OOM();
+  }
+  li->starts[li->count++] = (uint32_t) offset;
+}
+
+// Record the newlines from where we left off up to 'upto'.  The scan
+// only moves forward, so each byte of input is scanned at most once.
+void lineindex_scan(lineindex *li, const char *upto) {
+  if (!li) PANIC_NULL();
+  const char *s = li->scanned;
+  if (!s || (upto <= s)) return;
+  while ((s = memchr(s, '\n', (size_t) (upto - s)))) {
+    lineindex_add(li, ++s);
+    if (s == upto) break;
+  }
+  li->scanned = upto;
+}
+
+// Returns the line number (from 1) of 'point', and sets *start to the
+// start of that line.  This is a binary search of the index, after
+// first scanning any input up to 'point' that has not been scanned.
+size_t lineindex_line(lineindex *li, const char *point, const char **start) {
+  if (!li || !point || !start) PANIC_NULL();
+  lineindex_scan(li, point);
+  uint32_t offset = (uint32_t) (point - li->input);
+  // Count the line starts at or before 'point'
+  size_t lo = 0, hi = li->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (li->starts[mid] <= offset) lo = mid + 1;
+    else hi = mid;
+  }
+  *start = lo ? li->input + li->starts[lo - 1] : li->input;
+  return lo + 1;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Structural index                                                              */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  The positions of the delimiters ( ) { } , ; and = (which starts an
+  arrow, too) that are outside of strings and comments, found without
+  lexing, 64 bytes at a time, as in the first stage of simdjson.
+
+  For each block, one bit per byte marks the quotes, backslashes, and
+  so on.  The quotes that are escaped are those after an odd number of
+  backslashes.  The bits inside strings are then the prefix XOR of the
+  other quotes: bit i is set when an odd number of them are at or
+  before i.  With PCLMUL, that is one carry-less multiply by all ones.
+
+  Comments interfere: a quote in a comment does not start a string,
+  and "//" in a string does not start a comment.  So the first "//"
+  outside of a string is found, the quotes from it to the end of its
+  line are dropped, and the strings are computed again.  This repeats
+  for each comment in the block, which is usually none or one.
+
+  The index agrees with the lexer when every string starts where a
+  token can start, and no string is too long (the lexer ends such a
+  string without its closing quote, which then opens another string).
+  A quote inside an identifier, as in a"b, is where the first rule is
+  broken.  We check both rules as we go, and when either one is
+  broken, the index is not 'exact', and should not be used.
+*/
+
+#define SBLOCK 64
+
+typedef struct sblock {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t slash;
+  uint64_t stop;		// newline or NUL, which end a comment
+  uint64_t ws;
+  uint64_t delimiter;		// ( ) { } , ; =
+  uint64_t equals;
+  uint64_t gt;
+  uint64_t nul;
+} sblock;
+
+static void sblock_masks(const char *p, uint64_t valid, sblock *m) {
+  *m = (sblock) {0};
+#if VECTOR_SCAN
+  for (int i = 0; i < SBLOCK; i += VBLOCK) {
+    vblock v = vloadu(p + i);
+    uint64_t nl = vmatch(v, '\n'), nul = vmatch(v, '\0');
+    uint64_t eq = vmatch(v, '=');
+    m->quote |= (uint64_t) vmatch(v, '"') << i;
+    m->backslash |= (uint64_t) vmatch(v, ESC) << i;
+    m->slash |= (uint64_t) vmatch(v, '/') << i;
+    m->stop |= (nl | nul) << i;
+    m->ws |= (nl | vmatch(v, ' ') | vmatch(v, '\t') | vmatch(v, '\r')) << i;
+    m->delimiter |= (eq | vmatch(v, '(') | vmatch(v, ')') | vmatch(v, '{')
+		     | vmatch(v, '}') | vmatch(v, ',') | vmatch(v, ';')) << i;
+    m->equals |= eq << i;
+    m->gt |= (uint64_t) vmatch(v, '>') << i;
+    m->nul |= nul << i;
+  }
+#else
+  for (int i = 0; i < SBLOCK; i++) {
+    uint64_t bit = (uint64_t) 1 << i;
+    char_class cc = classify(p[i]);
+    if (p[i] == '"') m->quote |= bit;
+    else if (p[i] == ESC) m->backslash |= bit;
+    else if (p[i] == '/') m->slash |= bit;
+    else if (p[i] == '>') m->gt |= bit;
+    else if (cc == CC_WS) m->ws |= bit;
+    else if (cc == CC_NUL) m->nul |= bit;
+    else if (cc > CC_WS) m->delimiter |= bit;
+    if (p[i] == '=') m->equals |= bit;
+    if ((p[i] == '\n') || (p[i] == '\0')) m->stop |= bit;
+  }
+#endif
+  m->quote &= valid;
+  m->backslash &= valid;
+  m->slash &= valid;
+  m->stop &= valid;
+  m->ws &= valid;
+  m->delimiter &= valid;
+  m->equals &= valid;
+  m->gt &= valid;
+  m->nul &= valid;
+}
+
+// The bytes escaped by a backslash.  In a run of backslashes, every
+// other one escapes the next byte, starting with the first, so what
+// is escaped depends on whether the run starts on an even or an odd
+// bit.  Adding the starts of the runs on odd bits to the backslashes
+// carries each such run away, which leaves just the runs that start
+// on even bits, and those are flipped.  '*carry' is set when the
+// first byte of the next block is escaped.
+static uint64_t escaped_bytes(uint64_t backslash, uint64_t *carry) {
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  backslash &= ~*carry;
+  uint64_t follows_escape = (backslash << 1) | *carry;
+  uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+  uint64_t even_runs;
+  *carry = __builtin_add_overflow(odd_starts, backslash, &even_runs);
+  return (even_bits ^ (even_runs << 1)) & follows_escape;
+}
+
+// Bit i of the result is the XOR of bits 0 to i of 'x'
+#if defined(__PCLMUL__)
+#include <wmmintrin.h>
+static uint64_t prefix_xor(uint64_t x) {
+  __m128i product = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long) x),
+					 _mm_set1_epi8((char) 0xFF), 0);
+  uint64_t result = _mm_cvtsi128_si64(product);
+  return result;
+}
+#else
+static uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+#endif
+
+#define lowest_bit(x) ((x) & (0 - (x)))
+
+// What carries over from one block to the next
+typedef struct scarry {
+  uint64_t escaped;		// 1 when the next byte is escaped
+  uint64_t string;		// all ones when inside a string
+  bool     comment;		// inside a comment
+  uint64_t boundary;		// 1 when a token may start at the next byte
+  uint64_t equals;		// 1 when the last byte was '='
+  size_t   open_quote;		// position of the quote that opened a string
+} scarry;
+
+static void structindex_add(structindex *si, uint64_t bits, size_t base) {
+  if (si->count + SBLOCK > si->capacity) {
+    si->capacity = 2 * si->capacity + SBLOCK;
+    si->positions = realloc(si->positions, si->capacity * sizeof(uint32_t));
+    if (!si->positions) PANIC_OOM();
+  }
+  while (bits) {
+    si->positions[si->count++] = (uint32_t) (base + __builtin_ctzll(bits));
+    bits &= bits - 1;
+  }
+}
+
+static void structindex_block(structindex *si, const sblock *m, size_t base,
+			      bool next_slash, scarry *c) {
+  uint64_t quote = m->quote & ~escaped_bytes(m->backslash, &c->escaped);
+  uint64_t comment = 0;
+  if (c->comment) {
+    if (m->stop) {
+      comment = lowest_bit(m->stop) - 1;
+      c->comment = false;
+    } else {
+      comment = ~(uint64_t) 0;
+    }
+  }
+  uint64_t slashes = m->slash & ((m->slash >> 1) | ((uint64_t) next_slash << 63));
+  uint64_t string;
+  while (true) {
+    string = prefix_xor(quote & ~comment) ^ c->string;
+    uint64_t starts = slashes & ~string & ~comment;
+    if (!starts) break;
+    // This comment runs to the next stop, or past the end of the block
+    uint64_t from = ~(lowest_bit(starts) - 1);
+    uint64_t stops = m->stop & from;
+    if (stops) {
+      comment |= from & (lowest_bit(stops) - 1);
+    } else {
+      comment |= from;
+      c->comment = true;
+    }
+  }
+  quote &= ~comment;
+  c->string = (uint64_t) ((int64_t) string >> 63);
+
+  if (si->exact) {
+    uint64_t openers = quote & string;
+    uint64_t closers = quote & ~string;
+    uint64_t arrow_end = m->gt & ((m->equals << 1) | c->equals);
+    uint64_t boundary = m->ws | m->delimiter | m->nul | closers | arrow_end;
+    if (openers & ~((boundary << 1) | c->boundary)) si->exact = false;
+    c->boundary = boundary >> 63;
+    c->equals = m->equals >> 63;
+    for (uint64_t q = quote; q && si->exact; q &= q - 1) {
+      size_t at = base + __builtin_ctzll(q);
+      if (openers & lowest_bit(q))
+	c->open_quote = at;
+      else if (at - c->open_quote - 1 > MAX_STRINGLEN)
+	si->exact = false;
+    }
+  }
+  structindex_add(si, m->delimiter & ~string & ~comment, base);
+}
+
+// Pairs up the parens and braces, leaving the ones that do not match
+// as STRUCTINDEX_NONE
+static void structindex_match(structindex *si) {
+  si->match = malloc((si->count + 1) * sizeof(uint32_t));
+  uint32_t *stack = malloc((si->count + 1) * sizeof(uint32_t));
+  if (!si->match || !stack) PANIC_OOM();
+  size_t depth = 0;
+  for (size_t i = 0; i < si->count; i++) {
+    char c = si->input[si->positions[i]];
+    si->match[i] = UINT32_MAX;
+    if ((c == '(') || (c == '{')) {
+      stack[depth++] = (uint32_t) i;
+    } else if ((c == ')') || (c == '}')) {
+      if (!depth) continue;
+      uint32_t open = stack[depth - 1];
+      if (si->input[si->positions[open]] != ((c == ')') ? '(' : '{')) continue;
+      si->match[i] = open;
+      si->match[open] = (uint32_t) i;
+      depth--;
+    }
+  }
+  free(stack);
+}
+
+// The input ends at 'end', or at a NUL when 'end' is NULL.  Nothing
+// at or past the end is read.
+structindex *structural_index(const char *input, const char *end) {
+  if (!input) PANIC_NULL();
+  size_t len = end ? (size_t) (end - input) : strlen(input);
+  to_ulen(len);
+  structindex *si = xmalloc(sizeof(structindex));
+  if (!si) PANIC_OOM();
+  *si = (structindex) {.input = input, .exact = true};
+  scarry carry = {.boundary = 1};
+  sblock m;
+  char tail[SBLOCK];
+  for (size_t base = 0; base < len; base += SBLOCK) {
+    const char *p = input + base;
+    uint64_t valid = ~(uint64_t) 0;
+    if (len - base < SBLOCK) {
+      memset(tail, 0, SBLOCK);
+      memcpy(tail, p, len - base);
+      p = tail;
+      valid = ((uint64_t) 1 << (len - base)) - 1;
+    }
+    sblock_masks(p, valid, &m);
+    bool next_slash = (base + SBLOCK < len) && (input[base + SBLOCK] == '/');
+    structindex_block(si, &m, base, next_slash, &carry);
+  }
+  structindex_match(si);
+  return si;
+}
+
+void free_structindex(structindex *si) {
+  if (!si) return;
+  free(si->positions);
+  free(si->match);
+  free(si);
+}
+
+// Index of the first structural char at or after 'point'
+size_t structindex_find(structindex *si, const char *point) {
+  if (!si || !point) PANIC_NULL();
+  size_t offset = (size_t) (point - si->input);
+  size_t lo = 0, hi = si->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (si->positions[mid] < offset) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Index of the paren or brace that matches the one at index 'i', or
+// STRUCTINDEX_NONE
+size_t structindex_partner(structindex *si, size_t i) {
+  if (!si) PANIC_NULL();
+  if ((i >= si->count) || (si->match[i] == UINT32_MAX)) return STRUCTINDEX_NONE;
+  return si->match[i];
 }
 
 void print_token(token tok) {
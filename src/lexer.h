@@ -88,23 +88,111 @@ typedef struct token {
   enum token_type type;
   ulen_t len;			// length of token in bytes
   ulen_t pos;			// only used for error token
+  uint32_t flags;		// TOKEN_FLAG_* bits, set by the lexer
   const char *start;		// start of this token in the input
 } token;
 
+// A string token with no escape sequences can be copied verbatim.
+// Tokens made elsewhere have no flags, and are unescaped as usual.
+#define TOKEN_FLAG_NOESCAPES 0x1
+// An integer token whose value does not fit in an int64_t
+#define TOKEN_FLAG_INTRANGE  0x2
+
 bool all_whitespacep(const char *ptr, ulen_t len);
+ssize_t invalid_utf8(const char *start, ssize_t len);
 
 char *escape(const char *str, size_t len);
 char *unescape(const char *str, size_t len,
 	       bool stop_at(const char *c),
 	       const char **err);
+char *unescape_string(const char *str, size_t len, const char **err);
 
 bool  interpret_int(const char *start, ulen_t len, int64_t *retval);
 
 token read_token(const char **start);
+token read_token_n(const char **start, const char *end);
+token read_token_direct(const char **start, const char *end);
+token read_token_dfa(const char **start, const char *end);
 void  print_token(token tok);
 
 size_t token_length(token tok);
 
 token_type is_keyword(const char *start, size_t len);
 
+/* ----------------------------------------------------------------------------- */
+/* Streaming                                                                     */
+/*   Input arrives in chunks, and tokens are produced as soon as they are        */
+/*   complete.  A token that is cut off by the end of a chunk is resumed when    */
+/*   the next chunk arrives: only the new bytes are scanned for its end.         */
+/* ----------------------------------------------------------------------------- */
+
+// The unread input is kept in 'buf'.  The tokens returned by
+// lexstream_next() point into it, so they are valid only until the
+// next call to lexstream_feed().
+typedef struct lexstream {
+  char  *buf;			// input not yet returned as tokens
+  size_t len;			// bytes in buf
+  size_t capacity;
+  size_t pos;			// next byte of buf to lex
+  size_t scanned;		// the token at pos cannot end before this
+  size_t offset;		// position of buf[0] in the whole input
+  bool   finished;		// no more input will arrive
+} lexstream;
+
+lexstream *lexstream_new(void);
+void       lexstream_free(lexstream *ls);
+void       lexstream_feed(lexstream *ls, const char *chunk, size_t len);
+void       lexstream_finish(lexstream *ls);
+bool       lexstream_next(lexstream *ls, token *tok);
+
+/* ----------------------------------------------------------------------------- */
+/* Line index                                                                    */
+/*   The start of each line, so that a position can be turned into a line and    */
+/*   column with a binary search.  The input is scanned for newlines only as     */
+/*   far as the positions asked about, and only once.                            */
+/* ----------------------------------------------------------------------------- */
+
+// 'starts' holds the offset from 'input' of the start of each line
+// after the first, in order.  Every newline before 'scanned' has been
+// recorded.
+typedef struct lineindex {
+  const char *input;
+  const char *scanned;
+  uint32_t   *starts;
+  size_t      count;
+  size_t      capacity;
+} lineindex;
+
+void   lineindex_init(lineindex *li, const char *input);
+void   lineindex_release(lineindex *li);
+void   lineindex_scan(lineindex *li, const char *upto);
+size_t lineindex_line(lineindex *li, const char *point, const char **start);
+
+/* ----------------------------------------------------------------------------- */
+/* Structural index                                                              */
+/*   Where the delimiters ( ) { } , ; and = are, outside of strings and          */
+/*   comments, found 64 bytes at a time without lexing, and which parens and     */
+/*   braces match.                                                               */
+/* ----------------------------------------------------------------------------- */
+
+// When 'exact' is false, the input has a quote that the lexer would
+// not treat as the index does, e.g. inside an identifier, and the
+// index should not be used.  The delimiters are in 'positions', as
+// offsets from 'input'.  Use structindex_partner() to match brackets.
+typedef struct structindex {
+  const char *input;
+  uint32_t   *positions;
+  uint32_t   *match;		// index of the partner of each bracket
+  size_t      count;
+  size_t      capacity;
+  bool        exact;
+} structindex;
+
+#define STRUCTINDEX_NONE SIZE_MAX
+
+structindex *structural_index(const char *input, const char *end);
+void         free_structindex(structindex *si);
+size_t       structindex_find(structindex *si, const char *point);
+size_t       structindex_partner(structindex *si, size_t i);
+
 #endif
@@ -13,8 +13,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
-// Maximum size of input (a program to be parsed)
+// Maximum size of input (a program to be parsed) on stdin.  A file
+// named on the command line can be any size, and so can stdin with
+// -l or -n, which read it as it arrives.
 #define BUFMAX (1024 * 10)
 
 typedef enum exitcodes {
@@ -28,29 +35,48 @@ typedef enum exitcodes {
 } exitcodes;
 
 static void help(const char *progname) {
-  printf("Usage: %s [options]\n\n", progname);
-  printf("  The program (input) is read from stdin.\n\n"
+  printf("Usage: %s [options] [file]\n\n", progname);
+  printf("  The program (input) is read from the file, if given, or stdin.\n\n"
 	 "  Options:\n"
 	 "    -a    output a json OBJECT always (incl. for numbers, strings)\n"
 	 "    -s    output s-expressions instead of json\n"
 	 "    -t    output an ASCII tree figure instead of json\n"
          "    -k    list the language keywords (the invalid identifiers)\n"
+	 "    -l    output the tokens, including whitespace and comments, as\n"
+	 "          one json object per line, instead of parsing\n"
+	 "    -b    with -l, output the tokens as binary records (see below)\n"
+	 "    -n    batch mode: the input is many programs, each ended by a\n"
+	 "          NUL byte, and each result is one line of json (see below)\n"
+	 "    -j N  with -n, parse with N threads (0 for one per processor)\n"
 	 "    -v    print version number\n"
 	 "    -h    print this help message\n"
 	 "\n"
 	 "  Note: As currently configured, true, false, and null are parsed\n"
 	 "        as identifiers, not as keywords.  JSON supports true, false,\n"
 	 "        and null specially, but that does not mean our parser does.\n\n"
+	 "  Token records (-l -b) are 16 bytes each, little-endian:\n"
+	 "    uint32 offset, uint32 length, uint32 error position,\n"
+	 "    uint16 type (the order of the types in lexer.h), uint16 flags\n\n"
+	 "  In batch mode (-n), a program that does not parse is output as\n"
+	 "    {\"Error\":{\"type\":..., \"offset\":..., \"line\":..., ...}}\n"
+	 "  and the number of programs per second is printed on stderr.\n\n"
 	 "  Examples:\n");
   printf("    %s < prog.txt\n", progname);
+  printf("    %s prog.txt\n", progname);
   printf("    %s < prog.txt | interp\n", progname);
   printf("    %s -t < prog.txt\n", progname);
+  printf("    printf '%%s\\0' 'f(1)' 'g(2)' | %s -n\n", progname);
   printf("\n");
 }
 
 static bool option_tree = false;
 static bool option_sexp = false;
 static bool option_always_object = false;
+static bool option_tokens = false;
+static bool option_binary = false;
+static bool option_batch = false;
+static int option_threads = 1;
+static const char *option_file = NULL;
 
 static void process_options(int argc, char **argv) {
   for (int i = 1; i < argc; i++) {
@@ -77,12 +103,27 @@ static void process_options(int argc, char **argv) {
       option_sexp = true;
     if (strcmp(argv[i], "-a") == 0)
       option_always_object = true;
+    if (strcmp(argv[i], "-l") == 0)
+      option_tokens = true;
+    if (strcmp(argv[i], "-b") == 0)
+      option_binary = true;
+    if (strcmp(argv[i], "-n") == 0)
+      option_batch = true;
+    if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc)) {
+      option_threads = atoi(argv[++i]);
+      if (option_threads < 1) {
+	long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+	option_threads = (nprocs > 1) ? (int) nprocs : 1;
+      }
+      continue;
+    }
+    if (argv[i][0] != '-')
+      option_file = argv[i];
   }
 }
 
-static void print_json(ast *exp) {
+static void print_json(FILE *f, ast *exp) {
   char *printable;
-  FILE *f = stdout;
   switch (exp->type) {
     case AST_TRUE:
     case AST_FALSE:
@@ -110,7 +151,7 @@ static void print_json(ast *exp) {
     case AST_CONS:
       fprintf(f, "{\"%s\":[", ast_subtype_name(exp));
       while (!ast_nullp(exp)) {
-	print_json(ast_car(exp));
+	print_json(f, ast_car(exp));
 	exp = ast_cdr(exp);
 	if (!ast_nullp(exp)) fprintf(f, ",");
       }
@@ -168,31 +209,451 @@ static void print_sexp(ast *exp) {
   }
 }
 
-static char *read_input(void) {
+// A pipe may deliver the input in several pieces, so we read until
+// EOF.  One byte more than BUFMAX is room enough to tell that the
+// input is too long.
+static char *read_input(size_t *size) {
   ssize_t len;
-  char tinybuf[1];
+  size_t total = 0;
   char *buf = xmalloc(BUFMAX + 1);
   if (!buf) PANIC_OOM();
 
-  len = read(STDIN_FILENO, buf, BUFMAX);
-  if (len == -1) {
-    perror("Error reading from stdin");
+  do {
+    len = read(STDIN_FILENO, buf + total, BUFMAX + 1 - total);
+    if (len == -1) {
+      perror("Error reading from stdin");
+      exit(ERR_IO);
+    }
+    total += (size_t) len;
+  } while ((len != 0) && (total <= BUFMAX));
+  if (total == 0) {
+    fprintf(stderr, "Empty input\n");
+    exit(ERR_IO);
+  }
+  if (total > BUFMAX) {
+    fprintf(stderr, "Input too long (max is %d bytes)\n", BUFMAX);
+    exit(ERR_IO);
+  }
+  buf[total] = '\0';
+  *size = total;
+  return buf;
+}
+
+// The file is parsed where it is mapped, without copying it, so it
+// does not end in a NUL.  The parser is given its size instead.
+static void *map_file(const char *filename, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    perror(filename);
+    exit(ERR_IO);
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror(filename);
     exit(ERR_IO);
   }
-  if (len == 0) {
+  if (st.st_size == 0) {
     fprintf(stderr, "Empty input\n");
     exit(ERR_IO);
   }
-  buf[len] = '\0';
+  *size = (size_t) st.st_size;
+  void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    perror(filename);
+    exit(ERR_IO);
+  }
+  close(fd);
+  return map;
+}
 
-  // Test for more input. If present, then the earlier read() filled
-  // the input buffer without reading everything.
-  len = read(STDIN_FILENO, tinybuf, 1);
-  if (len != 0) {
-    fprintf(stderr, "Input too long (max is %d bytes)\n", BUFMAX);
+/* ----------------------------------------------------------------------------- */
+/* Token stream                                                                  */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  Every token from read_token_n(), including WS and COMMENT and ending
+  with EOF, so that editors and highlighters can use our lexer instead
+  of one of their own.  As NDJSON, a token looks like
+
+      {"type":"ID","offset":4,"length":3}
+
+  and an error token also has "pos", its error position.  A large
+  input has many tokens, so the records are formatted by hand into a
+  large buffer, which is written out when it fills.
+
+  From stdin, the input is fed to a lexstream as it is read, so that
+  it can be of any size, and each token is written once it is
+  complete.  Only the unfinished token need be kept in memory.
+*/
+
+#define OUTBUF_SIZE (256 * 1024)
+#define STDIN_READSIZE (64 * 1024)
+
+typedef struct outbuf {
+  char  *data;
+  size_t len;
+} outbuf;
+
+static void out_flush(outbuf *out) {
+  if (out->len && (fwrite(out->data, 1, out->len, stdout) != out->len)) {
+    perror("Error writing to stdout");
     exit(ERR_IO);
   }
-  return buf;
+  out->len = 0;
+}
+
+static void out_bytes(outbuf *out, const void *bytes, size_t n) {
+  if (out->len + n > OUTBUF_SIZE) out_flush(out);
+  memcpy(out->data + out->len, bytes, n);
+  out->len += n;
+}
+
+#define out_string(out, str) out_bytes((out), (str), strlen(str))
+
+static void out_uint(outbuf *out, uint32_t n) {
+  char digits[10];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = (char) ('0' + n % 10);
+    n /= 10;
+  } while (n);
+  out_bytes(out, digits + i, sizeof(digits) - i);
+}
+
+static void put_le(uint8_t *dest, uint32_t n, int nbytes) {
+  for (int i = 0; i < nbytes; i++) dest[i] = (uint8_t) (n >> (8 * i));
+}
+
+// The 'offset' of a token is from the start of the whole input
+static void write_token_json(outbuf *out, token tok, size_t offset) {
+  out_string(out, "{\"type\":\"");
+  out_string(out, token_name(tok));
+  out_string(out, "\",\"offset\":");
+  out_uint(out, (uint32_t) offset);
+  out_string(out, ",\"length\":");
+  out_uint(out, tok.len);
+  if (tok.type >= TOKEN_PANIC) {
+    out_string(out, ",\"pos\":");
+    out_uint(out, tok.pos);
+  }
+  out_string(out, "}\n");
+}
+
+static void write_token_binary(outbuf *out, token tok, size_t offset) {
+  uint8_t record[16];
+  put_le(record, (uint32_t) offset, 4);
+  put_le(record + 4, tok.len, 4);
+  put_le(record + 8, tok.pos, 4);
+  put_le(record + 12, (uint32_t) tok.type, 2);
+  put_le(record + 14, tok.flags, 2);
+  out_bytes(out, record, sizeof(record));
+}
+
+static void write_token(outbuf *out, token tok, size_t offset) {
+  if (option_binary)
+    write_token_binary(out, tok, offset);
+  else
+    write_token_json(out, tok, offset);
+}
+
+static void write_tokens(const char *input, const char *end) {
+  outbuf out = {.data = xmalloc(OUTBUF_SIZE)};
+  if (!out.data) PANIC_OOM();
+  const char *ptr = input;
+  token tok;
+  do {
+    tok = read_token_n(&ptr, end);
+    write_token(&out, tok, (size_t) (tok.start - input));
+  } while (tok.type != TOKEN_EOF);
+  out_flush(&out);
+  free(out.data);
+}
+
+static void write_tokens_stdin(void) {
+  outbuf out = {.data = xmalloc(OUTBUF_SIZE)};
+  char *chunk = xmalloc(STDIN_READSIZE);
+  if (!out.data || !chunk) PANIC_OOM();
+  lexstream *ls = lexstream_new();
+  size_t total = 0;
+  token tok;
+  while (true) {
+    if (lexstream_next(ls, &tok)) {
+      write_token(&out, tok, ls->offset + (size_t) (tok.start - ls->buf));
+      if (tok.type == TOKEN_EOF) break;
+      continue;
+    }
+    ssize_t n = read(STDIN_FILENO, chunk, STDIN_READSIZE);
+    if (n == -1) {
+      perror("Error reading from stdin");
+      exit(ERR_IO);
+    }
+    if (n == 0) {
+      if (total == 0) {
+	fprintf(stderr, "Empty input\n");
+	exit(ERR_IO);
+      }
+      lexstream_finish(ls);
+    } else {
+      lexstream_feed(ls, chunk, (size_t) n);
+      total += (size_t) n;
+    }
+  }
+  out_flush(&out);
+  lexstream_free(ls);
+  free(chunk);
+  free(out.data);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Batch mode                                                                    */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  With -n, the input is a stream of programs, each ended by a NUL byte
+  (the last one need not be), so that one process can parse many of
+  them.  Each program is parsed on its own, and its result is written
+  as one line of json: the program itself, as without -n, or else an
+  error object like
+
+      {"Error":{"type":"Unexpected EOF","offset":5,"line":1,"col":6}}
+
+  where "offset" (from the start of that program), "line", "col" and
+  "message" appear when they are known.  A program that is empty, or
+  that is followed by more input, is an error too, as it would be
+  without -n.  Lines are output in the order of the programs.
+
+  From stdin, the programs are parsed as their NULs arrive, so only
+  the largest program need fit in memory, and there is no limit on
+  the size of the input.
+
+  The programs are parsed in rounds of up to BATCH_ROUND.  With -j,
+  several threads share a round: each takes BATCH_GROUP programs at a
+  time, and writes their results into a buffer of its own for that
+  group.  When the round is done, the buffers are written out in
+  order.  The threads only read the options, which are set before
+  they start.  Each has an arena of its own for the round, which
+  holds the AST nodes and the symbol table names of one group at a
+  time, and is reset when the group's output is done, so that memory
+  stays bounded by one group per thread and no node is freed on its
+  own.
+*/
+
+#define BATCH_READSIZE (1024 * 1024)
+#define BATCH_ROUND 8192
+#define BATCH_GROUP 32
+#define BATCH_ARENA (256 * 1024)
+
+typedef struct batch_stats {
+  size_t programs;
+  size_t errors;
+} batch_stats;
+
+// The output for one group of programs, one line each
+typedef struct batch_output {
+  char  *text;
+  size_t len;
+} batch_output;
+
+typedef struct batch_round {
+  const char  *starts[BATCH_ROUND];	// Program i is starts[i] to ends[i]
+  const char  *ends[BATCH_ROUND];
+  size_t       count;
+  size_t       next_group;		// Shared by the threads,
+  pthread_mutex_t lock;			//   under this lock
+  batch_output outputs[BATCH_ROUND / BATCH_GROUP];
+} batch_round;
+
+typedef struct batch_worker {
+  batch_round *round;
+  batch_stats  stats;
+  arena       *nodes;
+  symtab      *symbols;			// For the current group
+} batch_worker;
+
+static void print_batch_error(FILE *f, const char *type, ast *err,
+			      const char *input) {
+  fprintf(f, "{\"Error\":{\"type\":\"%s\"", type);
+  if (err && err->start && (err->start >= input))
+    fprintf(f, ",\"offset\":%zu", (size_t) (err->start - input));
+  if (err && err->error->line)
+    fprintf(f, ",\"line\":%zu,\"col\":%zu", err->error->line, err->error->col);
+  if (err && err->error->msg && *err->error->msg) {
+    char *printable = escape(err->error->msg, strlen(err->error->msg));
+    fprintf(f, ",\"message\":%s", printable);
+    free(printable);
+  }
+  fprintf(f, "}}");
+}
+
+static void batch_program(FILE *f, batch_worker *w, const char *input,
+			  const char *end) {
+  batch_stats *stats = &w->stats;
+  const char *ptr = input;
+  ast *prog = read_program_n(w->symbols, &ptr, end);
+  stats->programs++;
+  if (!prog) {
+    stats->errors++;
+    print_batch_error(f, "Empty input", NULL, input);
+  } else if (ast_errorp(prog)) {
+    stats->errors++;
+    print_batch_error(f, error_name(prog), prog, input);
+  } else {
+    // Only whitespace and comments may follow the program
+    const char *leftover = ptr;
+    ast *more = (ptr != end) ? read_program_n(w->symbols, &ptr, end) : NULL;
+    if (more) {
+      stats->errors++;
+      fprintf(f, "{\"Error\":{\"type\":\"Unparsed input remaining\","
+	      "\"offset\":%zu}}", (size_t) (leftover - input));
+      free_ast(more);
+    } else {
+      print_json(f, prog);
+    }
+  }
+  fprintf(f, "\n");
+  free_ast(prog);
+}
+
+static void *batch_work(void *arg) {
+  batch_worker *w = arg;
+  batch_round *round = w->round;
+  size_t ngroups = (round->count + BATCH_GROUP - 1) / BATCH_GROUP;
+  size_t g;
+  while (true) {
+    // Groups of BATCH_GROUP programs keep the lock from being busy
+    pthread_mutex_lock(&round->lock);
+    g = round->next_group++;
+    pthread_mutex_unlock(&round->lock);
+    if (g >= ngroups) break;
+    batch_output *out = &round->outputs[g];
+    FILE *f = open_memstream(&out->text, &out->len);
+    if (!f) PANIC_OOM();
+    size_t last = (g + 1) * BATCH_GROUP;
+    if (last > round->count) last = round->count;
+    w->symbols = new_symtab_in(w->nodes);
+    ast_use_arena(w->nodes);
+    for (size_t i = g * BATCH_GROUP; i < last; i++)
+      batch_program(f, w, round->starts[i], round->ends[i]);
+    ast_use_arena(NULL);
+    free_symtab(w->symbols);
+    arena_reset(w->nodes);
+    if (fclose(f) == EOF) PANIC_OOM();
+  }
+  return NULL;
+}
+
+static void batch_run(batch_round *round, batch_stats *stats, int nthreads) {
+  size_t ngroups = (round->count + BATCH_GROUP - 1) / BATCH_GROUP;
+  if ((size_t) nthreads > ngroups) nthreads = (int) ngroups;
+  batch_worker *workers = xmalloc((size_t) nthreads * sizeof(batch_worker));
+  pthread_t *threads = xmalloc((size_t) nthreads * sizeof(pthread_t));
+  if (!workers || !threads) PANIC_OOM();
+  round->next_group = 0;
+  for (int t = 0; t < nthreads; t++) {
+    workers[t] = (batch_worker) {.round = round,
+				 .nodes = new_arena(BATCH_ARENA)};
+    if (t && pthread_create(&threads[t], NULL, batch_work, &workers[t]))
+      PANIC("failed to start a parsing thread");
+  }
+  batch_work(&workers[0]);
+  for (int t = 0; t < nthreads; t++) {
+    if (t && pthread_join(threads[t], NULL))
+      PANIC("failed to join a parsing thread");
+    stats->programs += workers[t].stats.programs;
+    stats->errors += workers[t].stats.errors;
+    free_arena(workers[t].nodes);
+  }
+  free(threads);
+  free(workers);
+  for (size_t g = 0; g < ngroups; g++) {
+    batch_output *out = &round->outputs[g];
+    if (fwrite(out->text, 1, out->len, stdout) != out->len) {
+      perror("Error writing to stdout");
+      exit(ERR_IO);
+    }
+    free(out->text);
+  }
+  round->count = 0;
+}
+
+// Every NUL in the input ends a program, and so does the end of input
+// unless it comes right after a NUL
+static void batch_buffer(batch_round *round, batch_stats *stats,
+			 const char *input, const char *end) {
+  while (input != end) {
+    const char *nul = memchr(input, '\0', (size_t) (end - input));
+    round->starts[round->count] = input;
+    round->ends[round->count++] = nul ?: end;
+    if (round->count == BATCH_ROUND) batch_run(round, stats, option_threads);
+    input = nul ? nul + 1 : end;
+  }
+  if (round->count) batch_run(round, stats, option_threads);
+}
+
+static void batch_stdin(batch_round *round, batch_stats *stats) {
+  size_t capacity = 4 * BATCH_READSIZE;
+  size_t len = 0;		// Bytes in buf, all of them unparsed
+  size_t scanned = 0;		// Bytes of buf known to have no NUL
+  char *buf = xmalloc(capacity);
+  if (!buf) PANIC_OOM();
+  while (true) {
+    if (capacity - len < BATCH_READSIZE) {
+      capacity *= 2;
+      buf = realloc(buf, capacity);
+      if (!buf) PANIC_OOM();
+    }
+    ssize_t n = read(STDIN_FILENO, buf + len, capacity - len);
+    if (n == -1) {
+      perror("Error reading from stdin");
+      exit(ERR_IO);
+    }
+    if (n == 0) break;
+    len += (size_t) n;
+    // Parse the programs that are complete, and keep the rest
+    const char *last = NULL, *nul = buf + scanned;
+    while ((nul = memchr(nul, '\0', len - (size_t) (nul - buf))))
+      last = nul++;
+    if (last) {
+      size_t done = (size_t) (last - buf) + 1;
+      batch_buffer(round, stats, buf, last + 1);
+      memmove(buf, buf + done, len - done);
+      len -= done;
+    }
+    scanned = len;
+  }
+  if (len) batch_buffer(round, stats, buf, buf + len);
+  free(buf);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void batch(const char *input, const char *end) {
+  batch_stats stats = {0};
+  batch_round *round = xmalloc(sizeof(batch_round));
+  if (!round) PANIC_OOM();
+  round->count = 0;
+  if (pthread_mutex_init(&round->lock, NULL)) PANIC("failed to create a lock");
+  double t0 = now();
+  if (input)
+    batch_buffer(round, &stats, input, end);
+  else
+    batch_stdin(round, &stats);
+  if (fflush(stdout) == EOF) {
+    perror("Error writing to stdout");
+    exit(ERR_IO);
+  }
+  double t = now() - t0;
+  pthread_mutex_destroy(&round->lock);
+  free(round);
+  fprintf(stderr, "Parsed %zu programs (%zu with errors) in %.3f s, "
+	  "%.0f programs/sec, with %d thread%s\n",
+	  stats.programs, stats.errors, t,
+	  (t > 0) ? (double) stats.programs / t : 0.0,
+	  option_threads, (option_threads == 1) ? "" : "s");
 }
 
 /* ----------------------------------------------------------------------------- */
@@ -202,15 +663,49 @@ static char *read_input(void) {
 int main(int argc, char **argv) {
 
   // 'ptr' advances while 'buf' remains the start of the buffer
-  const char *ptr;
-  char *buf;
+  const char *ptr, *end;
+  const char *buf;
+  char *copy = NULL;
+  void *map = NULL;
+  size_t size;
   ast *prog;
+  symtab *symbols;
 
   process_options(argc, argv);
 
-  buf = read_input();
+  // Batch mode and the token stream read stdin as it goes, without
+  // a size limit
+  if (option_batch && !option_file) {
+    batch(NULL, NULL);
+    exit(OK);
+  }
+  if (option_tokens && !option_file) {
+    write_tokens_stdin();
+    exit(OK);
+  }
+
+  if (option_file)
+    buf = map = map_file(option_file, &size);
+  else
+    buf = copy = read_input(&size);
   ptr = buf;
-  prog = read_program(&ptr);
+  end = buf + size;
+
+  if (option_tokens) {
+    write_tokens(buf, end);
+    if (map) munmap(map, size);
+    free(copy);
+    exit(OK);
+  }
+
+  if (option_batch) {
+    batch(buf, end);
+    munmap(map, size);
+    exit(OK);
+  }
+
+  symbols = new_symtab();
+  prog = read_program_n(symbols, &ptr, end);
 
   if (!prog) {
     fprintf(stderr, "Empty input\n");
@@ -227,22 +722,25 @@ int main(int argc, char **argv) {
   else if (option_sexp)
     print_sexp(prog);
   else
-    print_json(prog);
+    print_json(stdout, prog);
 
   printf("\n");
 
   free_ast(prog);
-  if (*ptr != '\0') {
+  if (ptr != end) {
     const char *leftover = ptr;
     // Check to see if only whitespace and comments remain
-    prog = read_program(&ptr);
+    prog = read_program_n(symbols, &ptr, end);
     if (prog) {
       // No, we got something semantically interesting
       free_ast(prog);
-      fprintf(stderr, "Unparsed input remaining: %s\n", leftover);
+      fprintf(stderr, "Unparsed input remaining: %.*s\n",
+	      (int) (end - leftover), leftover);
       exit(ERR_UNPARSED);
     }
   }
 
-  free(buf);
+  free_symtab(symbols);
+  if (map) munmap(map, size);
+  free(copy);
 }
@@ -5,12 +5,12 @@
 /*  (C) Jamie A. Jennings, 2024                                              */
 
 #include "parser.h"
-#include "desugar.h"
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 /* 
 
@@ -23,18 +23,51 @@
   The implementation tokenizes the input as it is read by the parser.
   The signature of read_program() is:
 
-    ast *read_program(char **ptr)
+    ast *read_program(symtab *st, char **ptr)
 
   The parser advances 'ptr' as it parses, to facilitate calling
-  read_program() repeatedly.
+  read_program() repeatedly.  The names of identifiers are interned
+  in 'st', which the caller frees after the ASTs that use it.
 
   If 'input' is the string you want to parse, you might write:
 
+    symtab *st = new_symtab();
     char *ptr = input;
-    ast *prog = read_program(&ptr);
+    ast *prog = read_program(st, &ptr);
+    ...
+    free_ast(prog);
+    free_symtab(st);
 
   The ast returned will either be an atom or form, as mentioned above,
-  or NULL, or an error indicator.
+  or NULL, or an error indicator.  It is already desugared: each 'let'
+  has a block, as if it had been given to fixup_let().
+
+  Alternatively, the whole input can be tokenized at once, with the
+  whitespace and comments removed.  The parser then reads tokens from
+  an array instead of lexing as it goes:
+
+    tokbuf *tb = tokenize(input);
+    char *ptr = input;
+    ast *prog = read_program_tokens(st, tb, &ptr);
+    ...
+    free_tokbuf(tb);
+
+  Here, 'ptr' is advanced exactly as read_program() would advance it,
+  so error positions are the same.
+
+  The input need not end in a NUL.  With read_program_n() and
+  tokenize_n(), the input ends at the 'end' pointer, and a NUL before
+  it is an error, so a file can be parsed straight from a read-only
+  mmap:
+
+    const char *ptr = map;
+    ast *prog = read_program_n(st, &ptr, map + size);
+
+  An editor can keep its source in a 'source' buffer, and give each
+  edit with the AST from before it, so that only the part of the
+  source around the edit is parsed again:
+
+    prog = reparse_program(st, prog, &src, (source_edit){offset, 1, "x", 1});
 
   A return value of NULL indicates EOF.  Error expressions include:
      PROGRAM_INCOMPLETE, signalling a list that is not properly closed
@@ -55,20 +88,72 @@ static bool atmospherep(token tok) {
 /* Parsing expressions                                                           */
 /* ----------------------------------------------------------------------------- */
 
+// Each thread has its own counts, found through a key
+typedef struct thread_stats {
+  parser_stats counts;
+  size_t       nodes_at_reset;
+} thread_stats;
+
+static pthread_key_t  stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void make_stats_key(void) {
+  if (pthread_key_create(&stats_key, free)) PANIC("failed to create a key");
+}
+
+static thread_stats *stats(void) {
+  pthread_once(&stats_once, make_stats_key);
+  return thread_block(stats_key, sizeof(thread_stats));
+}
+
+parser_stats parser_statistics(void) {
+  thread_stats *ts = stats();
+  ts->counts.nodes = ast_node_count() - ts->nodes_at_reset;
+  return ts->counts;
+}
+
+void reset_parser_statistics(void) {
+  thread_stats *ts = stats();
+  ts->counts = (parser_stats){0};
+  ts->nodes_at_reset = ast_node_count();
+}
+
+// Lexing from the input, a peek is usually followed by a read at the
+// same position, so the token peeked at (and where it ends) is kept
+// in the pstate for that read to consume instead of lexing again
 static token peek_semantic_token(pstate *s) {
   token tok;
+  if (s->toks) return tokbuf_token(s->toks, s->toks->next);
+  if (s->peeked_at && (s->peeked_at == pos(s))) return s->peeked;
   const char *sptr = pos(s);
   do {
-    tok = read_token(&sptr);
+    tok = read_token_n(&sptr, s->end);
   } while (atmospherep(tok));
+  if (PARSER_STATS) stats()->counts.lexed++;
+  s->peeked = tok;
+  s->peeked_at = pos(s);
+  s->peeked_end = sptr;
   return tok;
 }
 
 static token read_semantic_token(pstate *s) {
   token tok;
-  do {
-    tok = read_token(s->sptr);
-  } while (atmospherep(tok));
+  if (s->toks) {
+    // Like the lexer, we stay at the end once we get there
+    tok = tokbuf_token(s->toks, s->toks->next);
+    if (!token_eofp(tok)) s->toks->next++;
+    pos(s) = tok.start + tok.len;
+  } else if (s->peeked_at && (s->peeked_at == pos(s))) {
+    tok = s->peeked;
+    pos(s) = s->peeked_end;
+    s->peeked_at = NULL;
+  } else {
+    do {
+      tok = read_token_n(s->sptr, s->end);
+    } while (atmospherep(tok));
+    if (PARSER_STATS) stats()->counts.lexed++;
+  }
+  if (PARSER_STATS && !s->toks) stats()->counts.consumed++;
   if (TRACING) {
     print_token(tok);
   }
@@ -87,135 +172,6 @@ rsl_block = {ast_formp, AST_BLOCK, TOKEN_CLOSEBRACE, TOKEN_SEMICOLON, ERR_BLOCK}
 static const rsl_parms
 rsl_condclause = {ast_formp, AST_CLAUSE, TOKEN_CLOSEPAREN, TOKEN_ARROW, ERR_COND};
 
-// 'Parameters' is a comma-separated list of forms inside parens,
-// e.g. (1, 2, f(x)).
-//
-// A block is a list of expressions, like 'progn' in Lisp or 'begin'
-// in Scheme.  It is similar to a brace-delimited block in Rust (which
-// can end in an expression) except that here it MUST end in an
-// expression.  E.g. {foo; bar(); baz(1, 2, qux(3))}
-//
-// A cond expression has one or more clauses, each of which has the
-// form (test-expression => consequent-expression)
-//
-static ast *read_separated_list(pstate *s, const rsl_parms p) {
-  token tok;
-  const char *start = s->astart;
-  ast *err, *arg, *ls = ast_null(p.subtype, s->astart);
-
-  // Check for empty list
-  tok = peek_semantic_token(s);
-  if (tok.type == p.close) {
-    read_semantic_token(s);
-    return ls;
-  }
-
- tailcall:
-
-  // Read the next form
-  arg = read_ast(s);
-
-  // If eof before the closing token, return error
-  if (!arg) {
-    err = ast_error(ERR_EOF, in(s), pos(s), ast_type_name(p.subtype));
-    goto fail;
-  }
-
-  // If read_ast() returned an error, pass it along
-  if (ast_errorp(arg)) {
-    err = arg;
-    arg = NULL;
-    goto fail;
-  }
-  
-  // Parameters cannot contain another parameters
-  if ((p.subtype == AST_PARAMETERS) && ast_parametersp(arg)) {
-    err = ast_error(ERR_PARAMETERS, in(s), arg->start,
-		     "parameters not allowed here");
-    goto fail;
-  }
-  
-  // If we have some acceptable form, then the next token should be
-  // either a separator or the closer.
-  if (p.acceptablep(arg)) {
-
-    ls = ast_cons(p.subtype, arg, ls);
-    ls->start = start;
-    arg = NULL;
-    tok = read_semantic_token(s);
-
-    if (tok.type == p.sep) {
-      // Check for closer, which is not allowed after a separator:
-      // parameters cannot end in comma, block must end in expression,
-      // not semicolon.
-      tok = peek_semantic_token(s);
-      if (tok.type != p.close) goto tailcall;
-
-      err = ast_error(ERR_BADCHAR, in(s), pos(s),
-		      "spurious separator (or missing item) here");
-      goto fail;
-    }      
-
-    // Success!
-    if (tok.type == p.close)
-      return ast_nreverse(ls);
-
-    if (tok.type == TOKEN_EOF) {
-      err = ast_error(ERR_EOF, in(s), pos(s), ast_type_name(p.subtype));
-      goto fail;
-    }
-
-    // List must have separators between elements
-    err = ast_error(p.err, in(s), tok.start, "expected separator here");
-    goto fail;
-
-  }
-
-  // Got something unacceptable.
-  err = ast_error(p.err, in(s), arg->start, "syntax error here");
-
- fail:
-  if (arg) free_ast(arg);
-  free_ast(ls);
-  return err;
-}
-
-static ast *maybe_read_application(ast *exp, pstate *s) {
-  token next;
-  ast *args, *app = exp;
-  
- tailcall:
-
-  // If 'exp' is NOT followed by an open paren, there's no application
-  // here, though we may find we have one later, after reading an
-  // identifier or a lambda expression.
-  next = peek_semantic_token(s);
-  if (next.type != TOKEN_OPENPAREN) return app;
-
-  // Otherwise, we have an application
-  args = read_ast(s);
-
-  if (!args) {
-    free_ast(app);
-    return ast_error(ERR_EOF, in(s), pos(s), "truncated input in parameters");
-  }
-
-  if (ast_errorp(args)) {
-    free_ast(app);
-    return args;
-  }
-  
-  if (!ast_parametersp(args))
-    PANIC("Unexpected form after open paren: %s (subtype %s)",
-	  ast_name(args), ast_type_name(args->subtype));
-
-  app = ast_cons(AST_APP, app, args);
-  app->start = app->start;
-
-  // We may have a Curried application, e.g. f(a)(b)
-  goto tailcall;
-}
-  
 static ast *check(ast *a,
 		  bool (test)(ast *),
 		  error_type specific,
@@ -237,190 +193,17 @@ static ast *check(ast *a,
   return a;
 }
 
-static ast *read_assignment(ast *id, pstate *s) {
-  ast *assignment, *rhs;
-
-  assert(read_semantic_token(s).type == TOKEN_EQUALS);
-
-  rhs = read_ast(s);
-  rhs = check(rhs, ast_formp, ERR_ASSIGNMENT, s, "expected expression");
-  if (ast_errorp(rhs)) {
-    free_ast(id);
-    return rhs;
-  }
-
-  ast_type t = AST_ASSIGNMENT;
-  assignment = ast_cons(t, id, ast_cons(t, rhs, ast_null(t, s->astart)));
-  assignment->start = s->astart;
-  return assignment;
-}
-
 static ast *read_identifier(pstate *s, error_type err) {
   token tok = read_semantic_token(s);
   if (tok.type == TOKEN_IDENTIFIER)
-    return ast_identifier(tok);
+    return ast_identifier(s->symbols, tok);
   // Else signal the error as best we can
   return ast_error(err, in(s), tok.start, "expected identifier");
 }
 
-static ast *read_definition(token binder, pstate *s) {
-  ast *id, *rhs, *defn, *block;
-
-  id = read_identifier(s, ERR_DEFINITION);
-
-   token tok = read_semantic_token(s);
-   if (tok.type != TOKEN_EQUALS)
-     return ast_error(ERR_DEFINITION, in(s), pos(s),
- 		     "expected equals sign following identifier");
-
-  rhs = read_ast(s);
-  rhs = check(rhs, ast_formp, ERR_DEFINITION, s, "expected expression");
-  if (ast_errorp(rhs)) {
-    free_ast(id);
-    return rhs;
-  }
-
-  ast_type t;
-  switch (binder.type) {
-    case TOKEN_LET:        t = AST_LET;        break;
-    case TOKEN_DEFINITION: t = AST_DEFINITION; break;
-    default:
-      PANIC("unhandled binding construct: %s", token_name(binder));
-  }
-
-  // If rhs is NOT followed by an open brace, there's no "in" section,
-  // e.g. let x 5 {add(x,1)} which means "let x = 5 in { add(x,1) }".
-  token next = peek_semantic_token(s);
-  if (next.type == TOKEN_OPENBRACE) {
-    block = read_ast(s);
-    block = check(block, ast_blockp, ERR_DEFINITION, s, "expected code block");
-    if (ast_errorp(block)) {
-      free_ast(id);
-      free_ast(rhs);
-      return block;
-    } else {
-      // No error
-      block = ast_cons(AST_BLOCK, block, ast_null(AST_BLOCK, s->astart));
-    }
-  } else {
-    // No optional block present
-    block = ast_null(AST_BLOCK, s->astart);
-  }
-  defn = ast_cons(t, id, ast_cons(t, rhs, block));
-  defn->start = s->astart;
-  return defn;
-}
-
-static ast *read_lambda(pstate *s) {
-  ast *lambda, *args, *body;
-
-  token tok = read_semantic_token(s);
-  if (tok.type != TOKEN_OPENPAREN) {
-    return ast_error(ERR_LAMBDA, in(s), tok.start, "truncated input in lambda (missing parameter list)");
-  }
-  args = read_separated_list(s, rsl_parmlist);
-  args = check(args, ast_parametersp, ERR_LAMBDA, s, "expected parameter list");
-  if (ast_errorp(args)) return args;
-
-  tok = read_semantic_token(s);
-  if (tok.type != TOKEN_OPENBRACE) {
-    return ast_error(ERR_LAMBDA, in(s), tok.start, "missing function body for lambda");
-  }
-  body = read_separated_list(s, rsl_block);
-  body = check(body, ast_blockp, ERR_LAMBDA, s, "invalid function body");
-
-  if (!body)
-    return ast_error(ERR_EOF, in(s), pos(s), "truncated input in lambda (missing function body)");
-  if (ast_errorp(body))
-    return body;
-
-  lambda = ast_cons(AST_LAMBDA, args,
-		    ast_cons(AST_BLOCK, body, ast_null(AST_BLOCK, body->start)));
-  lambda->start = s->astart;
-  return lambda;
-}
-
-/*
-  cond (f(x) => 1)
-       (g(a, b, 3) => {foo; h(a)})
-       (true => p(a, b))
-*/
-static ast *read_cond(pstate *s) {
-  token tok;
-  ast *clause, *clauses = ast_null(AST_COND, s->astart);
-
- tailcall:
-
-  tok = read_semantic_token(s);
-  if (tok.type != TOKEN_OPENPAREN) {
-    free_ast(clauses);
-    return ast_error(ERR_COND, in(s), tok.start, "truncated input in cond");
-  }
-
-  clause = read_separated_list(s, rsl_condclause);
-
-  clause = check(clause, ast_clausep, ERR_COND, s, "expected cond clause");
-  if (ast_errorp(clause)) {
-    free_ast(clauses);
-    return clause;
-  }
-
-  // Ensure length of clause (a list) is two:  (test => consequent)
-  if (ast_length(clause) != 2) {
-    free_ast(clauses);
-    return ast_error(ERR_COND, in(s), clause->start,
-		     "improper cond clause: should be (test => consequent)");
-  }
-
-  clauses = ast_cons(AST_COND, clause, clauses);
-  clauses->start = s->astart;
-
-  // If clause is followed by another open paren, it's another clause
-  tok = peek_semantic_token(s);
-  if (tok.type == TOKEN_OPENPAREN) goto tailcall;
-
-  return ast_nreverse(clauses);
-}
-
-ast *read_ast(pstate *s) {
-  ast *exp;
-  token tok = read_semantic_token(s);
-  if (token_eofp(tok)) return NULL;
-
- tailcall:
-  s->astart = tok.start;
+// The AST for a token that is an expression by itself, or an error
+static ast *token_ast(pstate *s, token tok) {
   switch (tok.type) {
-    // "Atmosphere"
-    case TOKEN_WS:
-    case TOKEN_COMMENT:
-      tok = read_semantic_token(s);  
-      goto tailcall;
-
-    // Start of parameters
-    case TOKEN_OPENPAREN:
-      return read_separated_list(s, rsl_parameters);
-
-    // Start of block
-    case TOKEN_OPENBRACE:
-      exp = read_separated_list(s, rsl_block);
-      if (ast_errorp(exp)) return exp;
-      return maybe_read_application(exp, s);
-
-    // Keywords, identifiers, and literal values
-    case TOKEN_LAMBDA:
-    case TOKEN_LAMBDA_ALT:
-      exp = read_lambda(s);
-      if (ast_errorp(exp)) return exp;
-      return maybe_read_application(exp, s);
-    case TOKEN_COND:
-      return read_cond(s);
-    case TOKEN_DEFINITION:
-    case TOKEN_LET:
-      return read_definition(tok, s);
-    case TOKEN_IDENTIFIER: 
-      if (peek_semantic_token(s).type == TOKEN_EQUALS)
-	return read_assignment(ast_identifier(tok), s);
-      return maybe_read_application(ast_identifier(tok), s);
     case TOKEN_STRING:
       return ast_string(in(s), tok);
     case TOKEN_INTEGER:
@@ -475,22 +258,1227 @@ ast *read_ast(pstate *s) {
   }
 }
 
+/*
+  The parser does not recurse.  Where a nested expression is to be
+  read, it pushes a frame saying what to do with that expression, and
+  goes on to read it.  When an expression is complete (or is an
+  error), it is the value 'v' given to the frame on top of the stack,
+  which is popped or left in place to read another expression.  An
+  empty stack means 'v' is the result.
+
+  The frames for lists and for the right hand sides of bindings count
+  as a level of nesting, and reading more than 'max_depth' levels is
+  an ERR_DEPTH error.  No more than a few frames are pushed for each
+  level, so the stack stays small, and so does the recursion depth of
+  anything that walks the resulting AST.
+
+  Two things deepen the AST without nesting frames.  A let among the
+  expressions of a block takes the rest of the block as its own, so
+  it counts as the two levels of a let with a block, for as long as
+  the block is read.  And a Curried application, f(a)(b)(c), is an
+  application whose function is another one, one level deeper for
+  each pair of parens, though no frame is left for them.  The value
+  being read carries the number of these 'unframed' levels in it, and
+  an application makes one more of them, which must fit under
+  'max_depth' on top of the levels in use.
+*/
+
+typedef enum pframe_type {
+  PF_LIST,			// an element of a separated list
+  PF_APP,			// the arguments of an application
+  PF_THEN_APP,			// a block or lambda, which may be applied
+  PF_ASSIGN,			// the right hand side of an assignment
+  PF_DEF_RHS,			// the right hand side of a def or let
+  PF_DEF_BLOCK,			// the optional block of a def or let
+  PF_LAMBDA_PARMS,		// the parameter list of a lambda
+  PF_LAMBDA_BODY,		// the body of a lambda
+  PF_COND,			// a clause of a cond
+} pframe_type;
+
+typedef struct pframe {
+  pframe_type      type;
+  ast_type         binder;	// PF_DEF_*: AST_DEFINITION or AST_LET
+  const rsl_parms *p;		// PF_LIST: which kind of list
+  const char      *start;	// PF_LIST, PF_COND: where the list started
+  ast             *a;		// what has been read so far
+  ast             *b;		// for lists, the last cons of 'a'
+  size_t           unframed;	// most unframed levels in what was read
+  size_t           extra;	// PF_LIST: levels added by its lets
+} pframe;
+
+#define PSTACK_INITIAL 64
+
+typedef struct pstack {
+  pframe *frames;		// 'initial' until it is outgrown
+  size_t  top;			// number of frames in use
+  size_t  capacity;
+  size_t  depth;		// levels of nesting in use
+  size_t  max_depth;
+  pframe  initial[PSTACK_INITIAL];
+} pstack;
+
+static bool nestingp(pframe_type type) {
+  return (type == PF_LIST) || (type == PF_ASSIGN)
+    || (type == PF_DEF_RHS) || (type == PF_DEF_BLOCK);
+}
+
+// Returns NULL when the frame would nest too deeply
+static pframe *push(pstack *st, pframe_type type) {
+  if (nestingp(type)) {
+    if (st->depth == st->max_depth) return NULL;
+    st->depth++;
+  }
+  if (st->top == st->capacity) {
+    st->capacity *= 2;
+    if (st->frames == st->initial) {
+      st->frames = malloc(st->capacity * sizeof(pframe));
+      if (st->frames) memcpy(st->frames, st->initial, sizeof(st->initial));
+    } else {
+      st->frames = realloc(st->frames, st->capacity * sizeof(pframe));
+    }
+    if (!st->frames) PANIC_OOM();
+  }
+  pframe *f = &st->frames[st->top++];
+  f->type = type;
+  f->unframed = 0;
+  f->extra = 0;
+  return f;
+}
+
+static void pop(pstack *st) {
+  pframe *f = &st->frames[--st->top];
+  if (nestingp(f->type)) st->depth -= 1 + f->extra;
+}
+
+// While an expression is being read, its start is where an error in
+// it is reported.  Once it is part of a larger expression, its start
+// is that of its first element, as desugaring has always left it.
+static ast *settle(ast *a) {
+  if (ast_consp(a)) a->start = a->car->start;
+  return a;
+}
+
+// Lists are built in order, from the first cons ('a') of a frame to
+// the last ('b', or NULL when 'a' is the empty list)
+static void append_item(pframe *f, ast_type kind, ast *item) {
+  ast *cell = ast_cons(kind, settle(item), f->b ? f->b->cdr : f->a);
+  if (f->b) f->b->cdr = cell;
+  else f->a = cell;
+  f->b = cell;
+}
+
+// A 'let' without a block, among the expressions of a block, takes
+// the rest of them as its block, e.g. {a; let x = 1; b; c} becomes
+// {a; let x = 1 {b; c}}.  This is the desugaring that fixup_let()
+// does, done as each block is closed.  The block that ends at the
+// first let keeps the 'start' of the one it came from, and the rest
+// end at 'close', the closing bracket, so that every position in a
+// let lies within it.
+static void scope_lets(ast *block, const char *start, const char *close) {
+  ast *cell = block;
+  while (ast_consp(cell)) {
+    ast *item = cell->car, *rest = cell->cdr;
+    if (ast_letp(item) && ast_nullp(ast_cdr(ast_cdr(item)))) {
+      ast *rhs = item->cdr;
+      cell->cdr = ast_null(AST_BLOCK, start);
+      start = close;
+      // An empty block is its own terminator
+      if (!ast_consp(rest)) rest->start = close;
+      rhs->cdr = ast_cons(AST_BLOCK, rest, rhs->cdr);
+    }
+    cell = rest;
+  }
+  cell->start = start;
+}
+
+// Whether the frame under the top one is reading a block
+static bool in_blockp(pstack *st) {
+  return (st->top >= 2) && (st->frames[st->top - 2].type == PF_LIST)
+    && (st->frames[st->top - 2].p == &rsl_block);
+}
+
+// 'Parameters' is a comma-separated list of forms inside parens,
+// e.g. (1, 2, f(x)).
+//
+// A block is a list of expressions, like 'progn' in Lisp or 'begin'
+// in Scheme.  It is similar to a brace-delimited block in Rust (which
+// can end in an expression) except that here it MUST end in an
+// expression.  E.g. {foo; bar(); baz(1, 2, qux(3))}
+//
+// A cond expression has one or more clauses, each of which has the
+// form (test-expression => consequent-expression), e.g.
+//
+//   cond (f(x) => 1)
+//        (g(a, b, 3) => {foo; h(a)})
+//        (true => p(a, b))
+//
+// A definition (def or let) may be followed by a block, e.g.
+// let x = 5 {add(x,1)} which means "let x = 5 in { add(x,1) }".
+//
+ast *read_ast(pstate *s) {
+  pstack st;
+  st.frames = st.initial;
+  st.top = 0;
+  st.capacity = PSTACK_INITIAL;
+  st.depth = 0;
+  st.max_depth = s->max_depth ? s->max_depth : MAX_DEPTH;
+
+  const rsl_parms *p;
+  const char *where, *start;
+  pframe *f;
+  token tok;
+  ast *v, *err, *ls, *rhs, *block;
+  ast_type binder;
+  size_t unframed;		// unframed levels in 'v'
+
+ read:
+  unframed = 0;
+  tok = read_semantic_token(s);
+  if (token_eofp(tok)) {
+    v = NULL;
+    goto resume;
+  }
+
+ dispatch:
+  s->astart = tok.start;
+  switch (tok.type) {
+    // "Atmosphere"
+    case TOKEN_WS:
+    case TOKEN_COMMENT:
+      tok = read_semantic_token(s);
+      goto dispatch;
+
+    // Start of parameters
+    case TOKEN_OPENPAREN:
+      p = &rsl_parameters;
+      goto list;
+
+    // Start of block
+    case TOKEN_OPENBRACE:
+      push(&st, PF_THEN_APP);
+      p = &rsl_block;
+      goto list;
+
+    // Keywords and identifiers
+    case TOKEN_LAMBDA:
+    case TOKEN_LAMBDA_ALT:
+      push(&st, PF_THEN_APP);
+      goto lambda;
+    case TOKEN_COND:
+      f = push(&st, PF_COND);
+      f->a = ast_null(AST_COND, s->astart);
+      f->b = NULL;
+      goto cond;
+    case TOKEN_DEFINITION:
+    case TOKEN_LET:
+      goto definition;
+    case TOKEN_IDENTIFIER:
+      if (peek_semantic_token(s).type == TOKEN_EQUALS)
+	goto assignment;
+      v = ast_identifier(s->symbols, tok);
+      goto application;
+
+    // Literal values, and errors
+    default:
+      v = token_ast(s, tok);
+      goto resume;
+  }
+
+  // Read a separated list of kind 'p', opened by 'tok'
+ list:
+  where = tok.start;
+  ls = ast_null(p->subtype, where);
+  // Check for empty list
+  tok = peek_semantic_token(s);
+  if (tok.type == p->close) {
+    read_semantic_token(s);
+    v = ls;
+    goto resume;
+  }
+  f = push(&st, PF_LIST);
+  if (!f) {
+    free_ast(ls);
+    goto too_deep;
+  }
+  f->p = p;
+  f->start = where;
+  f->a = ls;
+  f->b = NULL;
+  goto read;
+
+ list_element:
+  p = f->p;
+  // If eof before the closing token, return error
+  if (!v) {
+    err = ast_error(ERR_EOF, in(s), pos(s), ast_type_name(p->subtype));
+    goto list_fail;
+  }
+  // If the element is an error, pass it along
+  if (ast_errorp(v)) {
+    err = v;
+    v = NULL;
+    goto list_fail;
+  }
+  // Parameters cannot contain another parameters
+  if ((p->subtype == AST_PARAMETERS) && ast_parametersp(v)) {
+    err = ast_error(ERR_PARAMETERS, in(s), v->start,
+		    "parameters not allowed here");
+    goto list_fail;
+  }
+  if (!p->acceptablep(v)) {
+    err = ast_error(p->err, in(s), v->start, "syntax error here");
+    goto list_fail;
+  }
+  // We have some acceptable form, so the next token should be either
+  // a separator or the closer.
+  append_item(f, p->subtype, v);
+  if (unframed > f->unframed) f->unframed = unframed;
+  v = NULL;
+  tok = read_semantic_token(s);
+  if (tok.type == p->sep) {
+    // Check for closer, which is not allowed after a separator:
+    // parameters cannot end in comma, block must end in expression,
+    // not semicolon.
+    tok = peek_semantic_token(s);
+    if (tok.type != p->close) goto read;
+    err = ast_error(ERR_BADCHAR, in(s), pos(s),
+		    "spurious separator (or missing item) here");
+    goto list_fail;
+  }
+  // Success!
+  if (tok.type == p->close) {
+    v = f->a;
+    if (p == &rsl_block) scope_lets(v, f->start, tok.start);
+    v->start = f->start;
+    unframed = f->unframed;
+    pop(&st);
+    goto resume;
+  }
+  if (tok.type == TOKEN_EOF)
+    err = ast_error(ERR_EOF, in(s), pos(s), ast_type_name(p->subtype));
+  else
+    // List must have separators between elements
+    err = ast_error(p->err, in(s), tok.start, "expected separator here");
+ list_fail:
+  free_ast(v);
+  free_ast(f->a);
+  pop(&st);
+  v = err;
+  goto resume;
+
+  // If 'v' is NOT followed by an open paren, there's no application
+  // here, though we may find we have one later, after reading an
+  // identifier or a lambda expression.
+ application:
+  tok = peek_semantic_token(s);
+  if (tok.type != TOKEN_OPENPAREN) goto resume;
+  if (st.depth + unframed + 1 > st.max_depth) {
+    free_ast(v);
+    where = tok.start;
+    goto too_deep;
+  }
+  f = push(&st, PF_APP);
+  f->a = v;
+  f->unframed = unframed + 1;
+  goto read;
+
+ application_args:
+  ls = f->a;			// the function
+  if (f->unframed > unframed) unframed = f->unframed;
+  pop(&st);
+  if (!v) {
+    free_ast(ls);
+    v = ast_error(ERR_EOF, in(s), pos(s), "truncated input in parameters");
+    goto resume;
+  }
+  if (ast_errorp(v)) {
+    free_ast(ls);
+    goto resume;
+  }
+  if (!ast_parametersp(v))
+    PANIC("Unexpected form after open paren: %s (subtype %s)",
+	  ast_name(v), ast_type_name(v->subtype));
+  // An error in the application is reported where the function starts
+  start = ls->start;
+  settle(ls);
+  v = ast_cons(AST_APP, ls, settle(v));
+  v->start = start;
+  // We may have a Curried application, e.g. f(a)(b)
+  goto application;
+
+ assignment:
+  where = tok.start;
+  ls = ast_identifier(s->symbols, tok);
+  tok = read_semantic_token(s);
+  assert(tok.type == TOKEN_EQUALS);
+  f = push(&st, PF_ASSIGN);
+  if (!f) {
+    free_ast(ls);
+    goto too_deep;
+  }
+  f->a = ls;
+  goto read;
+
+ assignment_rhs:
+  ls = f->a;			// the identifier
+  pop(&st);
+  rhs = check(v, ast_formp, ERR_ASSIGNMENT, s, "expected expression");
+  if (ast_errorp(rhs)) {
+    free_ast(ls);
+    v = rhs;
+    goto resume;
+  }
+  v = ast_cons(AST_ASSIGNMENT, ls,
+	       ast_cons(AST_ASSIGNMENT, settle(rhs),
+			ast_null(AST_ASSIGNMENT, ls->start)));
+  v->start = s->astart;
+  goto resume;
+
+ definition:
+  where = tok.start;
+  binder = (tok.type == TOKEN_LET) ? AST_LET : AST_DEFINITION;
+  ls = read_identifier(s, ERR_DEFINITION);
+  tok = read_semantic_token(s);
+  if (tok.type != TOKEN_EQUALS) {
+    free_ast(ls);
+    v = ast_error(ERR_DEFINITION, in(s), pos(s),
+		  "expected equals sign following identifier");
+    goto resume;
+  }
+  f = push(&st, PF_DEF_RHS);
+  if (!f) {
+    free_ast(ls);
+    goto too_deep;
+  }
+  f->binder = binder;
+  f->a = ls;
+  goto read;
+
+ definition_rhs:
+  rhs = check(v, ast_formp, ERR_DEFINITION, s, "expected expression");
+  if (ast_errorp(rhs)) {
+    free_ast(f->a);
+    pop(&st);
+    v = rhs;
+    goto resume;
+  }
+  // If rhs is followed by an open brace, there's an "in" section
+  if (peek_semantic_token(s).type == TOKEN_OPENBRACE) {
+    f->type = PF_DEF_BLOCK;
+    f->b = rhs;
+    f->unframed = unframed;
+    goto read;
+  }
+  // Without one, a 'let' gets an empty block, unless it is in a block
+  // and so will be given the rest of that block when it is closed.
+  // The rest of that block is then two levels deeper.  The empty
+  // lists here are placed at the identifier.
+  block = ast_null(AST_BLOCK, f->a->start);
+  if ((f->binder == AST_LET) && !in_blockp(&st))
+    block = ast_cons(AST_BLOCK, block, ast_null(AST_BLOCK, f->a->start));
+  else if (f->binder == AST_LET) {
+    if (st.depth + 1 > st.max_depth) {
+      where = f->a->start;
+      free_ast(f->a);
+      free_ast(rhs);
+      free_ast(block);
+      pop(&st);
+      goto too_deep;
+    }
+    st.frames[st.top - 2].extra += 2;
+    st.depth += 2;
+  }
+  goto definition_done;
+
+ definition_block:
+  rhs = f->b;
+  if (f->unframed > unframed) unframed = f->unframed;
+  block = check(v, ast_blockp, ERR_DEFINITION, s, "expected code block");
+  if (ast_errorp(block)) {
+    free_ast(f->a);
+    free_ast(rhs);
+    pop(&st);
+    v = block;
+    goto resume;
+  }
+  block = ast_cons(AST_BLOCK, settle(block), ast_null(AST_BLOCK, f->a->start));
+ definition_done:
+  v = ast_cons(f->binder, f->a, ast_cons(f->binder, settle(rhs), block));
+  v->start = s->astart;
+  pop(&st);
+  goto resume;
+
+ lambda:
+  tok = read_semantic_token(s);
+  if (tok.type != TOKEN_OPENPAREN) {
+    v = ast_error(ERR_LAMBDA, in(s), tok.start,
+		  "truncated input in lambda (missing parameter list)");
+    goto resume;
+  }
+  push(&st, PF_LAMBDA_PARMS);
+  p = &rsl_parmlist;
+  goto list;
+
+ lambda_parameters:
+  pop(&st);
+  v = check(v, ast_parametersp, ERR_LAMBDA, s, "expected parameter list");
+  if (ast_errorp(v)) goto resume;
+  tok = read_semantic_token(s);
+  if (tok.type != TOKEN_OPENBRACE) {
+    free_ast(v);
+    v = ast_error(ERR_LAMBDA, in(s), tok.start, "missing function body for lambda");
+    goto resume;
+  }
+  f = push(&st, PF_LAMBDA_BODY);
+  f->a = v;
+  p = &rsl_block;
+  goto list;
+
+ lambda_body:
+  ls = f->a;			// the parameters
+  pop(&st);
+  v = check(v, ast_blockp, ERR_LAMBDA, s, "invalid function body");
+  if (ast_errorp(v)) {
+    free_ast(ls);
+    goto resume;
+  }
+  start = v->start;
+  settle(ls);
+  v = ast_cons(AST_LAMBDA, ls,
+	       ast_cons(AST_BLOCK, settle(v), ast_null(AST_BLOCK, start)));
+  v->start = s->astart;
+  goto resume;
+
+  // Read a clause, to add to the clauses in frame 'f'
+ cond:
+  tok = read_semantic_token(s);
+  if (tok.type != TOKEN_OPENPAREN) {
+    err = ast_error(ERR_COND, in(s), tok.start, "truncated input in cond");
+    goto cond_fail;
+  }
+  p = &rsl_condclause;
+  goto list;
+
+ cond_clause:
+  v = check(v, ast_clausep, ERR_COND, s, "expected cond clause");
+  if (ast_errorp(v)) {
+    err = v;
+    goto cond_fail;
+  }
+  // Ensure length of clause (a list) is two:  (test => consequent)
+  if (ast_length(v) != 2) {
+    err = ast_error(ERR_COND, in(s), v->start,
+		    "improper cond clause: should be (test => consequent)");
+    free_ast(v);
+    goto cond_fail;
+  }
+  if (!f->b) f->start = s->astart;
+  append_item(f, AST_COND, v);
+  if (unframed > f->unframed) f->unframed = unframed;
+  // If clause is followed by another open paren, it's another clause
+  if (peek_semantic_token(s).type == TOKEN_OPENPAREN) goto cond;
+  v = f->a;
+  v->start = f->start;
+  unframed = f->unframed;
+  pop(&st);
+  goto resume;
+ cond_fail:
+  free_ast(f->a);
+  pop(&st);
+  v = err;
+  goto resume;
+
+ too_deep:
+  v = ast_error(ERR_DEPTH, in(s), where, "too many levels of nesting");
+
+  // Give 'v' to the frame on top of the stack
+ resume:
+  if (st.top == 0) {
+    if (st.frames != st.initial) free(st.frames);
+    return v ? settle(v) : NULL;
+  }
+  f = &st.frames[st.top - 1];
+  switch (f->type) {
+    case PF_LIST:         goto list_element;
+    case PF_APP:          goto application_args;
+    case PF_THEN_APP:
+      pop(&st);
+      if (ast_errorp(v)) goto resume;
+      goto application;
+    case PF_ASSIGN:       goto assignment_rhs;
+    case PF_DEF_RHS:      goto definition_rhs;
+    case PF_DEF_BLOCK:    goto definition_block;
+    case PF_LAMBDA_PARMS: goto lambda_parameters;
+    case PF_LAMBDA_BODY:  goto lambda_body;
+    case PF_COND:         goto cond_clause;
+  }
+  PANIC("Unhandled parser frame type %d", f->type);
+}
+
 /* ----------------------------------------------------------------------------- */
 /* External interface                                                            */
 /* ----------------------------------------------------------------------------- */
 
 
+// Line numbers count from the start of the line index, which is the
+// start of the tokbuf input, or else where this read started
+static void locate_error(ast *e, lineindex *li) {
+  const char *point = e->start;
+  if (!point) return;
+  const char *start;
+  e->error->line = lineindex_line(li, point, &start);
+  e->error->line_start = start;
+  // Count characters, i.e. every byte that is not a UTF-8 continuation
+  size_t col = 1;
+  for (const char *p = start; p < point; p++)
+    if (((uint8_t) *p & 0xC0) != 0x80) col++;
+  e->error->col = col;
+}
+
+static ast *read_program_from(pstate *s) {
+  const char *input = s->input;
+  ast *program = read_ast(s);
+  if (program && ast_listp(program) && (program->subtype == AST_PARAMETERS)) {
+    free_ast(program);
+    program = ast_error(ERR_PROGRAM, input, input, "This is a parameter list");
+  }
+  // So that the error printer stays within the input
+  if (program && ast_errorp(program)) {
+    program->error->end = s->end;
+    locate_error(program, s->toks ? &s->toks->lines : &s->lines);
+  }
+  return program;
+}
+
 // Read starting at *sptr, and advance it as we go
-ast *read_program(const char **sptr) {
+ast *read_program(symtab *st, const char **sptr) {
+  return read_program_n(st, sptr, NULL);
+}
+
+// The same, for input that ends at 'end' instead of at a NUL
+ast *read_program_n(symtab *st, const char **sptr, const char *end) {
+  if (!st) PANIC_NULL();
   const char *input = *sptr;
-  pstate state = {.input=input, .astart=input, .sptr = sptr};
-  ast *program = read_ast(&state);
-  if (program && ast_listp(program) && (program->subtype == AST_PARAMETERS))
-    return ast_error(ERR_PROGRAM, input, input, "This is a parameter list");
-  if (program) {
-    ast *desugared = fixup_let(program);
-    free_ast(program);
-    return desugared;
+  pstate state = {.input=input, .astart=input, .sptr = sptr, .end = end,
+		  .symbols = st};
+  lineindex_init(&state.lines, input);
+  ast *program = read_program_from(&state);
+  lineindex_release(&state.lines);
+  return program;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Incremental reparsing                                                         */
+/* ----------------------------------------------------------------------------- */
+
+/*
+  To find what to parse again, we go down from the root toward the
+  edit, taking in each list the last item that starts at or before
+  it.  The lists we pass through are the path.  A block, and an
+  application (whose arguments are a parenthesized list), records
+  its open bracket in the empty list that ends it, and so the closing
+  bracket can be found by lexing from there.  The innermost of these
+  whose brackets enclose the edit is parsed again, from its open
+  bracket to its close, and must come out as the same kind of list.
+
+  The rest of the tree is kept.  Its nodes point into the source, so
+  those after the edit must move by the change in length, but they
+  are moved lazily.  In a tree from the parser, every cons has the
+  start of its item.  On each list of the path, the cells after the
+  path are moved, and their items are left as they were: the
+  difference between a cons and its item is how far the item, and
+  everything in it, has yet to move.  Going down the path brings each
+  list on it up to date, a level at a time, and settle_positions()
+  does the whole tree.  So an edit costs time in proportion to the
+  lengths of the lists on the path, not to the size of the tree.
+
+  This needs every position in an item to come after the edit when
+  its start does, which is why scope_lets() ends the rest of a block
+  at its closing bracket.  When the source is copied to a larger
+  buffer, every node is moved, and the tree settled, at once.
+
+  A block made by scope_lets() from the rest of another ends at a
+  closing bracket, not an open one, and so is not parsed on its own.  Items are not given
+  their ends, and one that starts with a keyword, e.g. 'cond', starts
+  after it, so an edit to the keyword is parsed as part of a larger
+  region.
+*/
+
+typedef struct reparse_path {
+  ast   **lists;		// lists[0] is the root,
+  ast   **cells;		// and cells[i] the cons in lists[i] whose
+  size_t  count;		//   car is lists[i+1]
+  size_t  capacity;
+} reparse_path;
+
+static void path_push(reparse_path *path, ast *list, ast *cell) {
+  if (path->count == path->capacity) {
+    path->capacity = path->capacity ? 2 * path->capacity : 64;
+    path->lists = realloc(path->lists, path->capacity * sizeof(ast *));
+    path->cells = realloc(path->cells, path->capacity * sizeof(ast *));
+    if (!path->lists || !path->cells) PANIC_OOM();
+  }
+  path->lists[path->count] = list;
+  path->cells[path->count++] = cell;
+}
+
+// Moves the item of 'cell' to where the cell says it starts.  When it
+// is a list, its cells and terminator move, and their items are left
+// to move when they are needed.
+static void catch_up(ast *cell) {
+  ast *a = cell->car;
+  ssize_t delta = cell->start - a->start;
+  if (!delta) return;
+  for (; ast_consp(a); a = a->cdr) a->start += delta;
+  if (a->start) a->start += delta;
+}
+
+static void find_path(reparse_path *path, ast *prog, const char *point) {
+  ast *list = prog;
+  while (true) {
+    ast *cell = NULL;
+    for (ast *c = list; ast_consp(c) && (c->start <= point); c = c->cdr)
+      cell = c;
+    path_push(path, list, cell);
+    if (!cell || !ast_consp(cell->car)) return;
+    catch_up(cell);
+    list = cell->car;
+  }
+}
+
+// The open bracket of a block or argument list that can be parsed
+// again on its own, or NULL
+static const char *opener(ast *list) {
+  if (!ast_consp(list)) return NULL;
+  if ((list->subtype != AST_BLOCK) && (list->subtype != AST_APP)) return NULL;
+  ast *end = list;
+  while (ast_consp(end)) end = end->cdr;
+  const char *open = end->start;
+  if (!open || (*open != ((list->subtype == AST_BLOCK) ? '{' : '(')))
+    return NULL;
+  return open;
+}
+
+// The bracket that closes the one at 'open', or NULL
+static const char *closer(const char *open, const char *end) {
+  token_type o = (*open == '{') ? TOKEN_OPENBRACE : TOKEN_OPENPAREN;
+  token_type c = (*open == '{') ? TOKEN_CLOSEBRACE : TOKEN_CLOSEPAREN;
+  const char *ptr = open;
+  size_t depth = 0;
+  token tok;
+  do {
+    tok = read_token_n(&ptr, end);
+    if (tok.type == o) depth++;
+    else if ((tok.type == c) && (--depth == 0)) return tok.start;
+  } while ((tok.type != TOKEN_EOF) && (tok.type < TOKEN_PANIC));
+  return NULL;
+}
+
+// The innermost list on the path whose brackets enclose the edit, not
+// counting a block at the root, as that is the whole program.  When
+// there is none, 'close' is left NULL.
+static size_t find_region(reparse_path *path, const char *text, size_t len,
+			  source_edit edit, const char **open,
+			  const char **close) {
+  const char *first = text + edit.offset, *last = first + edit.deleted;
+  for (size_t k = path->count; k-- > 0; ) {
+    if ((k == 0) && ast_blockp(path->lists[0])) break;
+    const char *o = opener(path->lists[k]);
+    if (!o || (o >= first)) continue;
+    const char *c = closer(o, text + len);
+    if (c && (last <= c)) {
+      *open = o;
+      *close = c;
+      return k;
+    }
+  }
+  return 0;
+}
+
+// Replaces the edited bytes, returning the old text when it had to be
+// copied to a larger buffer, for the caller to free
+static char *apply_edit(source *src, source_edit edit) {
+  size_t len = src->len - edit.deleted + edit.inserted_len;
+  size_t after = src->len - edit.offset - edit.deleted + 1;	// with the NUL
+  char *old = src->text;
+  if (len + 1 <= src->capacity) {
+    memmove(old + edit.offset + edit.inserted_len,
+	    old + edit.offset + edit.deleted, after);
+    memcpy(old + edit.offset, edit.inserted, edit.inserted_len);
+    src->len = len;
+    return NULL;
+  }
+  src->capacity = 2 * (len + 1);
+  src->text = xmalloc(src->capacity);
+  if (!src->text) PANIC_OOM();
+  memcpy(src->text, old, edit.offset);
+  memcpy(src->text + edit.offset, edit.inserted, edit.inserted_len);
+  memcpy(src->text + edit.offset + edit.inserted_len,
+	 old + edit.offset + edit.deleted, after);
+  src->len = len;
+  return old;
+}
+
+typedef struct reparse_move {
+  const char *old;		// the text before the edit,
+  const char *text;		// and after it
+  source_edit edit;
+} reparse_move;
+
+// Where a position in the old text is in the new one.  Positions in
+// the deleted bytes go to the start of the inserted ones.
+static const char *moved(const reparse_move *m, const char *p) {
+  if (!p) return NULL;
+  size_t offset = (size_t) (p - m->old);
+  if (offset >= m->edit.offset + m->edit.deleted)
+    offset = offset - m->edit.deleted + m->edit.inserted_len;
+  else if (offset > m->edit.offset)
+    offset = m->edit.offset;
+  return m->text + offset;
+}
+
+typedef struct pending {
+  ast    *a;
+  ssize_t delta;		// how far 'a' and its cdrs have yet to move
+} pending;
+
+// Brings every position in 'a' up to date, and then moves it by 'm',
+// unless that is NULL.  The cdrs of a list are followed in a loop,
+// and its items are kept on a stack of our own, so that a deep tree
+// needs no more of the C stack than a shallow one.
+static void settle_all(ast *a, const reparse_move *m) {
+  size_t top = 0, capacity = 64;
+  pending *stack = xmalloc(capacity * sizeof(pending));
+  if (!stack) PANIC_OOM();
+  stack[top++] = (pending) {a, 0};
+  while (top) {
+    pending p = stack[--top];
+    for (a = p.a; ; a = a->cdr) {
+      const char *start = a->start ? a->start + p.delta : NULL;
+      if (ast_consp(a)) {
+	if (top == capacity) {
+	  capacity *= 2;
+	  stack = realloc(stack, capacity * sizeof(pending));
+	  if (!stack) PANIC_OOM();
+	}
+	ast *item = a->car;
+	stack[top++] = (pending) {item, item->start ? start - item->start : 0};
+      }
+      a->start = m ? moved(m, start) : start;
+      if (!ast_consp(a)) break;
+    }
+  }
+  free(stack);
+}
+
+void settle_positions(ast *prog) {
+  if (prog) settle_all(prog, NULL);
+}
+
+// Moves the nodes that are kept, i.e. all but those of lists[k] from
+// its open bracket on.  Items before the path come before the edit,
+// and items after it come after the edit, so they move by its change
+// in length, lazily.  The terminators of the path may come before or
+// after.  The cells on the path are settled by the caller.
+static void move_path(const reparse_move *m, reparse_path *path, size_t k) {
+  if (m->text != m->old) {
+    settle_all(path->lists[0], m);
+    return;
+  }
+  ssize_t delta = (ssize_t) m->edit.inserted_len - (ssize_t) m->edit.deleted;
+  if (!delta) return;
+  for (size_t i = 0; i < k; i++) {
+    ast *c = path->cells[i]->cdr;
+    for (; ast_consp(c); c = c->cdr) c->start += delta;
+    c->start = moved(m, c->start);
+  }
+}
+
+// Parses the region of lists[k] again, and puts it in place of the
+// old one, or returns NULL (changing nothing) if that cannot be done
+static ast *reparse_region(symtab *st, reparse_path *path, size_t k,
+			   const reparse_move *m,
+			   const char *open, const char *close) {
+  if (k >= MAX_DEPTH) return NULL;
+  ast *list = path->lists[k];
+  bool block = (list->subtype == AST_BLOCK);
+  const char *start = moved(m, open);
+  const char *end = moved(m, close) + 1;
+  const char *ptr = start;
+  // Each list on the path is read within at most one nesting frame
+  pstate s = {.input = m->text, .astart = start, .sptr = &ptr, .end = end,
+	      .symbols = st, .max_depth = MAX_DEPTH - k};
+  ast *v = read_ast(&s);
+  if (!v || ast_errorp(v) || (ptr != end)
+      || !(block ? ast_blockp(v) : ast_parametersp(v))) {
+    free_ast(v);
+    return NULL;
+  }
+  if (PARSER_STATS) stats()->counts.reparsed += (size_t) (end - start);
+  move_path(m, path, k);
+  if (block) {
+    path->cells[k - 1]->car = v;
+    free_ast(list);
+  } else {
+    free_ast(list->cdr);
+    list->cdr = v;
+  }
+  for (size_t i = k; i-- > 0; )
+    settle(path->cells[i]);
+  return path->lists[0];
+}
+
+// When 'settle' is false, the positions after the edit are left to
+// be moved lazily
+static ast *reparse(symtab *st, ast *prog, source *src, source_edit edit,
+		    bool settle) {
+  if (!st || !src) PANIC_NULL();
+  if ((edit.offset > src->len) || (edit.deleted > src->len - edit.offset))
+    PANIC("Edit at %zu deleting %zu bytes is outside the source (length %zu)",
+	  edit.offset, edit.deleted, src->len);
+  const char *old = src->text;
+  reparse_path path = {0};
+  const char *open = NULL, *close = NULL;
+  size_t k = 0;
+  if (prog && !ast_errorp(prog)) {
+    find_path(&path, prog, old + edit.offset);
+    k = find_region(&path, old, src->len, edit, &open, &close);
+  }
+  char *copied = apply_edit(src, edit);
+  reparse_move m = {.old = old, .text = src->text, .edit = edit};
+  ast *result = NULL;
+  if (close) result = reparse_region(st, &path, k, &m, open, close);
+  if (result && settle) settle_positions(result);
+  if (!result) {
+    free_ast(prog);
+    const char *ptr = src->text;
+    result = read_program_n(st, &ptr, src->text + src->len);
+    if (PARSER_STATS) stats()->counts.reparsed += src->len;
+  }
+  free(copied);
+  free(path.lists);
+  free(path.cells);
+  return result;
+}
+
+ast *reparse_program(symtab *st, ast *prog, source *src, source_edit edit) {
+  return reparse(st, prog, src, edit, true);
+}
+
+ast *reparse_program_lazy(symtab *st, ast *prog, source *src,
+			  source_edit edit) {
+  return reparse(st, prog, src, edit, false);
+}
+
+// Flags that a token of each type usually has, and so need not be
+// stored in the aux table
+static uint32_t usual_flags(token_type type) {
+  return (type == TOKEN_STRING) ? TOKEN_FLAG_NOESCAPES : 0;
+}
+
+static void tokbuf_append(tokbuf *tb, token tok) {
+  if (tb->count == tb->capacity) {
+    tb->capacity *= 2;
+    tb->kinds = realloc(tb->kinds, tb->capacity * sizeof(uint32_t));
+    tb->offsets = realloc(tb->offsets, tb->capacity * sizeof(uint32_t));
+    if (!tb->kinds || !tb->offsets) PANIC_OOM();
+  }
+  ssize_t offset = tok.start - tb->input;
+  if ((offset < 0) || ((size_t) offset > UINT32_MAX))
+    PANIC("token offset (%zd) does not fit in a packed token", offset);
+  uint32_t len = tok.len;
+  if ((len >= TOKBUF_AUX) || tok.pos || (tok.flags != usual_flags(tok.type))) {
+    if (tb->naux == tb->auxcapacity) {
+      tb->auxcapacity = tb->auxcapacity ? 2 * tb->auxcapacity : 16;
+      tb->aux = realloc(tb->aux, tb->auxcapacity * sizeof(tokbuf_aux));
+      if (!tb->aux) PANIC_OOM();
+    }
+    tb->aux[tb->naux++] = (tokbuf_aux) {.index = tb->count,
+					.len = tok.len,
+					.pos = tok.pos,
+					.flags = tok.flags};
+    len = TOKBUF_AUX;
+  }
+  tb->kinds[tb->count] = (len << 8) | (uint32_t) tok.type;
+  tb->offsets[tb->count] = (uint32_t) offset;
+  tb->count++;
+}
+
+// Lex all of 'input', keeping only the semantic tokens.  Error
+// tokens are kept, because the parser reports them.
+tokbuf *tokenize(const char *input) {
+  return tokenize_n(input, NULL);
+}
+
+// Typical programs have a semantic token every few bytes
+#define TOKBUF_CAPACITY(len) ((len) / 4 + 16)
+
+static tokbuf *new_tokbuf(const char *input, const char *end,
+			  size_t capacity) {
+  tokbuf *tb = xmalloc(sizeof(tokbuf));
+  if (!tb) PANIC_OOM();
+  *tb = (tokbuf) {.input = input, .end = end, .capacity = capacity};
+  lineindex_init(&tb->lines, input);
+  tb->kinds = xmalloc(tb->capacity * sizeof(uint32_t));
+  tb->offsets = xmalloc(tb->capacity * sizeof(uint32_t));
+  if (!tb->kinds || !tb->offsets) PANIC_OOM();
+  return tb;
+}
+
+// Append the semantic tokens from 'ptr' to 'end'.  When 'last' is
+// false, 'end' is a chunk boundary rather than the end of the input,
+// and a string cut off there is not appended, because its true extent
+// is not known.  Its start is returned instead, or NULL if there is
+// none.
+static const char *tokenize_range(tokbuf *tb, const char *ptr,
+				  const char *end, bool last) {
+  const char *start;
+  token tok;
+  do {
+    start = ptr;
+    tok = read_token_n(&ptr, end);
+    if (!last && (ptr == end)
+	&& ((tok.type == TOKEN_BAD_STREOF) || (tok.type == TOKEN_BAD_STRLEN)))
+      return start;
+    if (!atmospherep(tok)) tokbuf_append(tb, tok);
+  } while (!token_eofp(tok) && (last || (ptr != end)));
+  return NULL;
+}
+
+// The same, for input that ends at 'end' instead of at a NUL
+tokbuf *tokenize_n(const char *input, const char *end) {
+  if (!input) return NULL;
+  size_t len = end ? (size_t) (end - input) : strlen(input);
+  tokbuf *tb = new_tokbuf(input, end, TOKBUF_CAPACITY(len));
+  tokenize_range(tb, input, end, true);
+  return tb;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Parallel tokenizing                                                           */
+/* ----------------------------------------------------------------------------- */
+
+/*
+
+  tokenize_parallel() splits the input into chunks, lexes each chunk
+  on a thread of its own, and then stitches the chunk token arrays
+  together, in order.  The result is the same tokbuf that
+  tokenize_n() produces.
+
+  A chunk boundary is placed just after a newline that is followed by
+  something other than whitespace.  No identifier, integer, comment,
+  or run of whitespace continues past such a point, so the sequential
+  lexer is in one of two states there: at the start of a token, or
+  inside a string that began earlier.
+
+  Each chunk is lexed speculatively, assuming the first state.  The
+  stitch pass walks the chunks in order, tracking where the
+  sequential lexer would be.  When a chunk ends inside a string, the
+  string is lexed again from its start, with the real end of the
+  input, and so it may end several chunks later.  The chunk in which
+  it ends is then lexed from the end of the string, which is the
+  second state.  A string longer than MAX_STRINGLEN is handled the
+  same way, though the lexer ends it before its closing quote.
+
+  Only chunks that begin inside a string are lexed twice, and in most
+  programs there are none.
+
+*/
+
+typedef struct tokchunk {
+  const char *start;
+  const char *end;
+  bool        last;		// chunk ends at the end of the input
+  tokbuf     *toks;		// tokens, assuming start is a token start
+  const char *open;		// start of a string cut off at the end
+} tokchunk;
+
+typedef struct tokworker {
+  const char *input;
+  tokchunk *chunks;
+  size_t    nchunks;
+  size_t    first;		// this worker lexes chunks first,
+  size_t    stride;		// first + stride, and so on
+} tokworker;
+
+static void *tokenize_chunks(void *arg) {
+  tokworker *w = arg;
+  for (size_t i = w->first; i < w->nchunks; i += w->stride) {
+    tokchunk *c = &w->chunks[i];
+    c->toks = new_tokbuf(w->input, NULL,
+			 TOKBUF_CAPACITY((size_t) (c->end - c->start)));
+    c->open = tokenize_range(c->toks, c->start, c->end, c->last);
   }
   return NULL;
 }
+
+// Move the tokens of 'src' to the end of 'dest', and free 'src'
+static void tokbuf_concat(tokbuf *dest, tokbuf *src) {
+  size_t base = dest->count;
+  if (base + src->count > dest->capacity) {
+    dest->capacity = 2 * dest->capacity + src->count;
+    dest->kinds = realloc(dest->kinds, dest->capacity * sizeof(uint32_t));
+    dest->offsets = realloc(dest->offsets, dest->capacity * sizeof(uint32_t));
+    if (!dest->kinds || !dest->offsets) PANIC_OOM();
+  }
+  memcpy(dest->kinds + base, src->kinds, src->count * sizeof(uint32_t));
+  memcpy(dest->offsets + base, src->offsets, src->count * sizeof(uint32_t));
+  dest->count += src->count;
+  if (dest->naux + src->naux > dest->auxcapacity) {
+    dest->auxcapacity = 2 * dest->auxcapacity + src->naux;
+    dest->aux = realloc(dest->aux, dest->auxcapacity * sizeof(tokbuf_aux));
+    if (!dest->aux) PANIC_OOM();
+  }
+  for (size_t i = 0; i < src->naux; i++) {
+    dest->aux[dest->naux] = src->aux[i];
+    dest->aux[dest->naux++].index += base;
+  }
+  free_tokbuf(src);
+}
+
+// Split the input, which has 'len' bytes, into chunks of about
+// 'chunksize' bytes.  Returns the number of chunks.
+static size_t split_chunks(tokchunk *chunks, size_t maxchunks,
+			   const char *input, size_t len, size_t chunksize) {
+  const char *end = input + len;
+  const char *start = input;
+  size_t n = 0;
+  while (n + 1 < maxchunks) {
+    const char *p = input + (n + 1) * chunksize;
+    if (p < start) p = start;
+    if (p >= end) break;
+    p = memchr(p, '\n', (size_t) (end - p));
+    while (p && (p + 1 < end) && all_whitespacep(p + 1, 1))
+      p = memchr(p + 1, '\n', (size_t) (end - p - 1));
+    if (!p || (p + 1 >= end)) break;
+    chunks[n++] = (tokchunk) {.start = start, .end = p + 1};
+    start = p + 1;
+  }
+  chunks[n++] = (tokchunk) {.start = start, .end = end, .last = true};
+  return n;
+}
+
+// Like tokenize_n(), using up to 'nthreads' threads.  The input is
+// split into chunks of about 'chunksize' bytes, or, when 'chunksize'
+// is 0, a few per thread and no smaller than TOKENIZE_MIN_CHUNK (and
+// with one thread, not split at all).
+tokbuf *tokenize_parallel(const char *input, const char *end,
+			  int nthreads, size_t chunksize) {
+  if (!input) return NULL;
+  size_t len = end ? (size_t) (end - input) : strlen(input);
+  if (nthreads < 1) nthreads = 1;
+  if (!chunksize) {
+    if (nthreads == 1) return tokenize_n(input, end);
+    chunksize = len / (4 * (size_t) nthreads);
+    if (chunksize < TOKENIZE_MIN_CHUNK) chunksize = TOKENIZE_MIN_CHUNK;
+  }
+  size_t maxchunks = len / chunksize + 1;
+  if (maxchunks == 1) return tokenize_n(input, end);
+
+  tokchunk *chunks = xmalloc(maxchunks * sizeof(tokchunk));
+  if (!chunks) PANIC_OOM();
+  size_t nchunks = split_chunks(chunks, maxchunks, input, len, chunksize);
+  if ((size_t) nthreads > nchunks) nthreads = (int) nchunks;
+
+  tokworker *workers = xmalloc((size_t) nthreads * sizeof(tokworker));
+  pthread_t *threads = xmalloc((size_t) nthreads * sizeof(pthread_t));
+  if (!workers || !threads) PANIC_OOM();
+  for (int t = 0; t < nthreads; t++) {
+    workers[t] = (tokworker) {.input = input,
+			      .chunks = chunks, .nchunks = nchunks,
+			      .first = (size_t) t, .stride = (size_t) nthreads};
+    if (t && pthread_create(&threads[t], NULL, tokenize_chunks, &workers[t]))
+      PANIC("failed to start a tokenizing thread");
+  }
+  tokenize_chunks(&workers[0]);
+  for (int t = 1; t < nthreads; t++)
+    if (pthread_join(threads[t], NULL))
+      PANIC("failed to join a tokenizing thread");
+  free(threads);
+  free(workers);
+
+  // The stitch pass.  'ptr' is where the sequential lexer would be.
+  size_t count = 0;
+  for (size_t i = 0; i < nchunks; i++) count += chunks[i].toks->count;
+  tokbuf *tb = new_tokbuf(input, end, count + 1);
+  const char *ptr = input;
+  for (size_t i = 0; i < nchunks; i++) {
+    tokchunk *c = &chunks[i];
+    const char *open;
+    if (ptr == c->start) {
+      open = c->open;
+      tokbuf_concat(tb, c->toks);
+    } else {
+      free_tokbuf(c->toks);
+      // A string from an earlier chunk covers all of this one
+      if (ptr >= c->end) continue;
+      open = tokenize_range(tb, ptr, c->end, c->last);
+    }
+    ptr = c->end;
+    if (open) {
+      ptr = open;
+      tokbuf_append(tb, read_token_n(&ptr, input + len));
+    }
+  }
+  // The last string may have run to the end of the input
+  if (!tb->count || (tokbuf_token(tb, tb->count - 1).type != TOKEN_EOF))
+    tokbuf_append(tb, read_token_n(&ptr, input + len));
+  free(chunks);
+  return tb;
+}
+
+void free_tokbuf(tokbuf *tb) {
+  if (!tb) return;
+  free(tb->kinds);
+  free(tb->offsets);
+  free(tb->aux);
+  lineindex_release(&tb->lines);
+  free(tb);
+}
+
+// Tokens are usually unpacked in order, so the search for an aux
+// entry starts with the one found last time, and the one after it
+static tokbuf_aux *find_aux(tokbuf *tb, size_t i) {
+  size_t hint = tb->auxhint;
+  if ((hint < tb->naux) && (tb->aux[hint].index == i))
+    return &tb->aux[hint];
+  if ((hint + 1 < tb->naux) && (tb->aux[hint + 1].index == i))
+    return &tb->aux[tb->auxhint = hint + 1];
+  size_t lo = 0, hi = tb->naux;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (tb->aux[mid].index < i) lo = mid + 1;
+    else hi = mid;
+  }
+  if ((lo == tb->naux) || (tb->aux[lo].index != i))
+    PANIC("missing aux entry for token %zu", i);
+  return &tb->aux[tb->auxhint = lo];
+}
+
+// Unpack token 'i'
+token tokbuf_token(tokbuf *tb, size_t i) {
+  if (!tb) PANIC_NULL();
+  if (i >= tb->count) PANIC("token index %zu out of range", i);
+  uint32_t kind = tb->kinds[i];
+  token tok = {.type = (token_type) (kind & 0xFF),
+	       .len = kind >> 8,
+	       .flags = usual_flags((token_type) (kind & 0xFF)),
+	       .start = tb->input + tb->offsets[i]};
+  if (tok.len == TOKBUF_AUX) {
+    tokbuf_aux *aux = find_aux(tb, i);
+    tok.len = aux->len;
+    tok.pos = aux->pos;
+    tok.flags = aux->flags;
+  }
+  return tok;
+}
+
+// Read starting at the next token in 'tb', which must be at *sptr,
+// and advance both of them as we go
+ast *read_program_tokens(symtab *st, tokbuf *tb, const char **sptr) {
+  if (!st || !tb) PANIC_NULL();
+  const char *input = *sptr;
+  pstate state = {.input=input, .astart=input, .sptr = sptr,
+		  .end = tb->end, .toks = tb, .symbols = st};
+  return read_program_from(&state);
+}
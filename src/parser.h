@@ -13,17 +13,74 @@
 // When TRACING is true, prints each token as it is read
 #define TRACING false
 
+// When PARSER_STATS (see ast.h) is true, the parser counts the
+// semantic tokens it lexes and the ones it consumes.  Peeking lexes a
+// token without consuming it, so the difference shows how often the
+// lookahead cache in pstate is missed.
+
+// The parser keeps its own stack instead of recursing, so deeply
+// nested input cannot overflow the C stack.  Nesting (of lists,
+// bindings and Curried applications) deeper than this, or than a
+// pstate's 'max_depth', is an ERR_DEPTH error.
+#ifndef MAX_DEPTH
+#define MAX_DEPTH 1000
+#endif
+
+// The semantic tokens (no whitespace or comments) of an entire
+// input, lexed once, ending with TOKEN_EOF.
+//
+// Tokens are packed into 8 bytes, stored as two arrays: 'kinds' holds
+// the token type in the low 8 bits and the length in the high 24
+// bits, and 'offsets' holds the start of the token relative to
+// 'input'.  The rare token that does not fit, because it has an error
+// position, unusual flags, or a very long length, has TOKBUF_AUX as
+// its packed length, and its fields are kept in the 'aux' side table,
+// which is sorted by token index.  Use tokbuf_token() to unpack a
+// token.
+
+#define TOKBUF_AUX 0xFFFFFF
+
+typedef struct tokbuf_aux {
+  size_t   index;		// which token
+  ulen_t   len;
+  ulen_t   pos;
+  uint32_t flags;
+} tokbuf_aux;
+
+typedef struct tokbuf {
+  const char *input;		// base for the offsets
+  const char *end;		// end of input, or NULL at a NUL
+  uint32_t   *kinds;		// type:8 | len:24
+  uint32_t   *offsets;		// start of token, from input
+  size_t      count;		// number of tokens, including the EOF
+  size_t      capacity;
+  size_t      next;		// index of next token to be read
+  tokbuf_aux *aux;
+  size_t      naux;
+  size_t      auxcapacity;
+  size_t      auxhint;		// aux entry found last time
+  lineindex   lines;		// line starts, from input
+} tokbuf;
+
 // Parser state
 typedef struct pstate {
   const char *input;		// the entire input
   const char *astart;		// start of current ast in input
   const char **sptr;		// current position in input
+  const char *end;		// end of input, or NULL at a NUL
+  tokbuf     *toks;		// when not NULL, read tokens from here
+  symtab     *symbols;		// where identifiers are interned
+  lineindex   lines;		// line starts, unless reading from toks
+  size_t      max_depth;	// nesting limit, or 0 for MAX_DEPTH
+  token       peeked;		// the next semantic token, as lexed
+  const char *peeked_at;	//   by a peek at this position,
+  const char *peeked_end;	//   ending here (NULL when none)
 } pstate;
 
 #define in(s) ((s)->input)
 #define pos(s) (*((s)->sptr))
 
-// Configurations for read_separated_list
+// Configurations for reading separated lists
 typedef struct rsl_parms {
   bool       (*acceptablep)(ast *);
   ast_type   subtype;
@@ -40,8 +97,73 @@ typedef struct rsl_parms {
 ast  *read_ast(pstate *s);
 token read_token(const char **s);
 
-// Primary external interface
-ast *read_program(const char **sptr);
+// Primary external interface.  Identifiers are interned in 'st',
+// which must outlive the ASTs.
+ast *read_program(symtab *st, const char **sptr);
+ast *read_program_n(symtab *st, const char **sptr, const char *end);
+
+// Pre-tokenized interface: tokenize() the whole input, and then call
+// read_program_tokens() the way read_program() would be called
+tokbuf *tokenize(const char *input);
+tokbuf *tokenize_n(const char *input, const char *end);
+void    free_tokbuf(tokbuf *tb);
+token   tokbuf_token(tokbuf *tb, size_t i);
+ast    *read_program_tokens(symtab *st, tokbuf *tb, const char **sptr);
+
+// Tokenize with several threads, for very large inputs.  The result
+// is the same as from tokenize_n().
+#define TOKENIZE_MIN_CHUNK (64 * 1024)
+tokbuf *tokenize_parallel(const char *input, const char *end,
+			  int nthreads, size_t chunksize);
+
+// Incremental reparsing, e.g. for an editor.  The source is kept in
+// a buffer from malloc, and reparse_program() applies each edit to it
+// in place, replacing 'deleted' bytes at 'offset' with 'inserted'.
+// It returns what read_program_n() of the edited source would, given
+// 'prog', what it returned before the edit.  Only the smallest block
+// or argument list that encloses the edit is parsed again, and the
+// rest of 'prog' is reused, its positions moved to the edited source.
+// When that cannot be done, e.g. because the edit changes where the
+// enclosing brackets are, the whole source is parsed.  Either way,
+// 'prog' belongs to reparse_program(), and must not be used after.
+// The reparsed identifiers are interned in 'st', with those of 'prog'.
+// Moving the positions of the nodes after the edit takes time in
+// proportion to their number.  reparse_program_lazy() leaves most of
+// them to be moved later, so that an edit costs time in proportion to
+// the depth of the tree around it, e.g. for an editor that reparses
+// on each keystroke and reads positions less often.  Its result has
+// the right shape, but not the right 'start' in each node, until
+// settle_positions() brings all of them up to date.  Either function
+// may be given the result of the other.
+typedef struct source {
+  char  *text;			// NUL-terminated, from malloc
+  size_t len;
+  size_t capacity;		// bytes allocated for 'text'
+} source;
+
+typedef struct source_edit {
+  size_t      offset;
+  size_t      deleted;
+  const char *inserted;
+  size_t      inserted_len;
+} source_edit;
+
+ast *reparse_program(symtab *st, ast *prog, source *src, source_edit edit);
+ast *reparse_program_lazy(symtab *st, ast *prog, source *src,
+			  source_edit edit);
+void settle_positions(ast *prog);
+
+// Counts for this thread since its last reset, which stay zero
+// unless PARSER_STATS is true
+typedef struct parser_stats {
+  size_t lexed;			// semantic tokens lexed by the parser,
+  size_t consumed;		// and read by it (not from a tokbuf)
+  size_t nodes;			// AST nodes allocated
+  size_t reparsed;		// bytes parsed by reparse_program()
+} parser_stats;
+
+parser_stats parser_statistics(void);
+void         reset_parser_statistics(void);
 
 #endif
 
@@ -14,11 +14,14 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <locale.h>		// for large number printing
+#include <pthread.h>
+#include <sys/mman.h>		// for mprotect
 
 // This controls much of the "ordinary" output
 #define PRINTING false
@@ -39,6 +42,9 @@
 
 #define newline() do { puts(""); } while(0)
 
+// Where the identifiers of (nearly) all of the tests are interned
+static symtab *symbols;
+
 static void set(char *dest, const char *src) {
   TEST_ASSERT(strlen(src) <= BUFSIZE);
   strncpy(dest, src, BUFSIZE-1);
@@ -55,13 +61,15 @@ static void fill(char *dest, const char c, int n) {
 #define SET(str) do {						\
     set(in, (str));						\
     end = in;							\
-    state = (pstate){.input=in, .astart=in, .sptr = &end};	\
+    state = (pstate){.input=in, .astart=in, .sptr = &end,	\
+		     .symbols = symbols};			\
   } while (0);
 
 #define FILL(chr, n) do {					\
     fill(in, (chr), (n));					\
     end = in;							\
-    state = (pstate){.input=in, .astart=in, .sptr = &end};	\
+    state = (pstate){.input=in, .astart=in, .sptr = &end,	\
+		     .symbols = symbols};			\
   } while (0);
 
 typedef enum FuzzMode {
@@ -284,6 +292,503 @@ static uint32_t generate_integer(char *dest, uint32_t maxlen, enum FuzzMode mode
   return len;
 }
 
+static bool quotep(const char *c) {
+  return *c == '"';
+}
+
+// Every packed token must unpack to exactly what read_token() made
+static void compare_tokbuf(tokbuf *tb, const char *input) {
+  const char *ptr = input;
+  token tok;
+  size_t i = 0;
+  do {
+    tok = read_token(&ptr);
+    if ((tok.type == TOKEN_WS) || (tok.type == TOKEN_COMMENT)) continue;
+    TEST_ASSERT(i < tb->count);
+    token packed = tokbuf_token(tb, i++);
+    TEST_ASSERT(packed.type == tok.type);
+    TEST_ASSERT(packed.len == tok.len);
+    TEST_ASSERT(packed.pos == tok.pos);
+    TEST_ASSERT(packed.flags == tok.flags);
+    TEST_ASSERT(packed.start == tok.start);
+  } while (tok.type != TOKEN_EOF);
+  TEST_ASSERT(i == tb->count);
+}
+
+// Parse all of 'input' with read_program() and again with
+// read_program_tokens(), expecting exactly the same results
+static int compare_parse_paths(const char *input) {
+  const char *ptr1 = input, *ptr2 = input;
+  tokbuf *tb = tokenize(input);
+  TEST_ASSERT(tb && (tb->count > 0));
+  compare_tokbuf(tb, input);
+  int count = 0;
+  ast *a1, *a2;
+  do {
+    a1 = read_program(symbols, &ptr1);
+    a2 = read_program_tokens(symbols, tb, &ptr2);
+    TEST_ASSERT(!a1 == !a2);
+    if (a1 && a2) {
+      TEST_ASSERT(ast_equal(a1, a2));
+      TEST_ASSERT(a1->start == a2->start);
+    }
+    TEST_ASSERT(ptr1 == ptr2);
+    if (a1) count++;
+    free_ast(a1);
+    free_ast(a2);
+  } while (a1);
+  free_tokbuf(tb);
+  return count;
+}
+
+// Whether trees that are ast_equal() have their nodes at the same
+// offsets in their inputs
+static bool same_positions(ast *a, const char *ina, ast *b, const char *inb) {
+  while (true) {
+    if ((a->start - ina) != (b->start - inb)) return false;
+    if (!ast_consp(a)) return true;
+    if (!same_positions(ast_car(a), ina, ast_car(b), inb)) return false;
+    a = ast_cdr(a);
+    b = ast_cdr(b);
+  }
+}
+
+// Make random edits to 'input', expecting each reparse to give what
+// parsing all of the edited source gives.  Returns how many of them
+// parsed only part of the source.
+static int compare_reparse(const char *input, int nedits) {
+  // Mostly edits that keep a program valid
+  const char *pieces[] = {
+    "x", "x", "x", "12", "12", " ", " ", "f(a)", "f(a)", "{s; t}", "",
+    "(", ")", "{", "}", ";", ",", "\"", "=>", "let y = 2;", "cond",
+    "λ(a) {a}", "// c\n", "\n", "q, r",
+  };
+  size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+  source src = {.len = strlen(input)};
+  // Sometimes the source must move to a larger buffer
+  src.capacity = src.len + 1 + random_in(2) * BUFSIZE;
+  src.text = xmalloc(src.capacity);
+  TEST_ASSERT(src.text);
+  memcpy(src.text, input, src.len + 1);
+  const char *ptr = src.text;
+  ast *prog = read_program_n(symbols, &ptr, src.text + src.len);
+  int nlocal = 0;
+  for (int i = 0; i < nedits; i++) {
+    source_edit edit = {.offset = random_in((uint32_t) src.len + 1)};
+    if (!random_in(3))
+      edit.deleted = random_in((uint32_t) (src.len - edit.offset) + 1) % 4;
+    edit.inserted = pieces[random_in(npieces)];
+    edit.inserted_len = strlen(edit.inserted);
+    size_t reparsed = parser_statistics().reparsed;
+    bool lazy = random_in(2);
+    prog = lazy ? reparse_program_lazy(symbols, prog, &src, edit)
+                : reparse_program(symbols, prog, &src, edit);
+    if (parser_statistics().reparsed - reparsed < src.len) nlocal++;
+    TEST_ASSERT(src.text[src.len] == '\0');
+    ptr = src.text;
+    ast *full = read_program_n(symbols, &ptr, src.text + src.len);
+    TEST_ASSERT(!prog == !full);
+    if (full && ast_errorp(full)) {
+      TEST_ASSERT(ast_errorp(prog));
+      TEST_ASSERT(ast_error_type(prog) == ast_error_type(full));
+      TEST_ASSERT(prog->start == full->start);
+    } else if (full) {
+      TEST_ASSERT(ast_equal(prog, full));
+      if (lazy) {
+	// Settle a copy, so that later edits find positions still pending
+	ast *settled = ast_copy(prog);
+	settle_positions(settled);
+	TEST_ASSERT(same_positions(settled, src.text, full, src.text));
+	free_ast(settled);
+      } else {
+	TEST_ASSERT(same_positions(prog, src.text, full, src.text));
+      }
+    }
+    free_ast(full);
+  }
+  free_ast(prog);
+  free(src.text);
+  return nlocal;
+}
+
+// An edit at the first match of 'at' in the source
+typedef struct local_edit {
+  const char *at;
+  size_t      deleted;
+  const char *inserted;
+} local_edit;
+
+// Make edits that each stay inside a block or an argument list, and
+// so parse only that again, expecting the same tree as parsing all
+// of the edited source, with every node where that parse puts it.
+// Lazily, the positions are settled only after the last edit.
+static void check_local_edits(const char *input, const local_edit *edits,
+			      size_t nedits, bool lazy) {
+  source src = {.len = strlen(input), .capacity = BUFSIZE};
+  src.text = xmalloc(src.capacity);
+  TEST_ASSERT(src.text);
+  strcpy(src.text, input);
+  const char *ptr = src.text;
+  ast *prog = read_program_n(symbols, &ptr, src.text + src.len);
+  TEST_ASSERT(prog && !ast_errorp(prog));
+  ast *full = NULL;
+  for (size_t i = 0; i < nedits; i++) {
+    const char *at = strstr(src.text, edits[i].at);
+    TEST_ASSERT(at);
+    source_edit edit = {(size_t) (at - src.text), edits[i].deleted,
+			edits[i].inserted, strlen(edits[i].inserted)};
+    size_t reparsed = parser_statistics().reparsed;
+    prog = lazy ? reparse_program_lazy(symbols, prog, &src, edit)
+                : reparse_program(symbols, prog, &src, edit);
+    if (PARSER_STATS)
+      TEST_ASSERT(parser_statistics().reparsed - reparsed < src.len);
+    free_ast(full);
+    ptr = src.text;
+    full = read_program_n(symbols, &ptr, src.text + src.len);
+    TEST_ASSERT(prog && full && !ast_errorp(full));
+    TEST_ASSERT(ast_equal(prog, full));
+    if (!lazy) TEST_ASSERT(same_positions(prog, src.text, full, src.text));
+  }
+  settle_positions(prog);
+  TEST_ASSERT(same_positions(prog, src.text, full, src.text));
+  free_ast(full);
+  free_ast(prog);
+  free(src.text);
+}
+
+// Copy 'input', without its NUL, to the end of a page that is
+// followed by a page that cannot be read.  Reading at or past the end
+// of the copy will crash.  Call release_page_end() when done.
+static char *page_end_copy(const char *input, size_t len, void **region) {
+  size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+  size_t before = (len + pagesize - 1) / pagesize * pagesize;
+  TEST_ASSERT(posix_memalign(region, pagesize, before + pagesize) == 0);
+  TEST_ASSERT(mprotect((char *) *region + before, pagesize, PROT_NONE) == 0);
+  char *copy = (char *) *region + before - len;
+  memcpy(copy, input, len);
+  return copy;
+}
+
+static void release_page_end(void *region, size_t len) {
+  size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+  size_t before = (len + pagesize - 1) / pagesize * pagesize;
+  TEST_ASSERT(mprotect((char *) region + before, pagesize, PROT_READ | PROT_WRITE) == 0);
+  free(region);
+}
+
+// Lex and parse 'input' as usual, and again with the length-bounded
+// API on a copy that has no NUL, expecting exactly the same results
+static void compare_bounded(const char *input) {
+  static FILE *devnull = NULL;
+  if (!devnull) devnull = fopen("/dev/null", "w");
+  TEST_ASSERT(devnull);
+  size_t len = strlen(input);
+  void *region;
+  char *copy = page_end_copy(input, len, &region);
+  const char *end = copy + len;
+
+  const char *ptr1 = input, *ptr2 = copy;
+  token tok1, tok2;
+  size_t count = 0;
+  do {
+    tok1 = read_token(&ptr1);
+    tok2 = read_token_n(&ptr2, end);
+    TEST_ASSERT(tok1.type == tok2.type);
+    TEST_ASSERT(tok1.len == tok2.len);
+    TEST_ASSERT(tok1.pos == tok2.pos);
+    TEST_ASSERT(tok1.flags == tok2.flags);
+    TEST_ASSERT(tok1.start - input == tok2.start - copy);
+    TEST_ASSERT(ptr1 - input == ptr2 - copy);
+    if ((tok1.type != TOKEN_WS) && (tok1.type != TOKEN_COMMENT)) count++;
+  } while (tok1.type != TOKEN_EOF);
+
+  tokbuf *tb = tokenize_n(copy, end);
+  TEST_ASSERT(tb && (tb->count == count));
+  free_tokbuf(tb);
+
+  ast *a1, *a2;
+  ptr1 = input;
+  ptr2 = copy;
+  do {
+    a1 = read_program(symbols, &ptr1);
+    a2 = read_program_n(symbols, &ptr2, end);
+    TEST_ASSERT(!a1 == !a2);
+    if (a1 && a2) {
+      TEST_ASSERT(ast_equal(a1, a2));
+      TEST_ASSERT(a1->start - input == a2->start - copy);
+      if (ast_errorp(a2)) fprint_error(devnull, a2);
+    }
+    TEST_ASSERT(ptr1 - input == ptr2 - copy);
+    free_ast(a1);
+    free_ast(a2);
+  } while (a1);
+  release_page_end(region, len);
+}
+
+// Lex 'input' in one shot, and again by feeding it to a lexstream in
+// chunks of random sizes up to 'maxchunk', expecting the same tokens
+static void compare_streamed(const char *input, int maxchunk) {
+  size_t len = strlen(input);
+  const char *end = input + len;
+  const char *ptr = input;
+  size_t ntokens = 0, capacity = 64;
+  token *expected = malloc(capacity * sizeof(token));
+  TEST_ASSERT(expected);
+  do {
+    if (ntokens == capacity) {
+      capacity *= 2;
+      expected = realloc(expected, capacity * sizeof(token));
+      TEST_ASSERT(expected);
+    }
+    expected[ntokens] = read_token_n(&ptr, end);
+  } while (expected[ntokens++].type != TOKEN_EOF);
+
+  lexstream *ls = lexstream_new();
+  size_t fed = 0, i = 0;
+  token tok;
+  while (i < ntokens) {
+    if (lexstream_next(ls, &tok)) {
+      TEST_ASSERT(tok.type == expected[i].type);
+      TEST_ASSERT(tok.len == expected[i].len);
+      TEST_ASSERT(tok.pos == expected[i].pos);
+      TEST_ASSERT(tok.flags == expected[i].flags);
+      TEST_ASSERT(ls->offset + (size_t) (tok.start - ls->buf)
+		  == (size_t) (expected[i].start - input));
+      i++;
+    } else if (fed < len) {
+      size_t n = 1 + random_in(maxchunk);
+      if (n > len - fed) n = len - fed;
+      lexstream_feed(ls, input + fed, n);
+      fed += n;
+    } else {
+      TEST_ASSERT(!ls->finished);
+      lexstream_finish(ls);
+    }
+  }
+  // And EOF from then on
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_EOF));
+  lexstream_free(ls);
+  free(expected);
+}
+
+// lineindex_line() must agree with counting newlines, and afterwards
+// the line index of 'tb' must hold the start of every line but the
+// first
+static void check_lines(tokbuf *tb, const char *input) {
+  size_t len = strlen(input), n = 0;
+  size_t line = 1;
+  const char *line_start = input, *start;
+  for (size_t i = 0; i <= len; i++) {
+    if (!random_in(8) || (i == len)) {
+      TEST_ASSERT(lineindex_line(&tb->lines, input + i, &start) == line);
+      TEST_ASSERT(start == line_start);
+    }
+    if (input[i] == '\n') {
+      line++;
+      line_start = input + i + 1;
+    }
+  }
+  for (size_t i = 0; i < len; i++)
+    if (input[i] == '\n') {
+      TEST_ASSERT(n < tb->lines.count);
+      TEST_ASSERT(tb->lines.starts[n++] == i + 1);
+    }
+  TEST_ASSERT(n == tb->lines.count);
+}
+
+// Count the identifiers named 'name' in 'a', all of which must be the
+// same string as the first one seen
+static int count_interned(ast *a, const char *name, char **seen) {
+  if (!a) return 0;
+  if (ast_consp(a))
+    return count_interned(a->car, name, seen) + count_interned(a->cdr, name, seen);
+  if (!ast_identifierp(a) || (strcmp(a->str, name) != 0)) return 0;
+  if (!*seen) *seen = a->str;
+  TEST_ASSERT(a->str == *seen);
+  return 1;
+}
+
+// Parses a program in a thread of its own, with a symbol table of
+// its own, and returns the interned "x" that it saw
+typedef struct interning {
+  const char *input;
+  size_t      nsymbols;		// in the thread's table, after parsing
+  char       *x;
+} interning;
+
+static void *intern_in_thread(void *arg) {
+  interning *job = arg;
+  const char *ptr = job->input;
+  symtab *st = new_symtab();
+  ast *a = read_program(st, &ptr);
+  TEST_ASSERT(a && !ast_errorp(a));
+  job->nsymbols = symtab_count(st);
+  job->x = NULL;
+  TEST_ASSERT(count_interned(a, "x", &job->x) == 2);
+  free_ast(a);
+  free_symtab(st);
+  return NULL;
+}
+
+// Tokenize 'input' in parallel, in chunks of about 'chunksize' bytes,
+// expecting exactly what the sequential lexer makes
+static void compare_parallel(const char *input, int nthreads, size_t chunksize) {
+  size_t len = strlen(input);
+  tokbuf *tb = tokenize_parallel(input, NULL, nthreads, chunksize);
+  compare_tokbuf(tb, input);
+  TEST_ASSERT(tb->end == NULL);
+  free_tokbuf(tb);
+  tb = tokenize_parallel(input, input + len, nthreads, chunksize);
+  compare_tokbuf(tb, input);
+  TEST_ASSERT(tb->end == input + len);
+  free_tokbuf(tb);
+}
+
+// The table-driven lexer must make exactly the tokens that the
+// hand-written one does, reading up to 'end', or to a NUL if 'end' is
+// NULL
+static void compare_backend_tokens(const char *input, const char *end) {
+  const char *ptr1 = input, *ptr2 = input;
+  token tok1, tok2;
+  do {
+    tok1 = read_token_direct(&ptr1, end);
+    tok2 = read_token_dfa(&ptr2, end);
+    TEST_ASSERT(tok1.type == tok2.type);
+    TEST_ASSERT(tok1.start == tok2.start);
+    TEST_ASSERT(tok1.len == tok2.len);
+    TEST_ASSERT(tok1.pos == tok2.pos);
+    TEST_ASSERT(tok1.flags == tok2.flags);
+    TEST_ASSERT(ptr1 == ptr2);
+  } while (tok1.type != TOKEN_EOF);
+}
+
+// Compare the lexers on the 'len' bytes of 'input', as bounded input
+// ending at a page that cannot be read, and also up to the NUL that
+// follows them unless there is a NUL among them
+static void compare_backends(const char *input, size_t len) {
+  void *region;
+  char *copy = page_end_copy(input, len, &region);
+  compare_backend_tokens(copy, copy + len);
+  release_page_end(region, len);
+  if (!memchr(input, '\0', len)) compare_backend_tokens(input, NULL);
+}
+
+// Keywords, operators, pieces of UTF-8, escapes, control chars, and
+// NULs, with now and then a run long enough to be too long
+static size_t generate_token_soup(char *dest, size_t limit) {
+  const char *pieces[] = {
+    "lambda", "λ", "def", "cond", "let", "=>", "=", "//", "/", "\"",
+    "\\", "\\\"", " ", "\n", "\t", "(", ")", "{", "}", ",", ";", "+",
+    "-", "7", "0", "x", "lam", "co", "\xce", "\xbb", "\xe2\x82", "\xf0",
+    "\x80", "\xff", "\x01", "\x7f", "\r",
+  };
+  size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+  size_t len = 0;
+  while (len + 2 * MAX_STRINGLEN + 8 < limit) {
+    int roll = random_in(100);
+    if (roll < 3) {
+      dest[len++] = '\0';
+    } else if (roll < 5) {
+      const char run[] = "a9\"";
+      char c = run[random_in(3)];
+      size_t n = random_in(2 * MAX_STRINGLEN);
+      if (c == '"') dest[len++] = '"';
+      memset(dest + len, c == '"' ? 'b' : c, n);
+      len += n;
+    } else {
+      const char *piece = pieces[random_in(npieces)];
+      memcpy(dest + len, piece, strlen(piece));
+      len += strlen(piece);
+    }
+    if (!random_in(200)) break;
+  }
+  dest[len] = '\0';
+  return len;
+}
+
+// The structural index of 'len' bytes of 'input', as bounded input
+// ending at a page that cannot be read, must have just the delimiters
+// that the lexer finds, with brackets matched as a stack would match
+// them, unless it is not exact.  Returns whether it is exact.
+static bool compare_structural(const char *input, size_t len) {
+  void *region;
+  char *copy = page_end_copy(input, len, &region);
+  const char *end = copy + len;
+  structindex *si = structural_index(copy, end);
+  bool exact = si->exact;
+  if (exact) {
+    size_t *stack = malloc((si->count + 1) * sizeof(size_t));
+    TEST_ASSERT(stack);
+    size_t i = 0, depth = 0;
+    const char *ptr = copy;
+    token tok;
+    do {
+      tok = read_token_n(&ptr, end);
+      if ((tok.type > TOKEN_SEMICOLON) && (tok.type != TOKEN_EQUALS)
+	  && (tok.type != TOKEN_ARROW))
+	continue;
+      TEST_ASSERT(i < si->count);
+      TEST_ASSERT(copy + si->positions[i] == tok.start);
+      if ((tok.type == TOKEN_OPENPAREN) || (tok.type == TOKEN_OPENBRACE)) {
+	stack[depth++] = i;
+      } else if ((tok.type == TOKEN_CLOSEPAREN) || (tok.type == TOKEN_CLOSEBRACE)) {
+	char open = (tok.type == TOKEN_CLOSEPAREN) ? '(' : '{';
+	if (depth && (copy[si->positions[stack[depth - 1]]] == open)) {
+	  TEST_ASSERT(structindex_partner(si, i) == stack[depth - 1]);
+	  TEST_ASSERT(structindex_partner(si, stack[depth - 1]) == i);
+	  depth--;
+	} else {
+	  TEST_ASSERT(structindex_partner(si, i) == STRUCTINDEX_NONE);
+	}
+      } else {
+	TEST_ASSERT(structindex_partner(si, i) == STRUCTINDEX_NONE);
+      }
+      i++;
+    } while (tok.type != TOKEN_EOF);
+    TEST_ASSERT(i == si->count);
+    while (depth) TEST_ASSERT(structindex_partner(si, stack[--depth]) == STRUCTINDEX_NONE);
+    free(stack);
+  }
+  // Up to the NUL, the index is the same
+  if (strlen(input) == len) {
+    structindex *si2 = structural_index(input, NULL);
+    TEST_ASSERT(si2->exact == si->exact);
+    TEST_ASSERT(si2->count == si->count);
+    for (size_t i = 0; i < si->count; i++)
+      TEST_ASSERT(si2->positions[i] == si->positions[i]);
+    free_structindex(si2);
+  }
+  free_structindex(si);
+  release_page_end(region, len);
+  return exact;
+}
+
+// Lines of code in which strings and comments span chunk boundaries
+static void generate_multiline_program(char *dest, size_t limit) {
+  const char *pieces[] = {
+    "x", " ", "\n", "\n\n  ", "f(a, b);", "12", "\"", "\"ab\ncd\"",
+    "\"\\\n\"", "\"\\\"\n\"", "// \"quote\n", "//\n", "\"λ\nλ\"", "=>",
+    "\n\"\n\"\n", "\"\xce\n\"", "-7\n",
+  };
+  size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+  size_t len = 0;
+  while (len + 2 * MAX_STRINGLEN + 2 < limit) {
+    if (!random_in(50)) {
+      // A string too long to be a string, with newlines in it
+      size_t n = MAX_STRINGLEN + random_in(MAX_STRINGLEN);
+      dest[len++] = '"';
+      for (size_t i = 0; i < n; i++)
+	dest[len++] = random_in(10) ? random_alpha() : '\n';
+      dest[len++] = '"';
+    } else {
+      const char *piece = pieces[random_in(npieces)];
+      strcpy(dest + len, piece);
+      len += strlen(piece);
+    }
+  }
+  dest[len] = '\0';
+}
+
 static void generate_random_program(char *dest) {
   uint32_t len = random_in(BUFSIZE-1);
   if (PRINT_ALL) printf("Generating random program of %u bytes\n", len);
@@ -421,6 +926,7 @@ int main(int argc, char **argv) {
   setlocale(LC_ALL, "");	// need for printing numbers
   
   TEST_START(argc, argv);
+  symbols = new_symtab();
   printf("Size of Token is %zu bytes\n", sizeof(token));
   printf("Size of AST node is %zu bytes\n", sizeof(ast));
   srandom(time(NULL));
@@ -732,6 +1238,50 @@ int main(int argc, char **argv) {
   
   /* ----------------------------------------------------------------------------- */
 
+  TEST_SECTION("Unescaping strings");
+
+  const char *bad;
+  tmp = unescape_string("abc", 3, &bad);
+  TEST_ASSERT(tmp && (strcmp(tmp, "abc") == 0));
+  free(tmp);
+  tmp = unescape_string("", 0, &bad);
+  TEST_ASSERT(tmp && (*tmp == '\0'));
+  free(tmp);
+  tmp = unescape_string("\\\\\\\"x\\n\\r\\t", 11, &bad);
+  TEST_ASSERT(tmp && (strcmp(tmp, "\\\"x\n\r\t") == 0));
+  free(tmp);
+  // Only 'len' bytes are unescaped
+  tmp = unescape_string("ab\\ncd", 4, &bad);
+  TEST_ASSERT(tmp && (strcmp(tmp, "ab\n") == 0));
+  free(tmp);
+  set(in, "ab\\qcd");
+  TEST_ASSERT(!unescape_string(in, 6, &bad) && (bad == in + 2));
+  // A lone ESC at the end is a bad escape sequence
+  TEST_ASSERT(!unescape_string(in, 3, &bad) && (bad == in + 2));
+
+  // Must agree with unescape() when there is a closing quote
+  for (int len = 0; len < 80; len++) {
+    for (int i = 0; i < len; i++) in[i] = "ab\\n\\\\t\\\"q"[random_in(10)];
+    in[len] = '"';
+    in[len + 1] = '\0';
+    const char *err1 = NULL, *err2 = NULL;
+    char *s1 = unescape(in, len + 1, quotep, &err1);
+    char *s2 = unescape_string(in, len, &err2);
+    // When there is an unescaped quote before the end, the input is
+    // not a valid string token
+    if (s1 && (err1 != in + len)) {
+      free(s1);
+      free(s2);
+      continue;
+    }
+    TEST_ASSERT(!s1 == !s2);
+    if (s1 && s2) TEST_ASSERT(strcmp(s1, s2) == 0);
+    free(s1);
+    free(s2);
+  }
+
+  /* ----------------------------------------------------------------------------- */
+
   TEST_SECTION("Low-level token reader API");
 
   token tok;
@@ -789,6 +1339,252 @@ int main(int argc, char **argv) {
   TEST_ASSERT(tok.type == TOKEN_EOF);
   TEST_ASSERT(end == in+2);
 
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Keyword lookup");
+
+  for (token_type t = KEYWORD_START; t < KEYWORD_END; t++) {
+    const char *kw = token_type_name(t);
+    size_t kwlen = strlen(kw);
+    TEST_ASSERT(is_keyword(kw, kwlen) == t);
+    // Prefixes and extensions of a keyword are identifiers, except
+    // that '=' is a prefix of '=>'
+    if (t != TOKEN_ARROW)
+      TEST_ASSERT(is_keyword(kw, kwlen - 1) == TOKEN_IDENTIFIER);
+    set(in, kw);
+    strcat(in, "s");
+    TEST_ASSERT(is_keyword(in, kwlen + 1) == TOKEN_IDENTIFIER);
+    // Same length, first byte, and last byte, so same hash
+    if (kwlen > 2) {
+      in[1] = 'Q';
+      TEST_ASSERT(is_keyword(in, kwlen) == TOKEN_IDENTIFIER);
+    }
+  }
+  TEST_ASSERT(is_keyword("lambda_", 7) == TOKEN_IDENTIFIER);
+  TEST_ASSERT(is_keyword("λx", strlen("λx")) == TOKEN_IDENTIFIER);
+
+  SET("lambda λ def cond let lets");
+  TEST_ASSERT(read_token(&end).type == TOKEN_LAMBDA);
+  TEST_ASSERT(read_token(&end).type == TOKEN_WS);
+  TEST_ASSERT(read_token(&end).type == TOKEN_LAMBDA_ALT);
+  read_token(&end);
+  TEST_ASSERT(read_token(&end).type == TOKEN_DEFINITION);
+  read_token(&end);
+  TEST_ASSERT(read_token(&end).type == TOKEN_COND);
+  read_token(&end);
+  TEST_ASSERT(read_token(&end).type == TOKEN_LET);
+  read_token(&end);
+  TEST_ASSERT(read_token(&end).type == TOKEN_IDENTIFIER);
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Identifier error positions");
+
+  // Invalid UTF-8 is reported ahead of an earlier control char
+  SET("\x07" "b\xC3" "c d");
+  tok = read_token(&end);
+  TEST_ASSERT(tok.type == TOKEN_BAD_IDCHAR);
+  TEST_ASSERT(tok.pos == 3);
+  TEST_ASSERT(end == in + 4);
+
+  SET("\x07" "bc d");
+  tok = read_token(&end);
+  TEST_ASSERT(tok.type == TOKEN_BAD_CHAR);
+  TEST_ASSERT(tok.pos == 0);
+  TEST_ASSERT(end == in + 3);
+
+  SET("ab\x7F" "λ\xE2\x82");
+  tok = read_token(&end);
+  TEST_ASSERT(tok.type == TOKEN_BAD_IDCHAR);
+  TEST_ASSERT(tok.pos == 7);	// Cut off by the end of the input
+  TEST_ASSERT(end == in + 7);
+
+  SET("a/b\x1F//comment");
+  tok = read_token(&end);
+  TEST_ASSERT(tok.type == TOKEN_BAD_IDCHAR);
+  TEST_ASSERT(tok.pos == 3);
+  TEST_ASSERT(end == in + 4);
+
+  // Too long, which takes priority over everything else
+  FILL('i', MAX_IDLEN + 1);
+  in[1] = '\x07';
+  in[2] = (char) 0xC3;
+  tok = read_token(&end);
+  TEST_ASSERT(tok.type == TOKEN_BAD_IDLEN);
+  TEST_ASSERT(tok.pos == MAX_IDLEN);
+  TEST_ASSERT(end == in + MAX_IDLEN + 1);
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Whitespace and comments at every alignment");
+
+  // The lexer skips whitespace and comment bodies a block at a time,
+  // so we try every starting offset and many lengths, with the run
+  // ending at a token and also at the end of the input.
+  for (int offset = 0; offset < 64; offset++) {
+    for (int len = 1; len < 100; len++) {
+      memset(in, 'x', offset);
+      for (int i = 0; i < len; i++) in[offset + i] = " \t\r\n"[i % 4];
+      for (int at_eof = 0; at_eof < 2; at_eof++) {
+	in[offset + len] = at_eof ? '\0' : 'y';
+	in[offset + len + 1] = '\0';
+	end = in + offset;
+	tok = read_token(&end);
+	TEST_ASSERT(tok.type == TOKEN_WS);
+	TEST_ASSERT(token_length(tok) == (size_t) len);
+	TEST_ASSERT(end == in + offset + len);
+      }
+      memset(in + offset, '/', 2);
+      memset(in + offset + 2, 'c', len);
+      for (int at_eof = 0; at_eof < 2; at_eof++) {
+	in[offset + len + 2] = at_eof ? '\0' : '\n';
+	in[offset + len + 3] = '\0';
+	end = in + offset;
+	tok = read_token(&end);
+	TEST_ASSERT(tok.type == TOKEN_COMMENT);
+	TEST_ASSERT(token_length(tok) == (size_t) len + 2);
+	TEST_ASSERT(end == in + offset + len + 2);
+      }
+    }
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Strings at every alignment");
+
+  // String bodies are also scanned a block at a time, stopping only
+  // at quotes, escapes, NUL, and non-ASCII bytes.  Put one of those at
+  // every position of every block alignment.
+  for (int offset = 0; offset < 64; offset++) {
+    for (int len = 2; len < 100; len++) {
+      memset(in, 'x', offset);
+      in[offset] = '"';
+      memset(in + offset + 1, 's', len);
+      in[offset + len + 1] = '"';
+      in[offset + len + 2] = '\0';
+      end = in + offset;
+      tok = read_token(&end);
+      TEST_ASSERT(tok.type == TOKEN_STRING);
+      TEST_ASSERT(token_length(tok) == (size_t) len + 2);
+      TEST_ASSERT(tok.flags & TOKEN_FLAG_NOESCAPES);
+      TEST_ASSERT(end == in + offset + len + 2);
+      // An escaped quote does not end the string
+      int at = offset + 1 + (offset + len) % (len - 1);
+      in[at] = '\\';
+      in[at + 1] = '"';
+      end = in + offset;
+      tok = read_token(&end);
+      TEST_ASSERT(tok.type == TOKEN_STRING);
+      TEST_ASSERT(token_length(tok) == (size_t) len + 2);
+      TEST_ASSERT(!(tok.flags & TOKEN_FLAG_NOESCAPES));
+      // A 2-byte UTF-8 sequence is fine, but a truncated one is not
+      in[at] = (char) 0xC3;
+      in[at + 1] = (char) 0xA9;
+      end = in + offset;
+      tok = read_token(&end);
+      TEST_ASSERT(tok.type == TOKEN_STRING);
+      TEST_ASSERT(tok.flags & TOKEN_FLAG_NOESCAPES);
+      in[at + 1] = 's';
+      end = in + offset;
+      tok = read_token(&end);
+      TEST_ASSERT(tok.type == TOKEN_BAD_STRCHAR);
+      TEST_ASSERT(tok.pos == (ulen_t) (at + 1 - offset));
+      TEST_ASSERT(end == in + offset + len + 2);
+      // Unterminated
+      in[offset + len + 1] = '\0';
+      end = in + offset;
+      tok = read_token(&end);
+      TEST_ASSERT(tok.type == TOKEN_BAD_STREOF);
+      TEST_ASSERT(end == in + offset + len + 1);
+    }
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Integer decoding");
+
+  // The lexer decodes integers 8 digits at a time where it can, so
+  // try every length, with and without a sign, against strtoll()
+  static const char *const ints[] = {
+    "0", "-0", "+0", "7", "-12345678", "123456789", "+0000000000000000001",
+    "9223372036854775807", "-9223372036854775808",
+    "9223372036854775808", "-9223372036854775809",
+    "18446744073709551615", "18446744073709551616", "99999999999999999999",
+    "-0000000000000000009", "00000000000000000000", "1234567812345678",
+  };
+  for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+    SET(ints[i]);
+    tok = read_token(&end);
+    TEST_ASSERT(tok.type == TOKEN_INTEGER);
+    errno = 0;
+    long long expected = strtoll(in, NULL, 10);
+    if (errno == ERANGE) {
+      TEST_ASSERT(tok.flags & TOKEN_FLAG_INTRANGE);
+    } else {
+      TEST_ASSERT(!(tok.flags & TOKEN_FLAG_INTRANGE));
+      TEST_ASSERT(interpret_int(tok.start, tok.len, &n) && (n == expected));
+    }
+  }
+  for (int trial = 0; trial < 2000; trial++) {
+    int len = 1 + rand() % MAX_INTLEN;
+    int first = 0;
+    if ((len > 1) && (trial % 3)) in[first++] = (trial % 3 == 1) ? '-' : '+';
+    for (int i = first; i < len; i++) in[i] = (char) ('0' + rand() % 10);
+    // Sometimes a bad character, anywhere after the first digit
+    int badpos = (trial % 4 == 0) ? first + 1 + rand() % (len - first) : -1;
+    if ((badpos >= 0) && (badpos < len)) in[badpos] = 'x';
+    in[len] = '\0';
+    end = in;
+    tok = read_token(&end);
+    TEST_ASSERT(end == in + len);
+    if ((badpos >= 0) && (badpos < len)) {
+      TEST_ASSERT(tok.type == TOKEN_BAD_INTCHAR);
+      TEST_ASSERT(tok.pos == (ulen_t) badpos);
+      continue;
+    }
+    TEST_ASSERT(tok.type == TOKEN_INTEGER);
+    errno = 0;
+    long long expected = strtoll(in, NULL, 10);
+    TEST_ASSERT(!(tok.flags & TOKEN_FLAG_INTRANGE) == (errno != ERANGE));
+    // The value is decoded from the token's text
+    TEST_ASSERT(interpret_int(in, (ulen_t) len, &n) == (errno != ERANGE));
+    if (errno != ERANGE) TEST_ASSERT(n == expected);
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("UTF-8 validation at every position");
+
+  // invalid_utf8() checks whole blocks at a time, and a multibyte
+  // sequence may straddle two blocks or the end of the input
+  for (int len = 1; len < 100; len++) {
+    for (int at = 0; at < len; at++) {
+      memset(in, 'u', len);
+      in[len] = '\0';
+      TEST_ASSERT(invalid_utf8(in, len) == -1);
+      // Stray continuation bytes are accepted
+      in[at] = (char) 0x80;
+      TEST_ASSERT(invalid_utf8(in, len) == -1);
+      in[at] = '\0';
+      TEST_ASSERT(invalid_utf8(in, len) == at);
+      // 3-byte sequence, or one cut short by an ASCII byte or the end
+      in[at] = (char) 0xE2;
+      if (at + 2 < len) {
+	in[at + 1] = (char) 0x82;
+	in[at + 2] = (char) 0xAC;
+	TEST_ASSERT(invalid_utf8(in, len) == -1);
+	in[at + 2] = 'u';
+	TEST_ASSERT(invalid_utf8(in, len) == at + 2);
+      } else {
+	TEST_ASSERT(invalid_utf8(in, len) == ((at + 1 < len) ? at + 1 : len));
+      }
+    }
+  }
+
+  SET("\"No escapes here\" \"One\\there\"");
+  a = read_ast(&state);
+  TEST_ASSERT(a && ast_stringp(a));
+  TEST_ASSERT(strcmp(a->str, "No escapes here") == 0);
+  free_ast(a);
+  a = read_ast(&state);
+  TEST_ASSERT(a && ast_stringp(a));
+  TEST_ASSERT(strcmp(a->str, "One\there") == 0);
+  free_ast(a);
+
   // -----------------------------------------------------------------------------
   TEST_SECTION("Parsing errors");
 
@@ -1248,6 +2044,7 @@ int main(int argc, char **argv) {
       print_ast(b); newline();					\
     }								\
     TEST_ASSERT(ast_equal(r, b));				\
+    TEST_ASSERT(ast_equal(a, b));				\
     free_ast(r);						\
     free_ast(b);						\
     free_ast(a);						\
@@ -1273,6 +2070,20 @@ int main(int argc, char **argv) {
   FIXUPTEST("let a = 1 {add(a,100)}",   // No change, because the original
 	    "let a  = 1 {add(a,100)}"); // exp has a block in it
 
+  // The parser desugars as it reads, so fixup_let() makes a copy of
+  // the same tree, allocating as many nodes as parsing did
+  SET("{123; let a = 5; add(a, 1); let b = f(let c = a); {let d = b}}");
+  reset_parser_statistics();
+  a = read_ast(&state);
+  size_t nodes = parser_statistics().nodes;
+  r = fixup_let(a);
+  TEST_ASSERT(ast_equal(a, r));
+  printf("Parsing allocated %zu nodes, and fixup_let() %zu more\n",
+	 nodes, parser_statistics().nodes - nodes);
+  if (PARSER_STATS) TEST_ASSERT(parser_statistics().nodes == 2 * nodes);
+  free_ast(r);
+  free_ast(a);
+
 
 
   // -----------------------------------------------------------------------------
@@ -1291,7 +2102,8 @@ int main(int argc, char **argv) {
 
     buf = make_list_of_strings(limit, '(', ',', ')');
     end = buf;
-    state = (pstate){.input=buf, .astart=buf, .sptr = &end};
+    state = (pstate){.input=buf, .astart=buf, .sptr = &end,
+		     .symbols = symbols};
     a = read_ast(&state);
     TEST_ASSERT(a);
     TEST_ASSERT(ast_parametersp(a));
@@ -1301,7 +2113,8 @@ int main(int argc, char **argv) {
 
     buf = make_list_of_strings(limit, '{', ';', '}');
     end = buf;
-    state = (pstate){.input=buf, .astart=buf, .sptr = &end};
+    state = (pstate){.input=buf, .astart=buf, .sptr = &end,
+		     .symbols = symbols};
     a = read_ast(&state);
     TEST_ASSERT(a);
     TEST_ASSERT(ast_blockp(a));
@@ -1318,7 +2131,8 @@ int main(int argc, char **argv) {
   for (int i = 0; i < fuzziters; i++) {
     generate_string(in, GOOD_BYTES);
     end = in;
-    state = (pstate){.input=in, .astart=in, .sptr = &end};
+    state = (pstate){.input=in, .astart=in, .sptr = &end,
+		     .symbols = symbols};
     a = read_ast(&state);
     if (!a) break;		// EOF
     if (ast_errorp(a)) {
@@ -1379,7 +2193,8 @@ int main(int argc, char **argv) {
     if ((i % 10000) == 0) printf("%6d identifiers tested\n", i);
     generate_identifier(in, MAX_IDLEN, GOOD_BYTES);
     end = in;
-    state = (pstate){.input=in, .astart=in, .sptr = &end};
+    state = (pstate){.input=in, .astart=in, .sptr = &end,
+		     .symbols = symbols};
     a = read_ast(&state);
     if (!a) break;		// EOF
     if (!ast_identifierp(a)) {
@@ -1401,7 +2216,8 @@ int main(int argc, char **argv) {
     if ((i % 10000) == 0) printf("%6d identifiers tested\n", i);
     generate_identifier(in, MAX_IDLEN, WITH_BAD_CHAR);
     end = in;
-    state = (pstate){.input=in, .astart=in, .sptr = &end};
+    state = (pstate){.input=in, .astart=in, .sptr = &end,
+		     .symbols = symbols};
     a = read_ast(&state);
     if (!a) break;		// EOF
     if (ast_errorp(a)) {
@@ -1458,7 +2274,8 @@ int main(int argc, char **argv) {
     int other_error_count = 0;
     generate_random_program(in);
     end = in;
-    state = (pstate){.input=in, .astart=in, .sptr = &end};
+    state = (pstate){.input=in, .astart=in, .sptr = &end,
+		     .symbols = symbols};
     total_chars += strlen(in);
     if (PRINT_ALL) printf("Input: '%s'\n", in);
     do {
@@ -1548,6 +2365,867 @@ int main(int argc, char **argv) {
 
   TEST_ASSERT(total_asts == total_valid + total_errors);
 
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Pre-tokenized parsing");
+
+  TEST_ASSERT(tokenize(NULL) == NULL);
+
+  SET("  // Nothing but atmosphere\n  ");
+  tokbuf *tb = tokenize(in);
+  TEST_ASSERT(tb && (tb->count == 1) && (tokbuf_token(tb, 0).type == TOKEN_EOF));
+  free_tokbuf(tb);
+
+  SET("def f = λ(a, b) { // comment\n let x = a; add(x, b) }");
+  tb = tokenize(in);
+  TEST_ASSERT(tb->count == 23);
+  TEST_ASSERT(tokbuf_token(tb, 0).type == TOKEN_DEFINITION);
+  TEST_ASSERT(tokbuf_token(tb, tb->count - 1).type == TOKEN_EOF);
+  free_tokbuf(tb);
+
+  // Error positions, escapes, and long lengths go in the aux table
+  SET("\"esc\\n\" \"plain\" 1a \"\\q\" abc\x07 99999999999999999999999 x");
+  tb = tokenize(in);
+  TEST_ASSERT(tb->naux == 5);
+  compare_tokbuf(tb, in);
+  TEST_ASSERT(tokbuf_token(tb, 4).type == TOKEN_BAD_IDCHAR);
+  TEST_ASSERT(tokbuf_token(tb, 4).pos == 3);
+  TEST_ASSERT(tokbuf_token(tb, 1).flags == TOKEN_FLAG_NOESCAPES);
+  TEST_ASSERT(tokbuf_token(tb, 0).flags == 0);
+  // Out of order
+  TEST_ASSERT(tokbuf_token(tb, 5).type == TOKEN_BAD_INTLEN);
+  TEST_ASSERT(tokbuf_token(tb, 0).len == 7);
+  TEST_ASSERT(tokbuf_token(tb, 2).type == TOKEN_BAD_INTCHAR);
+  free_tokbuf(tb);
+
+  size_t biglen = TOKBUF_AUX + 10;
+  char *big = malloc(biglen + 1);
+  TEST_ASSERT(big);
+  memset(big, 's', biglen);
+  big[0] = '"';
+  big[biglen] = '\0';
+  tb = tokenize(big);
+  TEST_ASSERT(tb->count == 2);
+  tok = tokbuf_token(tb, 0);
+  TEST_ASSERT(tok.type == TOKEN_BAD_STRLEN);
+  TEST_ASSERT(tok.len == biglen);
+  TEST_ASSERT(tokbuf_token(tb, 1).start == big + biglen);
+  free_tokbuf(tb);
+  free(big);
+
+  const char *programs[] = {
+    "",
+    "1 2 3",
+    "def f = λ(a, b) { // comment\n let x = a; add(x, b) }",
+    "{ let x = 1; let y = 2 {mul(x, y)}; cond (zero?(x) => 1) (true => 2) }",
+    "f(a)(b)(c) \"str\\n\" -12 lambda(x) {x}(3)",
+    "x = 5 y = f(x, 1,) {a; b;}",
+    "def = ; (1, 2) } ) ,",
+    "cond (a => b => c)",
+    "\"unterminated string",
+    "{ def x = 1; 1a; x }",
+    "let f = lambda (n, m) { add(n, m) } f(1, 2",
+  };
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+    compare_parse_paths(programs[k]);
+
+  for (int i = 1; i <= fuzziters; i++) {
+    generate_random_program(in);
+    compare_parse_paths(in);
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Streaming");
+
+  lexstream *ls = lexstream_new();
+  TEST_ASSERT(!lexstream_next(ls, &tok));
+  lexstream_feed(ls, "f(x", 3);
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_IDENTIFIER));
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_OPENPAREN));
+  TEST_ASSERT(!lexstream_next(ls, &tok));	// maybe "x" is not all of it
+  lexstream_feed(ls, ")", 1);
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_IDENTIFIER));
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_CLOSEPAREN));
+  TEST_ASSERT(!lexstream_next(ls, &tok));
+  lexstream_feed(ls, "\"a\xce", 3);	// half of a λ
+  TEST_ASSERT(!lexstream_next(ls, &tok));
+  lexstream_feed(ls, "\xbb\"", 2);
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_STRING));
+  TEST_ASSERT((tok.len == 5) && (ls->offset + (tok.start - ls->buf) == 4));
+  lexstream_feed(ls, "=", 1);
+  TEST_ASSERT(!lexstream_next(ls, &tok));	// maybe =>
+  lexstream_finish(ls);
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_EQUALS));
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_EOF));
+  TEST_ASSERT(lexstream_next(ls, &tok) && (tok.type == TOKEN_EOF));
+  lexstream_free(ls);
+
+  // Split every kind of token at every place
+  const char *streamed[] = {
+    "def f = λ(a, b) { // comment\n let x = a; add(x, b) }",
+    "\"a string with \\\"escapes\\\" and λ\" 12345678901234567890 -9 +x",
+    "λλλ(λx, λy) {λxλ(λyλ, λ→λ, λ≠λ)}; \"\xce\" abc\xce\x07 => = =>",
+    "   \t\n   // a comment at the end",
+    "\"unterminated λ",
+    "a//b\nx/y/ /z \"\\\\\" \"x\\\"\" -1//\n///\n",
+  };
+  for (size_t k = 0; k < sizeof(streamed) / sizeof(streamed[0]); k++)
+    for (int maxchunk = 1; maxchunk < 8; maxchunk++)
+      for (int trial = 0; trial < 10; trial++)
+	compare_streamed(streamed[k], maxchunk);
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+    compare_streamed(programs[k], 4);
+  for (int i = 1; i <= fuzziters / 5; i++) {
+    generate_random_program(in);
+    compare_streamed(in, 1 + random_in(200));
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Length-bounded input");
+
+  // The end pointer is EOF, whatever follows it
+  SET("f(1, 2) g(3)");
+  end = in;
+  a = read_program_n(symbols, &end, in + 7);
+  TEST_ASSERT(a && ast_listp(a) && (a->subtype == AST_APP));
+  TEST_ASSERT(end == in + 7);
+  free_ast(a);
+  TEST_ASSERT(read_program_n(symbols, &end, in + 7) == NULL);
+  TEST_ASSERT(end == in + 7);
+  a = read_program_n(symbols, &end, in + 11);
+  TEST_ASSERT(a && ast_errorp(a));
+  free_ast(a);
+  end = in + 5;
+  tok = read_token_n(&end, in + 6);
+  TEST_ASSERT((tok.type == TOKEN_INTEGER) && (tok.len == 1) && (end == in + 6));
+  tok = read_token_n(&end, in + 6);
+  TEST_ASSERT((tok.type == TOKEN_EOF) && (tok.start == in + 6));
+  // A string, comment, or arrow that is cut off
+  SET("\"abc\" // x\n =>");
+  end = in;
+  tok = read_token_n(&end, in + 4);
+  TEST_ASSERT((tok.type == TOKEN_BAD_STREOF) && (end == in + 4));
+  end = in + 6;
+  tok = read_token_n(&end, in + 7);
+  TEST_ASSERT((tok.type == TOKEN_IDENTIFIER) && (tok.len == 1));
+  end = in + 12;
+  tok = read_token_n(&end, in + 13);
+  TEST_ASSERT((tok.type == TOKEN_EQUALS) && (end == in + 13));
+
+  // A NUL before the end is an error, not EOF
+  memcpy(in, "ab\0cd \"x\0y\" // c\0d", 18);
+  end = in;
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_IDENTIFIER) && (tok.len == 2));
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_BAD_CHAR) && (tok.len == 1) && (tok.pos == 0));
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_IDENTIFIER) && (tok.len == 2));
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT(tok.type == TOKEN_WS);
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_BAD_STRCHAR) && (tok.len == 5) && (tok.pos == 2));
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT(tok.type == TOKEN_WS);
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_COMMENT) && (tok.len == 4));
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT(tok.type == TOKEN_BAD_CHAR);
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_IDENTIFIER) && (tok.len == 1));
+  tok = read_token_n(&end, in + 18);
+  TEST_ASSERT((tok.type == TOKEN_EOF) && (end == in + 18));
+  end = in;
+  a = read_program_n(symbols, &end, in + 18);
+  TEST_ASSERT(a && ast_identifierp(a));
+  free_ast(a);
+  a = read_program_n(symbols, &end, in + 18);
+  TEST_ASSERT(a && ast_errorp(a));
+  free_ast(a);
+
+  // Nothing may be read past the end, which is the end of a page
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+    compare_bounded(programs[k]);
+  for (int i = 1; i <= fuzziters / 5; i++) {
+    generate_random_program(in);
+    compare_bounded(in);
+  }
+  // Every kind of token, cut off at the end, at every alignment
+  const char *endings[] = {
+    "abc", "λx", "12345678901234567", "-1", "\"str\"", "\"unterminated",
+    "\"esc\\", "// comment", "   \t ", "=", "=>", "/", "\"caf\xc3",
+  };
+  for (size_t k = 0; k < sizeof(endings) / sizeof(endings[0]); k++)
+    for (int offset = 0; offset < 64; offset++) {
+      memset(in, ' ', offset);
+      strcpy(in + offset, endings[k]);
+      compare_bounded(in);
+    }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Parallel tokenizing");
+
+  // Every chunk size, down to a chunk for every line
+  const size_t chunksizes[] = {1, 2, 5, 16, 100, 0};
+  for (size_t j = 0; j < sizeof(chunksizes) / sizeof(chunksizes[0]); j++)
+    for (int nthreads = 1; nthreads <= 4; nthreads++) {
+      for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+	compare_parallel(programs[k], nthreads, chunksizes[j]);
+      for (size_t k = 0; k < sizeof(streamed) / sizeof(streamed[0]); k++)
+	compare_parallel(streamed[k], nthreads, chunksizes[j]);
+    }
+  for (int i = 1; i <= fuzziters / 50; i++) {
+    generate_random_program(in);
+    compare_parallel(in, 1 + random_in(4), random_in(200));
+    generate_multiline_program(in, BUFSIZE);
+    compare_parallel(in, 1 + random_in(4), random_in(200));
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Line index");
+
+  // Errors are located by line and column, in characters
+  const char *located[] = {
+    "f(1,\n  2,,3)",
+    "def x = 1\n\n  λ(a b) {x}",
+    "{ \"line\none\"; \"λλ\"; λ(λ, 1) }",
+    "// a comment\n{ a; b;\n\n",
+    "f(1,\n2",
+  };
+  const size_t located_at[][2] = {{2, 5}, {3, 7}, {2, 16}, {4, 1}, {2, 2}};
+  for (size_t k = 0; k < sizeof(located) / sizeof(located[0]); k++) {
+    const char *input = located[k];
+    end = input;
+    while ((a = read_program(symbols, &end)) && !ast_errorp(a)) free_ast(a);
+    TEST_ASSERT(a && ast_errorp(a));
+    TEST_ASSERT(a->error->line == located_at[k][0]);
+    TEST_ASSERT(a->error->col == located_at[k][1]);
+    TEST_ASSERT(a->error->line_start <= a->start);
+    ast *copy = ast_copy(a);
+    TEST_ASSERT((copy->error->line == a->error->line)
+		&& (copy->error->col == a->error->col));
+    free_ast(copy);
+    free_ast(a);
+  }
+
+  // From a token buffer, lines count from the start of the input
+  SET("f(1)\ng(2)\n\nh(3,,4)");
+  tb = tokenize(in);
+  end = in;
+  for (int k = 0; k < 3; k++) {
+    a = read_program_tokens(symbols, tb, &end);
+    TEST_ASSERT(a);
+    if (k < 2) TEST_ASSERT(!ast_errorp(a));
+    else TEST_ASSERT(ast_errorp(a) && (a->error->line == 4)
+		     && (a->error->col == 5));
+    free_ast(a);
+  }
+  free_tokbuf(tb);
+
+  // And a read that starts partway through counts from there
+  end = in + 5;
+  a = read_program(symbols, &end);
+  TEST_ASSERT(a && !ast_errorp(a));
+  free_ast(a);
+  a = read_program(symbols, &end);
+  TEST_ASSERT(a && ast_errorp(a) && (a->error->line == 3) && (a->error->col == 5));
+  free_ast(a);
+
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++) {
+    tb = tokenize(programs[k]);
+    check_lines(tb, programs[k]);
+    free_tokbuf(tb);
+  }
+  for (int i = 1; i <= fuzziters / 50; i++) {
+    generate_multiline_program(in, BUFSIZE);
+    tb = tokenize(in);
+    check_lines(tb, in);
+    free_tokbuf(tb);
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Identifier interning");
+
+  // Every occurrence of a name is the same string
+  SET("fact(mul(n, fact(sub(n, 1))), n)");
+  end = in;
+  a = read_program(symbols, &end);
+  TEST_ASSERT(a && !ast_errorp(a));
+  char *seen = NULL;
+  TEST_ASSERT(count_interned(a, "fact", &seen) == 2);
+  seen = NULL;
+  TEST_ASSERT(count_interned(a, "n", &seen) == 3);
+  free_ast(a);
+
+  char *sym = intern(symbols, "add", 3);
+  TEST_ASSERT(strcmp(sym, "add") == 0);
+  TEST_ASSERT(intern(symbols, "addition", 3) == sym);
+  TEST_ASSERT(intern(symbols, "add", 3) == intern(symbols, "add", 3));
+  TEST_ASSERT(intern(symbols, "ad", 2) != sym);
+  TEST_ASSERT(intern(symbols, "λ", strlen("λ")) == intern(symbols, "λ", strlen("λ")));
+  size_t nsyms = symtab_count(symbols);
+  intern(symbols, "add", 3);
+  TEST_ASSERT(symtab_count(symbols) == nsyms);
+
+  // Through growth of the table, every name stays put
+  char name[16];
+  char *first = intern(symbols, "sym0_", 5);
+  for (int i = 0; i < 5000; i++) {
+    snprintf(name, sizeof(name), "sym%d_", i);
+    TEST_ASSERT(strcmp(intern(symbols, name, strlen(name)), name) == 0);
+  }
+  TEST_ASSERT(symtab_count(symbols) >= nsyms + 5000 - 1);
+  TEST_ASSERT(intern(symbols, "sym0_", 5) == first);
+  snprintf(name, sizeof(name), "sym%d_", 4999);
+  TEST_ASSERT(intern(symbols, name, strlen(name)) == intern(symbols, "sym4999_", 8));
+
+  // Copies share the name, and equality does not look at the bytes
+  SET("f(a, b, a)");
+  end = in;
+  a = read_program(symbols, &end);
+  ast *copy = ast_copy(a);
+  TEST_ASSERT(ast_equal(a, copy));
+  seen = NULL;
+  TEST_ASSERT(count_interned(a, "a", &seen) == 2);
+  TEST_ASSERT(count_interned(copy, "a", &seen) == 2);
+  free_ast(copy);
+  SET("f(a, b, c)");
+  end = in;
+  copy = read_program(symbols, &end);
+  TEST_ASSERT(!ast_equal(a, copy));
+  free_ast(copy);
+  free_ast(a);
+
+  // A new table starts empty, and parsing into it leaves the others
+  // alone
+  nsyms = symtab_count(symbols);
+  symtab *other = new_symtab();
+  TEST_ASSERT(symtab_count(other) == 0);
+  SET("g(x, x)");
+  end = in;
+  a = read_program(other, &end);
+  TEST_ASSERT(a && (symtab_count(other) == 2));
+  TEST_ASSERT(symtab_count(symbols) == nsyms);
+  seen = NULL;
+  TEST_ASSERT(count_interned(a, "x", &seen) == 2);
+  TEST_ASSERT(seen != intern(symbols, "x", 1));
+  // Across tables, the names are compared, not their pointers
+  end = in;
+  copy = read_program(symbols, &end);
+  TEST_ASSERT(!ast_equal(a, copy));
+  TEST_ASSERT(ast_equal_across(a, copy) && ast_equal_across(copy, a));
+  free_ast(copy);
+  SET("g(x, y)");
+  copy = read_program(symbols, &end);
+  TEST_ASSERT(!ast_equal_across(a, copy));
+  free_ast(copy);
+
+  // Threads parse at the same time, each into a table of its own
+  interning jobs[4];
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++) {
+    jobs[t] = (interning) {.input = "f(x, y, x)"};
+    TEST_ASSERT(pthread_create(&threads[t], NULL, intern_in_thread, &jobs[t]) == 0);
+  }
+  for (int t = 0; t < 4; t++) {
+    TEST_ASSERT(pthread_join(threads[t], NULL) == 0);
+    TEST_ASSERT(jobs[t].nsymbols == 3);
+    TEST_ASSERT(jobs[t].x != seen);
+  }
+  TEST_ASSERT(symtab_count(other) == 2);
+  free_ast(a);
+  free_symtab(other);
+
+  // Nodes and names from an arena, as in batch mode, make the same
+  // trees.  free_ast() frees only their strings and error details, and
+  // a reset arena is used again.
+  arena *pool = new_arena(256);
+  const char *arena_inputs[] = {"f(x, \"s\\n\", 12); g(\"t\", x)",
+				"h(\"abc\", ",
+				"let y = 99999999999999999999 in y"};
+  for (int round = 0; round < 2; round++) {
+    for (size_t i = 0; i < sizeof(arena_inputs) / sizeof(char *); i++) {
+      SET(arena_inputs[i]);
+      end = in;
+      copy = read_program(symbols, &end);
+      other = new_symtab_in(pool);
+      ast_use_arena(pool);
+      end = in;
+      a = read_program(other, &end);
+      TEST_ASSERT(ast_equal_across(a, copy));
+      TEST_ASSERT(intern(other, "x", 1) == intern(other, "x", 1));
+      free_ast(a);
+      ast_use_arena(NULL);
+      free_symtab(other);
+      free_ast(copy);
+    }
+    arena_reset(pool);
+  }
+  // A name longer than a chunk gets a chunk of its own
+  other = new_symtab_in(pool);
+  char longname[1000];
+  memset(longname, 'q', sizeof(longname));
+  char *q = intern(other, longname, sizeof(longname));
+  TEST_ASSERT((strlen(q) == sizeof(longname)) && (q[0] == 'q'));
+  TEST_ASSERT(intern(other, longname, sizeof(longname)) == q);
+  free_symtab(other);
+  free_arena(pool);
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Table-driven lexer");
+
+  // Every input of up to 4 of these bytes
+  const char alphabet[] = "al\xce\xbb/\"\\ \n(=>+1\x01\x80\xe2";
+  size_t nbytes = sizeof(alphabet);	// with the NUL
+  for (size_t width = 0; width <= 4; width++) {
+    size_t count = 1;
+    for (size_t j = 0; j < width; j++) count *= nbytes;
+    for (size_t k = 0; k < count; k++) {
+      size_t code = k;
+      for (size_t j = 0; j < width; j++) {
+	in[j] = alphabet[code % nbytes];
+	code /= nbytes;
+      }
+      in[width] = '\0';
+      compare_backends(in, width);
+    }
+  }
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+    compare_backends(programs[k], strlen(programs[k]));
+  for (size_t k = 0; k < sizeof(streamed) / sizeof(streamed[0]); k++)
+    compare_backends(streamed[k], strlen(streamed[k]));
+  for (size_t k = 0; k < sizeof(endings) / sizeof(endings[0]); k++)
+    compare_backends(endings[k], strlen(endings[k]));
+  for (int i = 1; i <= fuzziters / 10; i++) {
+    generate_random_program(in);
+    compare_backends(in, strlen(in));
+    generate_multiline_program(in, BUFSIZE);
+    compare_backends(in, strlen(in));
+    compare_backends(in, generate_token_soup(in, BUFSIZE));
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Structural index");
+
+  SET("f(a, \"(,)\" // (,\"\n , {x = y}) ;");
+  structindex *si = structural_index(in, NULL);
+  TEST_ASSERT(si->exact && (si->count == 8));
+  TEST_ASSERT((si->positions[0] == 1) && (si->positions[1] == 3));
+  TEST_ASSERT(in[si->positions[2]] == ',');
+  TEST_ASSERT(structindex_partner(si, 0) == 6);
+  TEST_ASSERT(structindex_partner(si, 6) == 0);
+  TEST_ASSERT(structindex_partner(si, 3) == 5);
+  TEST_ASSERT(structindex_partner(si, 1) == STRUCTINDEX_NONE);
+  TEST_ASSERT(structindex_partner(si, 8) == STRUCTINDEX_NONE);
+  TEST_ASSERT(structindex_find(si, in) == 0);
+  TEST_ASSERT(structindex_find(si, in + 2) == 1);
+  TEST_ASSERT(structindex_find(si, in + strlen(in)) == 8);
+  free_structindex(si);
+  TEST_ASSERT(compare_structural(in, strlen(in)));
+
+  // Escaped quotes, and escaped backslashes before a closing quote
+  SET("\"a\\\"(\" ( \"b\\\\\" ) \"\\\\\\\"\" =>");
+  si = structural_index(in, NULL);
+  TEST_ASSERT(si->exact && (si->count == 3));
+  TEST_ASSERT(structindex_partner(si, 0) == 1);
+  free_structindex(si);
+  TEST_ASSERT(compare_structural(in, strlen(in)));
+
+  // Brackets that do not match
+  SET(")({ a }} (b) {");
+  si = structural_index(in, NULL);
+  TEST_ASSERT(si->exact && (si->count == 8));
+  TEST_ASSERT(structindex_partner(si, 0) == STRUCTINDEX_NONE);
+  TEST_ASSERT(structindex_partner(si, 1) == STRUCTINDEX_NONE);
+  TEST_ASSERT(structindex_partner(si, 2) == 3);
+  TEST_ASSERT(structindex_partner(si, 4) == STRUCTINDEX_NONE);
+  TEST_ASSERT(structindex_partner(si, 5) == 6);
+  TEST_ASSERT(structindex_partner(si, 6) == 5);
+  TEST_ASSERT(structindex_partner(si, 7) == STRUCTINDEX_NONE);
+  free_structindex(si);
+
+  // Where the lexer would not start a string at a quote
+  SET("f(a\"b\", c)");
+  si = structural_index(in, NULL);
+  TEST_ASSERT(!si->exact);
+  free_structindex(si);
+  in[0] = '"';
+  fill(in + 1, 'x', MAX_STRINGLEN + 1);
+  strcat(in, "\" (\"");
+  si = structural_index(in, NULL);
+  TEST_ASSERT(!si->exact);
+  free_structindex(si);
+  SET("=>\"a\"\"b\"(\"c\")");
+  TEST_ASSERT(compare_structural(in, strlen(in)));
+
+  // Strings, comments, and runs of backslashes across every block
+  // boundary
+  const char *crossings[] = {
+    "x \"(//\\\"\" // \"( \n ( \"\\\\\" )",
+    "{ // a \"comment\" ( with \"quotes\"\n}",
+    "f(\"\\\\\\\\\\\"\", ///\n;)",
+    "( \"//\" , \"a\\\\\" , // \"\n \"\\\"\"=)",
+  };
+  for (size_t k = 0; k < sizeof(crossings) / sizeof(crossings[0]); k++)
+    for (int offset = 0; offset < 140; offset++) {
+      memset(in, ' ', offset);
+      strcpy(in + offset, crossings[k]);
+      TEST_ASSERT(compare_structural(in, strlen(in)));
+      // Cut off anywhere
+      compare_structural(in, offset + random_in(strlen(crossings[k])));
+    }
+
+  int nexact = 0;
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+    nexact += compare_structural(programs[k], strlen(programs[k]));
+  for (size_t k = 0; k < sizeof(streamed) / sizeof(streamed[0]); k++)
+    nexact += compare_structural(streamed[k], strlen(streamed[k]));
+  TEST_ASSERT(nexact > 0);
+  nexact = 0;
+  for (int i = 1; i <= fuzziters / 10; i++) {
+    generate_random_program(in);
+    nexact += compare_structural(in, strlen(in));
+    generate_multiline_program(in, BUFSIZE);
+    nexact += compare_structural(in, strlen(in));
+    nexact += compare_structural(in, generate_token_soup(in, BUFSIZE));
+  }
+  printf("%d of %d random inputs had an exact structural index\n",
+	 nexact, 3 * (fuzziters / 10));
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Lookahead cache");
+
+  // Each token consumed is lexed once.  A token is lexed again only
+  // when a peek is not followed by a read, as after the last token of
+  // an expression, which was 15 lexed for 6 consumed before the cache.
+  parser_stats ps;
+  SET("f(a, b)");
+  reset_parser_statistics();
+  a = read_ast(&state);
+  TEST_ASSERT(a && ast_applicationp(a));
+  free_ast(a);
+  ps = parser_statistics();
+  if (PARSER_STATS) {
+    TEST_ASSERT(ps.lexed == 7);
+    TEST_ASSERT(ps.consumed == 6);
+  } else {
+    TEST_ASSERT((ps.lexed == 0) && (ps.consumed == 0));
+  }
+
+  reset_parser_statistics();
+  int nprograms = 0;
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++)
+    nprograms += compare_parse_paths(programs[k]);
+  ps = parser_statistics();
+  TEST_ASSERT(ps.lexed >= ps.consumed);
+  TEST_ASSERT(ps.lexed - ps.consumed <= (size_t) nprograms);
+  printf("Parsing %d programs lexed %zu tokens and consumed %zu\n",
+	 nprograms, ps.lexed, ps.consumed);
+
+  // The token after an expression is peeked at, and the next read
+  // consumes it from the cache
+  SET("f(x) g");
+  a = read_ast(&state);
+  TEST_ASSERT(a && ast_applicationp(a));
+  free_ast(a);
+  TEST_ASSERT(state.peeked_at == end);
+  TEST_ASSERT(state.peeked.type == TOKEN_IDENTIFIER);
+  a = read_ast(&state);
+  TEST_ASSERT(a && ast_identifierp(a));
+  free_ast(a);
+  TEST_ASSERT(end == in + 6);
+  TEST_ASSERT(read_ast(&state) == NULL);
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Nesting depth");
+
+  // Nested blocks, as deep as allowed and one deeper
+  size_t deep = 100000;
+  char *nested = malloc(2 * deep + 2);
+  TEST_ASSERT(nested);
+  for (size_t depth = MAX_DEPTH; depth <= MAX_DEPTH + 1; depth++) {
+    memset(nested, '{', depth);
+    nested[depth] = 'x';
+    memset(nested + depth + 1, '}', depth);
+    nested[2 * depth + 1] = '\0';
+    end = nested;
+    a = read_program(symbols, &end);
+    TEST_ASSERT(a);
+    if (depth == MAX_DEPTH) {
+      TEST_ASSERT(ast_blockp(a));
+      TEST_ASSERT(*end == '\0');
+    } else {
+      TEST_ASSERT(ast_error_type(a) == ERR_DEPTH);
+      TEST_ASSERT(a->start == nested + MAX_DEPTH);
+    }
+    free_ast(a);
+  }
+
+  // Far deeper than the C stack would allow a recursive parser
+  memset(nested, '{', deep);
+  nested[deep] = '\0';
+  end = nested;
+  a = read_program(symbols, &end);
+  TEST_ASSERT(ast_error_type(a) == ERR_DEPTH);
+  free_ast(a);
+  for (size_t i = 0; i < deep; i++) memcpy(nested + 2 * i, "f(", 2);
+  nested[2 * deep] = '\0';
+  end = nested;
+  a = read_program(symbols, &end);
+  TEST_ASSERT(ast_error_type(a) == ERR_DEPTH);
+  TEST_ASSERT(a->start == nested + 2 * MAX_DEPTH + 1);
+  free_ast(a);
+  // Curried applications, and lets in a block, deepen the AST
+  // without nesting brackets, so they count too
+  nested[0] = 'f';
+  for (size_t i = 0; i < deep; i++) memcpy(nested + 1 + 2 * i, "()", 2);
+  nested[1 + 2 * deep] = '\0';
+  end = nested;
+  a = read_program(symbols, &end);
+  TEST_ASSERT(ast_error_type(a) == ERR_DEPTH);
+  TEST_ASSERT(a->start == nested + 1 + 2 * MAX_DEPTH);
+  free_ast(a);
+  char *lets = malloc(11 * deep + 4);
+  TEST_ASSERT(lets);
+  lets[0] = '{';
+  for (size_t i = 0; i < deep; i++) memcpy(lets + 1 + 11 * i, "let a = 1; ", 11);
+  strcpy(lets + 1 + 11 * deep, "a}");
+  end = lets;
+  a = read_program(symbols, &end);
+  TEST_ASSERT(ast_error_type(a) == ERR_DEPTH);
+  TEST_ASSERT(a->start == lets + 1 + 11 * (MAX_DEPTH / 2 - 1) + 4);
+  free_ast(a);
+  free(lets);
+
+  // A deeper limit than MAX_DEPTH in the pstate, with the parser
+  // stack on the heap
+  size_t depth = 20000;
+  memset(nested, '{', depth);
+  nested[depth] = 'x';
+  memset(nested + depth + 1, '}', depth);
+  nested[2 * depth + 1] = '\0';
+  end = nested;
+  state = (pstate){.input=nested, .astart=nested, .sptr = &end,
+		   .symbols = symbols, .max_depth = depth};
+  a = read_ast(&state);
+  TEST_ASSERT(a && ast_blockp(a));
+  TEST_ASSERT(*end == '\0');
+  for (ast *inner = a; ast_blockp(inner); inner = ast_car(inner)) depth--;
+  TEST_ASSERT(depth == 0);
+  free_ast(a);
+  free(nested);
+
+  // Each kind of nesting counts, a def or let with a block counts
+  // twice, and so does a let that takes the rest of its block
+  struct {const char *input; size_t depth;} nestings[] = {
+    {"f(f(f(f(x))))", 4},
+    {"{a; {b; {c; {d}}}}", 4},
+    {"x = y = z = w = 1", 4},
+    {"def a = def b = def c = def d = 1", 4},
+    {"let a = 1 {let b = 2 {let c = 3 {d}}}", 6},
+    {"{let a = 1; let b = 2; let c = 3; d}", 7},
+    {"f(a)(b)(c)(d)", 4},
+    {"{f()}()()", 3},
+    {"lambda(a) {lambda(b) {lambda(c) {lambda(d) {e}}}}", 4},
+    {"cond (a => cond (b => cond (c => cond (d => e))))", 4},
+  };
+  for (size_t k = 0; k < sizeof(nestings) / sizeof(nestings[0]); k++) {
+    for (size_t max = 1; max <= 8; max++) {
+      SET(nestings[k].input);
+      state.max_depth = max;
+      a = read_ast(&state);
+      TEST_ASSERT(a);
+      if (max < nestings[k].depth)
+	TEST_ASSERT(ast_error_type(a) == ERR_DEPTH);
+      else
+	TEST_ASSERT(!ast_errorp(a));
+      free_ast(a);
+    }
+  }
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Wide lists");
+
+  // Lists are built in order, so check the order and the positions
+  // recorded in every cons (that of its item) and in the terminator
+  size_t width = 4000;
+  char *wide = malloc(width * 16);
+  TEST_ASSERT(wide);
+  for (int kind = 0; kind < 3; kind++) {
+    char *w = wide;
+    w += sprintf(w, "%s", (kind == 0) ? "{" : (kind == 1) ? "f(" : "cond ");
+    for (size_t i = 0; i < width; i++) {
+      if (kind == 0) w += sprintf(w, "%s%zu", i ? "; " : "", i);
+      if (kind == 1) w += sprintf(w, "%s%zu", i ? ", " : "", i);
+      if (kind == 2) w += sprintf(w, "(x => %zu) ", i);
+    }
+    sprintf(w, "%s", (kind == 0) ? "}" : (kind == 1) ? ")" : "");
+    end = wide;
+    state = (pstate){.input=wide, .astart=wide, .sptr = &end,
+		     .symbols = symbols};
+    a = read_ast(&state);
+    TEST_ASSERT(a && !ast_errorp(a));
+    ast *list = (kind == 1) ? ast_cdr(a) : a;
+    const char *list_start = (kind == 1) ? wide + 1 : wide;
+    TEST_ASSERT(ast_length(list) == (int) width);
+    size_t i = 0;
+    for (ast *cell = list; ast_consp(cell); cell = ast_cdr(cell), i++) {
+      ast *item = ast_car(cell);
+      TEST_ASSERT(cell->start == item->start);
+      if (kind == 2) {
+	TEST_ASSERT(ast_clausep(item));
+	item = ast_car(ast_cdr(item));
+      }
+      TEST_ASSERT(ast_integerp(item) && (item->n == (int64_t) i));
+      if (ast_nullp(ast_cdr(cell)))
+	TEST_ASSERT(ast_cdr(cell)->start == list_start);
+    }
+    TEST_ASSERT(i == width);
+    free_ast(a);
+  }
+  free(wide);
+
+  // -----------------------------------------------------------------------------
+  TEST_SECTION("Incremental reparsing");
+
+  // An edit inside a block, or inside the arguments of an application,
+  // parses only that again, and the rest of the tree is kept
+  const char *before_edit = "{def f = λ(a) {add(a, 1)}; print(f(2), g(3))}";
+  source src = {.len = strlen(before_edit), .capacity = BUFSIZE};
+  src.text = xmalloc(src.capacity);
+  TEST_ASSERT(src.text);
+  strcpy(src.text, before_edit);
+  end = src.text;
+  a = read_program_n(symbols, &end, src.text + src.len);
+  TEST_ASSERT(a && ast_blockp(a));
+  ast *def = ast_car(a), *print = ast_car(ast_cdr(a));
+  reset_parser_statistics();
+  size_t at = (size_t) (strstr(src.text, "1)") - src.text);
+  a = reparse_program(symbols, a, &src, (source_edit){at, 1, "10", 2});
+  TEST_ASSERT(strcmp(src.text, "{def f = λ(a) {add(a, 10)}; print(f(2), g(3))}") == 0);
+  TEST_ASSERT(ast_blockp(a));
+  TEST_ASSERT((ast_car(a) == def) && (ast_car(ast_cdr(a)) == print));
+  if (PARSER_STATS) TEST_ASSERT(parser_statistics().reparsed == strlen("(a, 10)"));
+  reset_parser_statistics();
+  at = (size_t) (strstr(src.text, "3)") - src.text);
+  a = reparse_program(symbols, a, &src, (source_edit){at + 1, 0, ", 4", 3});
+  TEST_ASSERT(strcmp(src.text, "{def f = λ(a) {add(a, 10)}; print(f(2), g(3, 4))}") == 0);
+  TEST_ASSERT((ast_car(a) == def) && (ast_car(ast_cdr(a)) == print));
+  if (PARSER_STATS) TEST_ASSERT(parser_statistics().reparsed == strlen("(3, 4)"));
+  ast *g = ast_car(ast_cdr(ast_cdr(print)));
+  TEST_ASSERT(ast_applicationp(g) && (ast_length(g) == 3));
+  TEST_ASSERT(g->start == strstr(src.text, "g(3"));
+
+  // When the enclosing brackets change, everything is parsed again
+  reset_parser_statistics();
+  at = (size_t) (strstr(src.text, "}") - src.text);
+  a = reparse_program(symbols, a, &src, (source_edit){at, 1, "", 0});
+  TEST_ASSERT(ast_errorp(a));
+  if (PARSER_STATS) TEST_ASSERT(parser_statistics().reparsed == src.len);
+  a = reparse_program(symbols, a, &src, (source_edit){at, 0, "}", 1});
+  TEST_ASSERT(ast_blockp(a));
+  TEST_ASSERT(strcmp(src.text, "{def f = λ(a) {add(a, 10)}; print(f(2), g(3, 4))}") == 0);
+  // An unterminated string runs past the close of its block
+  at = (size_t) (strstr(src.text, "a, 10") - src.text);
+  a = reparse_program(symbols, a, &src, (source_edit){at, 0, "\"", 1});
+  end = src.text;
+  ast *full = read_program_n(symbols, &end, src.text + src.len);
+  TEST_ASSERT(ast_errorp(a) && ast_errorp(full));
+  TEST_ASSERT(ast_error_type(a) == ast_error_type(full));
+  TEST_ASSERT(a->start == full->start);
+  free_ast(full);
+  free_ast(a);
+
+  // From empty input, and to it
+  src.len = 0;
+  src.text[0] = '\0';
+  a = reparse_program(symbols, NULL, &src, (source_edit){0, 0, "f(x)", 4});
+  TEST_ASSERT(a && ast_applicationp(a));
+  a = reparse_program(symbols, a, &src, (source_edit){0, 4, "", 0});
+  TEST_ASSERT(!a && (src.len == 0));
+  free(src.text);
+
+  // What comes after an edit is moved lazily, however deep it goes,
+  // and settling it walks the tree without recursing
+  size_t napps = MAX_DEPTH - 2;
+  src.capacity = 3 * napps + 16;
+  src.text = xmalloc(src.capacity);
+  TEST_ASSERT(src.text);
+  strcpy(src.text, "{{x}; f");
+  for (size_t i = 0; i < napps; i++) strcat(src.text, "(1)");
+  strcat(src.text, "}");
+  src.len = strlen(src.text);
+  end = src.text;
+  a = read_program_n(symbols, &end, src.text + src.len);
+  TEST_ASSERT(a && ast_blockp(a));
+  ast *apps = ast_car(ast_cdr(a));
+  const char *f_was = src.text + 6;
+  a = reparse_program_lazy(symbols, a, &src, (source_edit){2, 1, "xyz", 3});
+  TEST_ASSERT(ast_car(ast_cdr(a)) == apps);
+  TEST_ASSERT(ast_cdr(a)->start == src.text + 8);
+  TEST_ASSERT(apps->start == f_was);
+  settle_positions(a);
+  TEST_ASSERT(apps->start == src.text + 8);
+  end = src.text;
+  full = read_program_n(symbols, &end, src.text + src.len);
+  TEST_ASSERT(ast_equal(a, full));
+  TEST_ASSERT(same_positions(a, src.text, full, src.text));
+  free_ast(full);
+  free_ast(a);
+  free(src.text);
+
+  // Identifiers and integers edited inside bodies and argument lists,
+  // with everything after each edit moved by it
+  const local_edit def_edits[] = {
+    {"b)}", 1, "bb"},			// in the arguments of add
+    {"1, 2", 1, "123"},			// in the arguments of f
+    {"y; z", 1, "yy"},			// in the block {y; z}
+    {"3)", 1, "3, 7"},			// adds an argument
+    {"x, {", 3, ""},			// removes one
+    {"a, bb)", 0, "c, "},		// adds one to add
+    {"bb)", 2, "c"},			// shortens one
+  };
+  const local_edit fact_edits[] = {
+    {"1)))", 1, "10"},			// in the arguments of sub
+    {"fact(", 4, "factorial"},		// in the arguments of mul
+    {"h(1", 0, "99, "},			// in the arguments of g
+    {"2; 3", 1, "x"},			// in a block in those
+    {"n) =>", 1, "m"},			// in the arguments of zero?
+  };
+  for (int lazy = 0; lazy <= 1; lazy++) {
+    check_local_edits("{def f = λ(a, b) {add(a, b)}; let x = f(1, 2); "
+		      "print(x, {y; z}(3)); x}",
+		      def_edits, sizeof(def_edits) / sizeof(local_edit), lazy);
+    check_local_edits("{ cond (zero?(n) => 1) (true => mul(n, fact(sub(n, 1)))); "
+		      "g(h(1, {2; 3}), \"s}\") }",
+		      fact_edits, sizeof(fact_edits) / sizeof(local_edit), lazy);
+  }
+
+  // Random edits, mostly to valid programs
+  const char *editable[] = {
+    "{def f = λ(a, b) {add(a, b)}; let x = f(1, 2); print(x, {y; z}(3)); x}",
+    "{ cond (zero?(n) => 1) (true => mul(n, fact(sub(n, 1)))); g(h(1, {2; 3}), \"s}\") }",
+    "f(a, g(b, {c; let d = 1; e(d)}), λ(x) {x})(1)(2, 3)",
+    "{\n  let a = 1 {b(a)};\n  x = {1; 2};\n  def q = 5;\n  {{{{1}}}}\n}",
+    "{ f(); g(h(), // (\n i) }",
+  };
+  size_t neditable = sizeof(editable) / sizeof(editable[0]);
+  reset_parser_statistics();
+  int nedits = 0, nlocal = 0;
+  for (size_t k = 0; k < sizeof(programs) / sizeof(programs[0]); k++) {
+    nlocal += compare_reparse(programs[k], 20);
+    nedits += 20;
+  }
+  for (int i = 1; i <= fuzziters / 10; i++) {
+    nlocal += compare_reparse(editable[random_in(neditable)], 10);
+    nedits += 10;
+    if (i % 10) continue;
+    generate_random_program(in);
+    nlocal += compare_reparse(in, 5);
+    nedits += 5;
+  }
+  if (PARSER_STATS) TEST_ASSERT(nlocal > 0);
+  printf("%d of %d random edits were reparsed in part\n", nlocal, nedits);
 
+  free_symtab(symbols);
   TEST_END();
 }
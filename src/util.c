@@ -27,6 +27,84 @@ void *xmalloc(size_t sz) {
   return malloc(sz);
 }
 
+void *thread_block(pthread_key_t key, size_t size) {
+  void *block = pthread_getspecific(key);
+  if (!block) {
+    block = calloc(1, size);
+    if (!block) PANIC_OOM();
+    if (pthread_setspecific(key, block)) PANIC("failed to set thread data");
+  }
+  return block;
+}
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  char               *free;		// Next unused byte
+  char               *end;
+} arena_chunk;
+
+struct arena {
+  arena_chunk *first;
+  arena_chunk *current;
+  size_t       chunksize;
+};
+
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+static arena_chunk *new_chunk(size_t size) {
+  size_t header = ARENA_ROUND(sizeof(arena_chunk));
+  arena_chunk *c = xmalloc(header + size);
+  if (!c) PANIC_OOM();
+  c->next = NULL;
+  c->free = (char *) c + header;
+  c->end = c->free + size;
+  return c;
+}
+
+arena *new_arena(size_t chunksize) {
+  arena *a = xmalloc(sizeof(arena));
+  if (!a) PANIC_OOM();
+  a->chunksize = ARENA_ROUND(chunksize);
+  a->first = a->current = new_chunk(a->chunksize);
+  return a;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+  if (!a) PANIC_NULL();
+  size = ARENA_ROUND(size);
+  arena_chunk *c = a->current;
+  // A chunk kept by arena_reset() may be too small for this request,
+  // in which case its space goes unused until the next reset
+  while ((size_t) (c->end - c->free) < size) {
+    if (!c->next)
+      c->next = new_chunk((size > a->chunksize) ? size : a->chunksize);
+    c = a->current = c->next;
+  }
+  void *block = c->free;
+  c->free += size;
+  return block;
+}
+
+void arena_reset(arena *a) {
+  if (!a) PANIC_NULL();
+  size_t header = ARENA_ROUND(sizeof(arena_chunk));
+  for (arena_chunk *c = a->first; c; c = c->next)
+    c->free = (char *) c + header;
+  a->current = a->first;
+}
+
+void free_arena(arena *a) {
+  if (!a) return;
+  arena_chunk *c = a->first;
+  while (c) {
+    arena_chunk *next = c->next;
+    free(c);
+    c = next;
+  }
+  free(a);
+}
+
 void __attribute__((unused)) 
 panic_message(const char *filename, int lineno, const char *fmt, ...) {
     va_list ap;
@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 /*
   Configurable:
@@ -48,6 +49,22 @@
 
 void *xmalloc(size_t sz);
 
+// The calling thread's block of 'size' bytes under 'key', zeroed
+// when it is first asked for.  Give the key free() as its destructor.
+void *thread_block(pthread_key_t key, size_t size);
+
+// A bump allocator: arena_alloc() takes the next bytes of the current
+// chunk, aligned for pointers and 64-bit integers, and adds a chunk
+// when that one is full.  Nothing is freed on its own.  arena_reset()
+// takes everything back at once, keeping the chunks for reuse, and
+// free_arena() returns them.  An arena is not locked.
+typedef struct arena arena;
+
+arena *new_arena(size_t chunksize);
+void  *arena_alloc(arena *a, size_t size);
+void   arena_reset(arena *a);
+void   free_arena(arena *a);
+
 /* ----------------------------------------------------------------------------- */
 /* Error handling for runtime errors and code bugs                               */
 /* ----------------------------------------------------------------------------- */